@@ -0,0 +1,903 @@
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "vm.h"
+#include "decode.h"
+#include "compress.h"
+#include "verify.h"
+#include "aot.h"
+
+// Two steps, so VM_AOT_ABI is expanded before it is turned into a string
+#define VM_AOT_STRING(X) VM_AOT_STRING_(X)
+#define VM_AOT_STRING_(X) #X
+
+/*
+ * Emitted in front of the translated code
+ *
+ * Registers live in the locals r0 to r63, r63 holding the flags. Memory is
+ * accessed through m, size and the stack limit are copies of the state.
+ * STEP hands the instruction at IP over to the interpreter. F and U move
+ * the bits of a register into a double and back.
+ * */
+static const char vm_aot_prelude[] =
+  "// Generated by vm --aot, do not edit\n"
+  "#include <math.h>\n"
+  "#include <stdint.h>\n"
+  "#include <string.h>\n"
+  "\n"
+  VM_AOT_STRING(VM_AOT_ABI) "\n"
+  "\n"
+  "#define M8(A) (*(uint8_t *)(m + (A)))\n"
+  "#define M16(A) (*(uint16_t *)(m + (A)))\n"
+  "#define M32(A) (*(uint32_t *)(m + (A)))\n"
+  "#define M64(A) (*(uint64_t *)(m + (A)))\n"
+  "#define SET8(R, V) (R = (R & ~(uint64_t) 0xff) | (uint8_t)(V))\n"
+  "#define SET16(R, V) (R = (R & ~(uint64_t) 0xffff) | (uint16_t)(V))\n"
+  "#define SET32(R, V) (R = (R & ~(uint64_t) 0xffffffff) | (uint32_t)(V))\n"
+  "#define SET64(R, V) (R = (uint64_t)(V))\n"
+  "#define ZERO(V) (r63 = (r63 & ~(uint64_t) 1) | ((V) ? 1 : 0))\n"
+  "#define FITS(SP, N) ((SP) >= (uint64_t) stack_limit + (N) && (SP) <= size)\n"
+  "#define WATCHED(A, N) (((uint64_t)(A) + (N) > watch_low && (A) < watch_high) || \\\n"
+  "                       ((uint64_t)(A) + (N) > vram_low && (A) < vram_high))\n"
+  "#define STEP(IP) { ip = (IP); goto step; }\n"
+  "\n"
+  "static inline double F(uint64_t v) { double d; memcpy(&d, &v, 8); return d; }\n"
+  "static inline uint64_t U(double d) { uint64_t v; memcpy(&v, &d, 8); return v; }\n"
+  "\n";
+
+// Names of the types and accessors of each register width
+static const char* vm_aot_type(uint32_t size) {
+  switch (size) {
+    case 1: return "uint8_t";
+    case 2: return "uint16_t";
+    case 4: return "uint32_t";
+    default: return "uint64_t";
+  }
+}
+
+static uint32_t vm_aot_bits(uint8_t reg) {
+  return vm_reg_size(reg) * 8;
+}
+
+static uint32_t vm_aot_reg(uint8_t reg) {
+  return reg & VM_CODEMASK;
+}
+
+// Registers which are kept in locals of the run function, see vm_loop.h
+static bool vm_aot_plain_reg(uint8_t reg) {
+  uint8_t code = reg & VM_CODEMASK;
+  return code != ((VM_REGIP) & VM_CODEMASK) && code != ((VM_REGFLAGS) & VM_CODEMASK);
+}
+
+/*
+ * Returns the number of register operands of an instruction the translator
+ * handles, -1 if it is left to the interpreter
+ * */
+static int vm_aot_operands(opcode instruction, VMInstruction* inst) {
+  switch (instruction) {
+    case op_push:
+      return inst->a == 1 || inst->a == 2 || inst->a == 4 || inst->a == 8 ? 0 : -1;
+    case op_copyc:
+    case op_jz:
+    case op_jmp:
+    case op_call:
+    case op_ret:
+    case op_nop:
+      return 0;
+    case op_rpush:
+    case op_rpop:
+    case op_loadi:
+    case op_rst:
+    case op_not:
+    case op_load:
+    case op_store:
+    case op_readc:
+    case op_writec:
+    case op_jzr:
+    case op_jmpr:
+    case op_callr:
+    case op_inttofp:
+    case op_sinttofp:
+    case op_fptoint:
+      return vm_aot_plain_reg(inst->r1) ? 1 : -1;
+    case op_mov:
+    case op_add:
+    case op_sub:
+    case op_mul:
+    case op_div:
+    case op_idiv:
+    case op_rem:
+    case op_irem:
+    case op_cmp:
+    case op_lt:
+    case op_gt:
+    case op_ult:
+    case op_ugt:
+    case op_shr:
+    case op_shl:
+    case op_and:
+    case op_xor:
+    case op_or:
+    case op_fadd:
+    case op_fsub:
+    case op_fmul:
+    case op_fdiv:
+    case op_frem:
+    case op_fexp:
+    case op_flt:
+    case op_fgt:
+    case op_loadr:
+    case op_read:
+    case op_write:
+    case op_copy:
+      return vm_aot_plain_reg(inst->r1) && vm_aot_plain_reg(inst->r2) ? 2 : -1;
+
+    // The third register is kept in a, see vm_decode
+    case op_fill:
+      return vm_aot_plain_reg(inst->r1) && vm_aot_plain_reg(inst->r2) && vm_aot_plain_reg(inst->a) ? 3 : -1;
+    default:
+      return -1;
+  }
+}
+
+// Index of a translated instruction, starts is sorted
+static int64_t vm_aot_find(const uint32_t* starts, uint32_t count, uint32_t address) {
+  uint32_t low = 0;
+  uint32_t high = count;
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    if (starts[middle] < address) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  return low < count && starts[low] == address ? (int64_t) low : -1;
+}
+
+// Continues at a constant address, jumps onto translated code check its block first
+static void vm_aot_emit_goto(FILE* out, const uint32_t* starts, uint32_t count, uint32_t address) {
+  if (vm_aot_find(starts, count, address) >= 0) {
+    fprintf(out, "goto C_%08x;", address);
+  } else {
+    fprintf(out, "{ ip = 0x%xu; goto dispatch; }", address);
+  }
+}
+
+// Pushes a stack frame like vm_push_stack_frame, the machine's own push runs if it doesn't fit
+static void vm_aot_emit_frame(FILE* out, uint32_t ip, uint32_t return_address) {
+  fprintf(out, "    { uint32_t sp = (uint32_t) r61;\n");
+  fprintf(out, "      if (!FITS(sp, 8) || WATCHED(sp - 8, 8)) STEP(0x%xu);\n", ip);
+  fprintf(out, "      M32(sp - 8) = (uint32_t) r62; M32(sp - 4) = 0x%xu;\n", return_address);
+  fprintf(out, "      SET32(r61, sp - 8); SET32(r62, sp - 8); }\n");
+}
+
+/*
+ * Emit the translation of a single instruction
+ *
+ * The semantics are the ones of the handlers in vm_loop.h. Whenever a handler
+ * would raise or report a write, the instruction is stepped instead, before it
+ * changed anything. Jumps onto the instruction itself fall through.
+ * */
+static void vm_aot_emit(FILE* out, VM* vm, uint32_t ip, opcode instruction, VMInstruction* inst,
+                        const uint32_t* starts, uint32_t count) {
+  uint32_t target = vm_aot_reg(inst->r1);
+  uint32_t source = vm_aot_reg(inst->r2);
+  uint32_t bits = vm_aot_bits(inst->r1);
+  uint32_t size = vm_reg_size(inst->r1);
+
+  switch (instruction) {
+    case op_mov:
+      fprintf(out, "    SET%u(r%u, r%u);\n", bits, target, source);
+      break;
+    case op_loadi:
+      fprintf(out, "    SET%u(r%u, 0x%llxull);\n", bits, target, (unsigned long long) inst->value);
+      break;
+    case op_rst:
+      fprintf(out, "    SET%u(r%u, 0);\n", bits, target);
+      break;
+
+    case op_add:
+    case op_sub:
+    case op_mul:
+    case op_div:
+    case op_idiv:
+    case op_rem:
+    case op_irem: {
+      const char* format;
+      switch (instruction) {
+        case op_add: format = "r%u + r%u"; break;
+        case op_sub: format = "r%u - r%u"; break;
+        case op_mul: format = "r%u * r%u"; break;
+        case op_div: format = "r%u / r%u"; break;
+        case op_rem: format = "r%u %% r%u"; break;
+        case op_idiv: format = "(uint64_t)((int64_t) r%u / (int64_t) r%u)"; break;
+        default: format = "(uint64_t)((int64_t) r%u %% (int64_t) r%u)"; break;
+      }
+
+      // Division by zero and overflow do whatever the interpreter does
+      if (instruction == op_div || instruction == op_rem) {
+        fprintf(out, "    if (r%u == 0) STEP(0x%xu);\n", source, ip);
+      } else if (instruction == op_idiv || instruction == op_irem) {
+        fprintf(out, "    if (r%u == 0 || (r%u == (uint64_t) INT64_MIN && r%u == (uint64_t) -1)) STEP(0x%xu);\n",
+                source, target, source, ip);
+      }
+
+      fprintf(out, "    { uint64_t v = ");
+      fprintf(out, format, target, source);
+      fprintf(out, "; ZERO(v == 0); SET%u(r%u, v); }\n", bits, target);
+      break;
+    }
+
+    // The result is converted into an integer when it is written back, results
+    // which don't fit into a uint64_t are left to the interpreter's conversion
+    case op_fadd:
+    case op_fsub:
+    case op_fmul:
+    case op_fdiv:
+    case op_frem:
+    case op_fexp: {
+      const char* format;
+      switch (instruction) {
+        case op_fadd: format = "F(r%u) + F(r%u)"; break;
+        case op_fsub: format = "F(r%u) - F(r%u)"; break;
+        case op_fmul: format = "F(r%u) * F(r%u)"; break;
+        case op_fdiv: format = "F(r%u) / F(r%u)"; break;
+        case op_frem: format = "fmod(F(r%u), F(r%u))"; break;
+        default: format = "pow(F(r%u), F(r%u))"; break;
+      }
+
+      fprintf(out, "    { double v = ");
+      fprintf(out, format, target, source);
+      fprintf(out, ";\n      if (!(v >= 0 && v < 18446744073709551616.0)) STEP(0x%xu);\n", ip);
+      fprintf(out, "      ZERO(v == 0); SET%u(r%u, (uint64_t) v); }\n", bits, target);
+      break;
+    }
+    case op_flt:
+      fprintf(out, "    ZERO(F(r%u) < F(r%u));\n", target, source);
+      break;
+    case op_fgt:
+      fprintf(out, "    ZERO(F(r%u) > F(r%u));\n", target, source);
+      break;
+    case op_inttofp:
+      fprintf(out, "    SET%u(r%u, U((double) r%u));\n", bits, target, target);
+      break;
+    case op_sinttofp:
+      fprintf(out, "    SET%u(r%u, U((double)(int64_t) r%u));\n", bits, target, target);
+      break;
+    case op_fptoint:
+      fprintf(out, "    { double v = F(r%u);\n", target);
+      fprintf(out, "      if (!(v >= -9223372036854775808.0 && v < 9223372036854775808.0)) STEP(0x%xu);\n", ip);
+      fprintf(out, "      SET%u(r%u, (int64_t) v); }\n", bits, target);
+      break;
+
+    case op_cmp:
+      fprintf(out, "    ZERO(r%u == r%u);\n", target, source);
+      break;
+    case op_lt:
+      fprintf(out, "    ZERO((int64_t) r%u < (int64_t) r%u);\n", target, source);
+      break;
+    case op_gt:
+      fprintf(out, "    ZERO((int64_t) r%u > (int64_t) r%u);\n", target, source);
+      break;
+    case op_ult:
+      fprintf(out, "    ZERO(r%u < r%u);\n", target, source);
+      break;
+    case op_ugt:
+      fprintf(out, "    ZERO(r%u > r%u);\n", target, source);
+      break;
+
+    // shr shifts left and shl right, the shift count is masked like the host does
+    case op_shr:
+      fprintf(out, "    ZERO((r%u << (r%u & 63)) == 0);\n", target, source);
+      break;
+    case op_shl:
+      fprintf(out, "    ZERO((r%u >> (r%u & 63)) == 0);\n", target, source);
+      break;
+    case op_and:
+      fprintf(out, "    ZERO((r%u & r%u) == 0);\n", target, source);
+      break;
+    case op_xor:
+      fprintf(out, "    ZERO((r%u ^ r%u) == 0);\n", target, source);
+      break;
+    case op_or:
+      fprintf(out, "    ZERO((r%u | r%u) == 0);\n", target, source);
+      break;
+    case op_not:
+      fprintf(out, "    { uint64_t v = ~r%u; ZERO(v == 0); SET%u(r%u, v); }\n", target, bits, target);
+      break;
+
+    case op_load:
+    case op_loadr:
+      if (instruction == op_load) {
+        fprintf(out, "    { uint32_t a = (uint32_t) r62 + 0x%xu;\n", inst->a);
+      } else {
+        fprintf(out, "    { uint32_t a = (uint32_t) r62 + (uint32_t) r%u;\n", source);
+      }
+      fprintf(out, "      if (size - %u < a) STEP(0x%xu);\n", size, ip);
+      fprintf(out, "      SET%u(r%u, M%u(a)); }\n", bits, target, bits);
+      break;
+    case op_store:
+      fprintf(out, "    { uint32_t a = (uint32_t) r62 + 0x%xu;\n", inst->a);
+      fprintf(out, "      if (size - %u < a || WATCHED(a, %u)) STEP(0x%xu);\n", size, size, ip);
+      fprintf(out, "      M%u(a) = (%s) r%u; }\n", bits, vm_aot_type(size), target);
+      break;
+    case op_read:
+      fprintf(out, "    { uint32_t a = (uint32_t) r%u;\n", source);
+      fprintf(out, "      if ((uint64_t) a + %u >= size) STEP(0x%xu);\n", size, ip);
+      fprintf(out, "      SET%u(r%u, M%u(a)); }\n", bits, target, bits);
+      break;
+    case op_readc:
+      if ((uint64_t) inst->a + size >= vm->memory_size) {
+        fprintf(out, "    STEP(0x%xu);\n", ip);
+      } else {
+        fprintf(out, "    SET%u(r%u, M%u(0x%xu));\n", bits, target, bits, inst->a);
+      }
+      break;
+
+    // The width of the source register decides the size of the write
+    case op_write: {
+      uint32_t source_size = vm_reg_size(inst->r2);
+      fprintf(out, "    { uint32_t a = (uint32_t) r%u;\n", target);
+      fprintf(out, "      if ((uint64_t) a + %u >= size || WATCHED(a, %u)) STEP(0x%xu);\n",
+              source_size, source_size, ip);
+      fprintf(out, "      M%u(a) = (%s) r%u; }\n", source_size * 8, vm_aot_type(source_size), source);
+      break;
+    }
+    case op_writec:
+      if ((uint64_t) inst->a + size >= vm->memory_size) {
+        fprintf(out, "    STEP(0x%xu);\n", ip);
+      } else {
+        fprintf(out, "    if (WATCHED(0x%xu, %u)) STEP(0x%xu);\n", inst->a, size, ip);
+        fprintf(out, "    M%u(0x%xu) = (%s) r%u;\n", bits, inst->a, vm_aot_type(size), target);
+      }
+      break;
+
+    // copy only keeps the low byte of its addresses, like the interpreter
+    case op_copy:
+      fprintf(out, "    { uint8_t t = r%u; uint8_t f = r%u;\n", target, source);
+      fprintf(out, "      if ((uint64_t) t + 0x%xu >= size || (uint64_t) f + 0x%xu >= size || WATCHED(t, 0x%xu)) STEP(0x%xu);\n",
+              inst->a, inst->a, inst->a, ip);
+      fprintf(out, "      memmove(m + t, m + f, 0x%xu); }\n", inst->a);
+      break;
+    case op_copyc:
+      if ((uint64_t) inst->a + inst->b >= vm->memory_size || (uint64_t) inst->c + inst->b >= vm->memory_size) {
+        fprintf(out, "    STEP(0x%xu);\n", ip);
+      } else {
+        fprintf(out, "    if (WATCHED(0x%xu, 0x%xu)) STEP(0x%xu);\n", inst->a, inst->b, ip);
+        fprintf(out, "    memmove(m + 0x%xu, m + 0x%xu, 0x%xu);\n", inst->a, inst->c, inst->b);
+      }
+      break;
+    case op_fill:
+      fprintf(out, "    { uint32_t a = (uint32_t) r%u; uint32_t n = (uint32_t) r%u;\n", target, source);
+      fprintf(out, "      if ((uint64_t) a + n >= size || WATCHED(a, n)) STEP(0x%xu);\n", ip);
+      fprintf(out, "      memset(m + a, (uint8_t) r%u, n); }\n", vm_aot_reg(inst->a));
+      break;
+
+    case op_rpush:
+      fprintf(out, "    { uint32_t sp = (uint32_t) r61;\n");
+      fprintf(out, "      if (!FITS(sp, %u) || WATCHED(sp - %u, %u)) STEP(0x%xu);\n", size, size, size, ip);
+      fprintf(out, "      M%u(sp - %u) = (%s) r%u; SET32(r61, sp - %u); }\n",
+              bits, size, vm_aot_type(size), target, size);
+      break;
+    case op_rpop:
+      fprintf(out, "    { uint32_t sp = (uint32_t) r61;\n");
+      fprintf(out, "      if ((uint64_t) sp + %u > size || sp < %u) STEP(0x%xu);\n", size, size, ip);
+      fprintf(out, "      SET32(r61, sp + %u); SET%u(r%u, M%u(sp)); }\n", size, bits, target, bits);
+      break;
+
+    // The pushed bytes are part of the instruction, a write to them makes the block stale
+    case op_push: {
+      uint64_t value = 0;
+      memcpy(&value, vm->memory + ip + 5, inst->a);
+      fprintf(out, "    { uint32_t sp = (uint32_t) r61;\n");
+      fprintf(out, "      if (!FITS(sp, %u) || WATCHED(sp - %u, %u)) STEP(0x%xu);\n", inst->a, inst->a, inst->a, ip);
+      fprintf(out, "      M%u(sp - %u) = 0x%llxull; SET32(r61, sp - %u); }\n",
+              inst->a * 8, inst->a, (unsigned long long) value, inst->a);
+      break;
+    }
+
+    case op_jz:
+      if (inst->a != ip) {
+        fprintf(out, "    if (r63 & 1) ");
+        vm_aot_emit_goto(out, starts, count, inst->a);
+        fprintf(out, "\n");
+      }
+      break;
+    case op_jmp:
+      fprintf(out, "    ");
+      vm_aot_emit_goto(out, starts, count, inst->a == ip ? inst->next : inst->a);
+      fprintf(out, "\n");
+      break;
+    case op_call:
+      vm_aot_emit_frame(out, ip, ip + 5);
+      fprintf(out, "    ");
+      vm_aot_emit_goto(out, starts, count, inst->a == ip ? inst->next : inst->a);
+      fprintf(out, "\n");
+      break;
+
+    // Jumps through registers go through the dispatch switch
+    case op_jzr:
+      fprintf(out, "    if (r63 & 1) { ip = (uint32_t) r%u; if (ip == 0x%xu) ip = 0x%xu; goto dispatch; }\n",
+              target, ip, inst->next);
+      break;
+    case op_jmpr:
+      fprintf(out, "    ip = (uint32_t) r%u; if (ip == 0x%xu) ip = 0x%xu; goto dispatch;\n", target, ip, inst->next);
+      break;
+    case op_callr:
+      fprintf(out, "    { uint32_t t = (uint32_t) r%u;\n", target);
+      vm_aot_emit_frame(out, ip, ip + 2);
+      fprintf(out, "      ip = t == 0x%xu ? 0x%xu : t; goto dispatch; }\n", ip, inst->next);
+      break;
+    case op_ret:
+      fprintf(out, "    { uint32_t base = (uint32_t) r62;\n");
+      fprintf(out, "      if ((uint64_t) base + 12 >= size) STEP(0x%xu);\n", ip);
+      fprintf(out, "      uint32_t sp = base + 12 + M32(base + 8);\n");
+      fprintf(out, "      if (sp >= size) STEP(0x%xu);\n", ip);
+      fprintf(out, "      uint32_t ra = M32(base + 4);\n");
+      fprintf(out, "      SET32(r61, sp); SET32(r62, M32(base));\n");
+      fprintf(out, "      ip = ra == 0x%xu ? 0x%xu : ra; goto dispatch; }\n", ip, inst->next);
+      break;
+
+    case op_nop:
+      break;
+
+    default:
+      fprintf(out, "    STEP(0x%xu);\n", ip);
+      break;
+  }
+}
+
+/*
+ * Translate the code of a freshly flashed machine into C
+ *
+ * The code is verified first (see vm_verify), address receives the offending
+ * address if that fails. instruction_count receives the number of translated
+ * instructions. The source defines VM_AOT_SYMBOL, see vm_aot_compile.
+ * */
+VMError vm_aot_translate(VM* vm, FILE* out, uint32_t* address, uint32_t* instruction_count) {
+  VMError result = vm_verify(vm, address);
+  if (result != vm_err_regular_exit) return result;
+
+  VMVerified* verified = vm->verified;
+  uint32_t capacity = 64;
+  uint32_t count = 0;
+  uint32_t* starts = malloc(capacity * sizeof(uint32_t));
+  if (starts == NULL) return vm_err_allocation;
+
+  for (uint64_t i = verified->low; i < verified->high; i++) {
+    if (!vm_verified(vm, i)) continue;
+
+    if (count == capacity) {
+      uint32_t* grown = realloc(starts, capacity * 2 * sizeof(uint32_t));
+      if (grown == NULL) {
+        free(starts);
+        return vm_err_allocation;
+      }
+
+      starts = grown;
+      capacity *= 2;
+    }
+
+    starts[count++] = i;
+  }
+
+  // Per instruction: its block, whether a constant jump targets it and whether it is stepped
+  uint32_t* block_of = malloc(count * sizeof(uint32_t));
+  uint32_t* block_ranges = malloc(count * 2 * sizeof(uint32_t));
+  bool* targeted = calloc(count, sizeof(bool));
+  if (block_of == NULL || block_ranges == NULL || targeted == NULL) {
+    free(starts);
+    free(block_of);
+    free(block_ranges);
+    free(targeted);
+    return vm_err_allocation;
+  }
+
+  bool used[VM_REGCOUNT] = { false };
+  used[(VM_REGSP) & VM_CODEMASK] = true;
+  used[(VM_REGFP) & VM_CODEMASK] = true;
+  used[(VM_REGFLAGS) & VM_CODEMASK] = true;
+
+  // Blocks are runs of instructions which follow each other in memory
+  uint32_t block_count = 0;
+  size_t code_size = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    VMInstruction inst;
+    opcode instruction = vm->memory[starts[i]];
+    vm_decode(vm, starts[i], instruction, &inst);
+
+    if (block_count == 0 || block_ranges[block_count * 2 - 1] != starts[i]) {
+      block_ranges[block_count * 2] = starts[i];
+      block_count++;
+    }
+
+    block_ranges[block_count * 2 - 1] = inst.next;
+    block_of[i] = block_count - 1;
+    code_size += inst.next - starts[i];
+
+    int operands = vm_aot_operands(instruction, &inst);
+    if (operands >= 1) used[inst.r1 & VM_CODEMASK] = true;
+    if (operands >= 2) used[inst.r2 & VM_CODEMASK] = true;
+    if (operands >= 3) used[inst.a & VM_CODEMASK] = true;
+
+    if (instruction == op_jz || instruction == op_jmp || instruction == op_call) {
+      int64_t index = vm_aot_find(starts, count, inst.a);
+      if (index >= 0) targeted[index] = true;
+    }
+  }
+
+  // The loader compares the bytes of the blocks with the ones it is given
+  uint8_t* code = malloc(code_size);
+  if (code == NULL) {
+    free(starts);
+    free(block_of);
+    free(block_ranges);
+    free(targeted);
+    return vm_err_allocation;
+  }
+
+  size_t copied = 0;
+  for (uint32_t i = 0; i < block_count; i++) {
+    uint32_t block_size = block_ranges[i * 2 + 1] - block_ranges[i * 2];
+    memcpy(code + copied, vm->memory + block_ranges[i * 2], block_size);
+    copied += block_size;
+  }
+
+  uint32_t checksum = exe_crc32(code, code_size);
+  free(code);
+
+  fputs(vm_aot_prelude, out);
+
+  fprintf(out, "static const uint32_t blocks[] = {\n");
+  for (uint32_t i = 0; i < block_count; i++) {
+    fprintf(out, "  0x%xu, 0x%xu,\n", block_ranges[i * 2], block_ranges[i * 2 + 1]);
+  }
+  fprintf(out, "};\n\n");
+
+  fprintf(out, "static void run(VMAotState* s) {\n");
+  fprintf(out, "  uint64_t* regs = s->regs;\n");
+  fprintf(out, "  uint8_t* m = s->memory;\n");
+  fprintf(out, "  const uint8_t* stale = s->stale;\n");
+  fprintf(out, "  uint32_t size = s->memory_size;\n");
+  fprintf(out, "  uint32_t stack_limit = s->stack_limit;\n");
+  fprintf(out, "  uint32_t watch_low = s->watch_low;\n");
+  fprintf(out, "  uint32_t watch_high = s->watch_high;\n");
+  fprintf(out, "  uint32_t vram_low = s->vram_low;\n");
+  fprintf(out, "  uint32_t vram_high = s->vram_high;\n");
+  fprintf(out, "  uint32_t ip = (uint32_t) regs[%u];\n", (VM_REGIP) & VM_CODEMASK);
+  for (uint32_t reg = 0; reg < VM_REGCOUNT; reg++) {
+    if (used[reg]) fprintf(out, "  uint64_t r%u = regs[%u];\n", reg, reg);
+  }
+  fprintf(out, "  goto dispatch;\n\n");
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t ip = starts[i];
+    VMInstruction inst;
+    opcode instruction = vm->memory[ip];
+    vm_decode(vm, ip, instruction, &inst);
+
+    if (targeted[i]) {
+      fprintf(out, "  C_%08x: if (stale[%u]) { ip = 0x%xu; goto leave; }\n", ip, block_of[i], ip);
+    }
+
+    fprintf(out, "  L_%08x:\n", ip);
+    if (vm_aot_operands(instruction, &inst) < 0) {
+      fprintf(out, "    STEP(0x%xu);\n", ip);
+    } else {
+      vm_aot_emit(out, vm, ip, instruction, &inst, starts, count);
+    }
+
+    // Falls through into the next label unless that isn't the following instruction
+    if (i + 1 == count || starts[i + 1] != inst.next) {
+      fprintf(out, "    { ip = 0x%xu; goto dispatch; }\n", inst.next);
+    }
+  }
+
+  // Every translated instruction can be entered through the switch
+  fprintf(out, "\n  dispatch:\n");
+  fprintf(out, "  switch (ip) {\n");
+  for (uint32_t i = 0; i < count; i++) {
+    fprintf(out, "    case 0x%xu: if (stale[%u]) goto leave; goto L_%08x;\n", starts[i], block_of[i], starts[i]);
+  }
+  fprintf(out, "    default: goto leave;\n");
+  fprintf(out, "  }\n\n");
+
+  // Writes the locals back, the instruction pointer register only holds 32 bits
+  fprintf(out, "  step:\n");
+  for (uint32_t reg = 0; reg < VM_REGCOUNT; reg++) {
+    if (used[reg]) fprintf(out, "  regs[%u] = r%u;\n", reg, reg);
+  }
+  fprintf(out, "  *(uint32_t *)(regs + %u) = ip;\n", (VM_REGIP) & VM_CODEMASK);
+  fprintf(out, "  s->step(s);\n");
+  fprintf(out, "  if (s->leave) return;\n");
+  for (uint32_t reg = 0; reg < VM_REGCOUNT; reg++) {
+    if (used[reg]) fprintf(out, "  r%u = regs[%u];\n", reg, reg);
+  }
+  fprintf(out, "  ip = (uint32_t) regs[%u];\n", (VM_REGIP) & VM_CODEMASK);
+  fprintf(out, "  goto dispatch;\n\n");
+
+  fprintf(out, "  leave:\n");
+  for (uint32_t reg = 0; reg < VM_REGCOUNT; reg++) {
+    if (used[reg]) fprintf(out, "  regs[%u] = r%u;\n", reg, reg);
+  }
+  fprintf(out, "  *(uint32_t *)(regs + %u) = ip;\n", (VM_REGIP) & VM_CODEMASK);
+  fprintf(out, "}\n\n");
+
+  fprintf(out, "const VMAotModule %s = {\n", VM_AOT_SYMBOL);
+  fprintf(out, "  %u, 0x%xu, %u, 0x%08xu, blocks, run\n", VM_AOT_VERSION, vm->memory_size, block_count, checksum);
+  fprintf(out, "};\n");
+
+  free(starts);
+  free(block_of);
+  free(block_ranges);
+  free(targeted);
+
+  *instruction_count = count;
+  return ferror(out) ? vm_err_internal_failure : vm_err_regular_exit;
+}
+
+/*
+ * Compile a translated source into a shared object
+ *
+ * Runs $CC, or VM_AOT_CC if it isn't set. $CC is split into words like a
+ * shell would without quoting, so values like "ccache gcc" work. Returns
+ * vm_err_compile_failed if the compiler couldn't be started or didn't
+ * succeed.
+ * */
+VMError vm_aot_compile(const char* source, const char* output) {
+  // pow and fmod are left to the C library at runtime, like in the interpreter
+  static const char* const flags[] = {
+    "-O2", "-shared", "-fPIC", "-fno-strict-aliasing", "-ffp-contract=off",
+    "-fno-builtin-pow", "-fno-builtin-fmod", "-w", "-o", NULL, "-x", "c", NULL, "-lm"
+  };
+  const size_t flag_count = sizeof(flags) / sizeof(flags[0]);
+
+  const char* compiler = getenv("CC");
+  if (compiler == NULL || compiler[0] == '\0') compiler = VM_AOT_CC;
+
+  char* words = strdup(compiler);
+  char** argv = malloc((strlen(compiler) / 2 + 1 + flag_count + 1) * sizeof(char*));
+  if (words == NULL || argv == NULL) {
+    free(words);
+    free(argv);
+    return vm_err_allocation;
+  }
+
+  size_t argc = 0;
+  for (char* word = strtok(words, " \t\n"); word != NULL; word = strtok(NULL, " \t\n")) {
+    argv[argc++] = word;
+  }
+
+  if (argc == 0) {
+    free(words);
+    free(argv);
+    return vm_err_compile_failed;
+  }
+
+  for (size_t i = 0; i < flag_count; i++) {
+    argv[argc + i] = (char*) flags[i];
+  }
+  argv[argc + 9] = (char*) output;
+  argv[argc + 12] = (char*) source;
+  argv[argc + flag_count] = NULL;
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    execvp(argv[0], argv);
+    _exit(127);
+  }
+
+  free(words);
+  free(argv);
+  if (pid < 0) return vm_err_compile_failed;
+
+  int status;
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    return vm_err_compile_failed;
+  }
+
+  return vm_err_regular_exit;
+}
+
+/*
+ * Translate the flashed machine and compile it into output
+ *
+ * The source only lives in a temporary file while it is compiled. address
+ * and instruction_count receive what vm_aot_translate gives them.
+ * */
+VMError vm_aot_build(VM* vm, const char* output, uint32_t* address, uint32_t* instruction_count) {
+  char source[] = "/tmp/vm-aot-XXXXXX";
+  int fd = mkstemp(source);
+  if (fd < 0) return vm_err_internal_failure;
+
+  FILE* fp = fdopen(fd, "w");
+  if (fp == NULL) {
+    close(fd);
+    unlink(source);
+    return vm_err_internal_failure;
+  }
+
+  VMError result = vm_aot_translate(vm, fp, address, instruction_count);
+  if (fclose(fp) != 0 && result == vm_err_regular_exit) {
+    result = vm_err_internal_failure;
+  }
+
+  if (result == vm_err_regular_exit) {
+    result = vm_aot_compile(source, output);
+  }
+
+  unlink(source);
+  return result;
+}
+
+/*
+ * Checks a module against the flashed machine
+ *
+ * The blocks have to be sorted, inside memory and hold the bytes
+ * they were translated from
+ * */
+static bool vm_aot_matches(VM* vm, const VMAotModule* module) {
+  if (module->version != VM_AOT_VERSION || module->memory_size != vm->memory_size || module->block_count == 0) {
+    return false;
+  }
+
+  uint64_t code_size = 0;
+  uint32_t previous_end = 0;
+  for (uint32_t i = 0; i < module->block_count; i++) {
+    uint32_t start = module->blocks[i * 2];
+    uint32_t end = module->blocks[i * 2 + 1];
+    if (start < previous_end || end <= start || end > vm->memory_size) return false;
+
+    code_size += end - start;
+    previous_end = end;
+  }
+
+  uint8_t* code = malloc(code_size);
+  if (code == NULL) return false;
+
+  size_t copied = 0;
+  for (uint32_t i = 0; i < module->block_count; i++) {
+    uint32_t block_size = module->blocks[i * 2 + 1] - module->blocks[i * 2];
+    memcpy(code + copied, vm->memory + module->blocks[i * 2], block_size);
+    copied += block_size;
+  }
+
+  bool matches = exe_crc32(code, code_size) == module->checksum;
+  free(code);
+  return matches;
+}
+
+// Runs a single instruction for the module, see VM_AOT_ABI
+static void vm_aot_step(VMAotState* state) {
+  VM* vm = state->vm;
+  vm_cycle(vm);
+  state->leave = !vm->running;
+}
+
+/*
+ * Load a compiled module into a flashed machine
+ *
+ * Has to be called after vm_flash. Returns vm_err_invalid_module if the
+ * module can't be opened or wasn't translated from the flashed executable.
+ * */
+VMError vm_aot_load(VM* vm, const char* path) {
+  vm_aot_clean(vm);
+
+  // dlopen only searches the library path for names without a slash
+  char* local_path = NULL;
+  if (strchr(path, '/') == NULL) {
+    local_path = malloc(strlen(path) + 3);
+    if (local_path == NULL) return vm_err_allocation;
+    strcpy(local_path, "./");
+    strcat(local_path, path);
+  }
+
+  void* handle = dlopen(local_path ? local_path : path, RTLD_NOW | RTLD_LOCAL);
+  free(local_path);
+  if (handle == NULL) return vm_err_invalid_module;
+
+  const VMAotModule* module = dlsym(handle, VM_AOT_SYMBOL);
+  if (module == NULL || !vm_aot_matches(vm, module)) {
+    dlclose(handle);
+    return vm_err_invalid_module;
+  }
+
+  VMAot* aot = malloc(sizeof(VMAot));
+  uint8_t* stale = calloc(module->block_count, sizeof(uint8_t));
+  if (aot == NULL || stale == NULL) {
+    free(aot);
+    free(stale);
+    dlclose(handle);
+    return vm_err_allocation;
+  }
+
+  aot->handle = handle;
+  aot->module = module;
+  aot->stale = stale;
+  memset(&aot->state, 0, sizeof(VMAotState));
+  aot->state.stale = stale;
+  aot->state.vm = vm;
+  aot->state.step = vm_aot_step;
+  vm->aot = aot;
+  return vm_err_regular_exit;
+}
+
+/*
+ * Unload the module
+ * */
+void vm_aot_clean(VM* vm) {
+  if (vm->aot == NULL) return;
+
+  dlclose(vm->aot->handle);
+  free(vm->aot->stale);
+  free(vm->aot);
+  vm->aot = NULL;
+}
+
+/*
+ * Run the machine on its module until it stops
+ *
+ * Whenever the module returns, the interpreter executes the instruction it
+ * stopped at. The module doesn't report its writes to the decode cache, so
+ * the cache is flushed first and stays empty, vm_cycle doesn't use it.
+ * */
+void vm_aot_run(VM* vm) {
+  VMAot* aot = vm->aot;
+  const VMAotModule* module = aot->module;
+  VMAotState* state = &aot->state;
+
+  vm_decode_flush(vm);
+
+  // Writes to translated or verified code and to a streamed VRAM are stepped
+  state->regs = vm->regs;
+  state->memory = vm->memory;
+  state->memory_size = vm->memory_size;
+  state->stack_limit = vm->stack_limit;
+  state->watch_low = module->blocks[0];
+  state->watch_high = module->blocks[module->block_count * 2 - 1];
+  if (vm->verified) {
+    if (vm->verified->low < state->watch_low) state->watch_low = vm->verified->low;
+    if (vm->verified->high > state->watch_high) state->watch_high = vm->verified->high;
+  }
+  state->vram_low = vm->framebuffer ? VM_VRAM : 0;
+  state->vram_high = vm->framebuffer ? VM_VRAM + VM_VRAMSIZE : 0;
+  state->leave = 0;
+
+  while (vm->running) {
+    module->run(state);
+    if (!vm->running) break;
+    vm_cycle(vm);
+  }
+}
+
+/*
+ * Mark the blocks overlapping with a write as stale
+ *
+ * Called by vm_memory_written, the module doesn't enter them anymore
+ * */
+void vm_aot_written(VM* vm, uint32_t address, uint32_t size) {
+  const VMAotModule* module = vm->aot->module;
+  const uint32_t* blocks = module->blocks;
+  uint64_t end = (uint64_t) address + size;
+  if (address >= blocks[module->block_count * 2 - 1] || end <= blocks[0]) return;
+
+  // First block which ends after the address
+  uint32_t low = 0;
+  uint32_t high = module->block_count;
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    if (blocks[middle * 2 + 1] <= address) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  for (uint32_t i = low; i < module->block_count && blocks[i * 2] < end; i++) {
+    vm->aot->stale[i] = 1;
+  }
+}
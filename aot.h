@@ -0,0 +1,101 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "vm.h"
+
+#ifndef AOTH
+#define AOTH
+
+/*
+ * Ahead-of-time translation of verified programs into native modules
+ *
+ * vm_aot_translate writes the code vm_verify found as a single C function:
+ * every instruction gets a label, constant jumps become gotos and jumps through
+ * registers and returns go through a switch over guest addresses. Registers
+ * live in locals of that function. The source is compiled into a shared object
+ * (vm_aot_compile), which vm_aot_load opens with dlopen.
+ *
+ * Instructions the translator doesn't handle (syscalls, loads and stores of
+ * whole blocks, cmpmem and findb, operands naming the instruction pointer or
+ * the flags) are run by the interpreter through the step callback without
+ * leaving the module. So are accesses which would fault, floating-point
+ * results which don't convert into an integer and writes which somebody has to
+ * see, i.e. writes into translated code or VRAM with a framebuffer. Jumps to
+ * addresses which weren't translated leave the module, vm_aot_run interprets
+ * an instruction and enters it again.
+ *
+ * Translated code is split into blocks of consecutive instructions. A write
+ * into a block marks it stale (see vm_aot_written), the module doesn't enter
+ * it anymore and the interpreter runs that code from then on.
+ * */
+
+// Bumped whenever VM_AOT_ABI or the generated code changes
+#define VM_AOT_VERSION 1
+
+// Name of the VMAotModule a compiled module exports
+#define VM_AOT_SYMBOL "vm_aot_module"
+
+// Compiler used by vm_aot_compile if $CC isn't set
+#define VM_AOT_CC "cc"
+
+/*
+ * Types shared between the runtime and the generated code
+ *
+ * The generated source gets the stringified macro (see vm_aot_translate), so
+ * both sides always agree on the layout.
+ *
+ * VMAotState     what the module works on, the registers are read on entry
+ *                and written back before the step callback and on return
+ * step           executes the instruction at the instruction pointer register
+ *                in the interpreter, sets leave if the module has to return
+ * VMAotModule    blocks holds the start and end address of each block in
+ *                ascending order, checksum is the CRC-32C of their bytes
+ * */
+#define VM_AOT_ABI                                                             \
+  typedef struct VMAotState {                                                  \
+    uint64_t* regs;                                                            \
+    uint8_t* memory;                                                           \
+    uint32_t memory_size;                                                      \
+    uint32_t stack_limit;                                                      \
+    uint32_t watch_low;                                                        \
+    uint32_t watch_high;                                                       \
+    uint32_t vram_low;                                                         \
+    uint32_t vram_high;                                                        \
+    const uint8_t* stale;                                                      \
+    uint32_t leave;                                                            \
+    void* vm;                                                                  \
+    void (*step)(struct VMAotState* state);                                    \
+  } VMAotState;                                                                \
+  typedef struct VMAotModule {                                                 \
+    uint32_t version;                                                          \
+    uint32_t memory_size;                                                      \
+    uint32_t block_count;                                                      \
+    uint32_t checksum;                                                         \
+    const uint32_t* blocks;                                                    \
+    void (*run)(VMAotState* state);                                            \
+  } VMAotModule;
+
+VM_AOT_ABI
+
+/*
+ * A loaded module
+ *
+ * stale has one entry per block, set once the block was written to
+ * */
+typedef struct VMAot {
+  void* handle;
+  const VMAotModule* module;
+  uint8_t* stale;
+  VMAotState state;
+} VMAot;
+
+// AOT methods
+VMError vm_aot_translate(VM* vm, FILE* out, uint32_t* address, uint32_t* instruction_count);
+VMError vm_aot_compile(const char* source, const char* output);
+VMError vm_aot_build(VM* vm, const char* output, uint32_t* address, uint32_t* instruction_count);
+VMError vm_aot_load(VM* vm, const char* path);
+void vm_aot_clean(VM* vm);
+void vm_aot_run(VM* vm);
+void vm_aot_written(VM* vm, uint32_t address, uint32_t size);
+
+#endif
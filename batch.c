@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "vm.h"
+#include "exe.h"
+#include "jit.h"
+#include "output.h"
+#include "batch.h"
+
+/*
+ * Load the executable of a job
+ *
+ * Files which were already named by an earlier job aren't parsed again
+ * */
+static void vm_batch_load(VMBatch* batch, VMBatchJob* job) {
+  for (size_t i = 0; i < batch->job_count; i++) {
+    VMBatchJob* other = batch->jobs + i;
+    if (strcmp(other->filename, job->filename) == 0) {
+      job->exe = other->exe;
+      job->load_result = other->load_result;
+      job->owns_exe = false;
+      return;
+    }
+  }
+
+  job->owns_exe = true;
+
+  FILE* fp = fopen(job->filename, "r");
+  if (fp == NULL) {
+    job->load_result = exe_err_io;
+    return;
+  }
+
+  // exe_map keeps its own descriptor of the file
+  job->load_result = exe_map(&job->exe, fileno(fp));
+  if (job->load_result != exe_err_success) {
+    job->exe = NULL;
+  }
+
+  fclose(fp);
+}
+
+/*
+ * Read a list of jobs, one filename per line
+ *
+ * Empty lines and lines starting with a # are ignored
+ * */
+VMError vm_batch_create(VMBatch** batch, FILE* jobs, bool jit) {
+  VMBatch* batch_ptr = calloc(1, sizeof(VMBatch));
+  if (batch_ptr == NULL) {
+    return vm_err_allocation;
+  }
+
+  batch_ptr->jit = jit;
+  pthread_mutex_init(&batch_ptr->lock, NULL);
+
+  size_t capacity = 0;
+  char* line = NULL;
+  size_t line_size = 0;
+  while (getline(&line, &line_size, jobs) != -1) {
+
+    // Strip surrounding whitespace
+    char* filename = line;
+    while (*filename == ' ' || *filename == '\t') filename++;
+    size_t length = strlen(filename);
+    while (length > 0 && strchr(" \t\r\n", filename[length - 1]) != NULL) length--;
+    filename[length] = 0;
+
+    if (length == 0 || filename[0] == '#') continue;
+
+    if (batch_ptr->job_count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      VMBatchJob* grown = realloc(batch_ptr->jobs, capacity * sizeof(VMBatchJob));
+      if (grown == NULL) {
+        free(line);
+        vm_batch_clean(batch_ptr);
+        return vm_err_allocation;
+      }
+      batch_ptr->jobs = grown;
+    }
+
+    VMBatchJob* job = batch_ptr->jobs + batch_ptr->job_count;
+    memset(job, 0, sizeof(VMBatchJob));
+    job->filename = strdup(filename);
+    if (job->filename == NULL) {
+      free(line);
+      vm_batch_clean(batch_ptr);
+      return vm_err_allocation;
+    }
+
+    vm_batch_load(batch_ptr, job);
+    batch_ptr->job_count++;
+  }
+
+  free(line);
+
+  *batch = batch_ptr;
+  return vm_err_regular_exit;
+}
+
+/*
+ * Take jobs off the batch until there are none left
+ * */
+static void* vm_batch_worker(void* argument) {
+  VMBatch* batch = argument;
+
+  // The machine is reused for every job this worker runs, it's only
+  // replaced if a job asks for a different memory layout
+  VM* vm = NULL;
+
+  for (;;) {
+    pthread_mutex_lock(&batch->lock);
+    size_t index = batch->next_job++;
+    pthread_mutex_unlock(&batch->lock);
+
+    if (index >= batch->job_count) break;
+    VMBatchJob* job = batch->jobs + index;
+
+    if (job->exe == NULL) {
+      job->result = vm_err_invalid_executable;
+      continue;
+    }
+
+    VMConfig config;
+    vm_config_default(&config);
+    vm_config_executable(&config, job->exe);
+
+    if (vm == NULL || vm->memory_size != config.memory_size || vm->stack_start != config.stack_start ||
+        vm->stack_size != config.stack_size || vm->vram != config.vram) {
+      vm_clean(vm);
+      free(vm);
+      vm = NULL;
+
+      VMError create_result = vm_create(&vm, &config);
+      if (create_result != vm_err_regular_exit) {
+        job->result = create_result;
+        continue;
+      }
+
+      // Jobs still run in the interpreter if this fails
+      if (batch->jit) vm_jit_enable(vm);
+    }
+
+    FILE* output = open_memstream(&job->output, &job->output_size);
+    if (output == NULL) {
+      job->result = vm_err_allocation;
+      continue;
+    }
+
+    job->result = vm_flash(vm, job->exe);
+    if (job->result == vm_err_regular_exit) {
+      vm_output_redirect(vm->output, output);
+      job->result = vm_run(vm, &job->exit_code);
+      vm_output_redirect(vm->output, stdout);
+    }
+
+    fclose(output);
+  }
+
+  vm_clean(vm);
+  free(vm);
+  return NULL;
+}
+
+/*
+ * Run all jobs of a batch on a pool of threads
+ * Returns once every job has finished
+ * */
+VMError vm_batch_run(VMBatch* batch, uint32_t threads) {
+  if (threads == 0) threads = 1;
+  if (threads > batch->job_count) threads = batch->job_count;
+  if (threads == 0) return vm_err_regular_exit;
+
+  pthread_t* workers = malloc(threads * sizeof(pthread_t));
+  if (workers == NULL) {
+    return vm_err_allocation;
+  }
+
+  batch->next_job = 0;
+
+  // The jobs get picked up by whichever workers did start
+  uint32_t started = 0;
+  while (started < threads) {
+    if (pthread_create(workers + started, NULL, vm_batch_worker, batch) != 0) break;
+    started++;
+  }
+
+  for (uint32_t i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+
+  free(workers);
+  return started ? vm_err_regular_exit : vm_err_internal_failure;
+}
+
+/*
+ * Print the output of each job in the order they were listed in,
+ * and a status line per job to log
+ *
+ * Returns the number of jobs which didn't exit regularly with exit code 0
+ * */
+int vm_batch_report(VMBatch* batch, FILE* out, FILE* log) {
+  int failed = 0;
+
+  for (size_t i = 0; i < batch->job_count; i++) {
+    VMBatchJob* job = batch->jobs + i;
+
+    fprintf(out, "==> %s <==\n", job->filename);
+    if (job->output_size) {
+      fwrite(job->output, job->output_size, 1, out);
+      if (job->output[job->output_size - 1] != '\n') fputc('\n', out);
+    }
+
+    if (job->exe == NULL) {
+      fprintf(log, "%s: %s\n", job->filename, exe_err(job->load_result));
+      failed++;
+    } else if (job->result != vm_err_regular_exit) {
+      fprintf(log, "%s: %s\n", job->filename, vm_err(job->result));
+      failed++;
+    } else {
+      fprintf(log, "%s: exit code %d\n", job->filename, job->exit_code);
+      if (job->exit_code != 0) failed++;
+    }
+  }
+
+  return failed;
+}
+
+/*
+ * Clean the resources used by a batch
+ * */
+void vm_batch_clean(VMBatch* batch) {
+  if (batch == NULL) return;
+
+  for (size_t i = 0; i < batch->job_count; i++) {
+    VMBatchJob* job = batch->jobs + i;
+    if (job->owns_exe && job->exe) exe_clean(job->exe);
+    free(job->filename);
+    free(job->output);
+  }
+
+  pthread_mutex_destroy(&batch->lock);
+  free(batch->jobs);
+  free(batch);
+}
@@ -0,0 +1,47 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "vm.h"
+#include "exe.h"
+
+#ifndef BATCHH
+#define BATCHH
+
+/*
+ * A single run of an executable
+ *
+ * Jobs which name the same file share one Executable
+ * */
+typedef struct VMBatchJob {
+  char* filename;
+  Executable* exe;        // NULL if the file couldn't be loaded
+  bool owns_exe;          // this job is the first one naming the file
+  ExecutableError load_result;
+  VMError result;
+  int exit_code;
+  char* output;           // everything the job wrote to stdout
+  size_t output_size;
+} VMBatchJob;
+
+/*
+ * A list of jobs which are run by a fixed pool of worker threads
+ *
+ * Every worker owns one machine and reflashes it for each job it takes
+ * */
+typedef struct VMBatch {
+  VMBatchJob* jobs;
+  size_t job_count;
+  size_t next_job;
+  pthread_mutex_t lock;
+  bool jit;
+} VMBatch;
+
+// Batch methods
+VMError vm_batch_create(VMBatch** batch, FILE* jobs, bool jit);
+VMError vm_batch_run(VMBatch* batch, uint32_t threads);
+int vm_batch_report(VMBatch* batch, FILE* out, FILE* log);
+void vm_batch_clean(VMBatch* batch);
+
+#endif
@@ -0,0 +1,355 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "vm.h"
+#include "exe.h"
+#include "jit.h"
+#include "guard.h"
+#include "verify.h"
+#include "aot.h"
+#include "output.h"
+#include "profile.h"
+#include "builder.h"
+#include "workloads.h"
+
+/*
+ * Runs the workloads and reports how fast the machine executes them
+ *
+ * bin/bench [options] [workload...]
+ *
+ * --reps N          timed runs per workload (default 5)
+ * --warmup N        untimed runs before that (default 1)
+ * --scale F         multiply the size of every workload
+ * --jit             enable the JIT
+ * --guard           leave bounds checks to guard pages (see guard.h)
+ * --verify          verify every workload after loading it (see verify.h)
+ * --aot             translate every workload into a native module and run that (see aot.h)
+ * --save FILE       write the results, to be used as a baseline later
+ * --baseline FILE   compare against results written by --save
+ * --emit DIR        only write the workloads as DIR/<name>.bc
+ * */
+
+// Most repetitions that are kept track of
+#define BENCH_MAXREPS 100
+
+typedef struct BenchOptions {
+  int reps;
+  int warmup;
+  double scale;
+  bool jit;
+  bool guard;
+  bool verify;
+  bool aot;
+  char* save;
+  char* baseline;
+  char* emit;
+  char** names;
+  int name_count;
+} BenchOptions;
+
+static double now(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void* left, const void* right) {
+  double a = *(const double*) left;
+  double b = *(const double*) right;
+  return (a > b) - (a < b);
+}
+
+/*
+ * Look up a workload in a file written by --save
+ * Returns 0 if it isn't in there
+ * */
+static double baseline_lookup(FILE* baseline, const char* name) {
+  if (baseline == NULL) return 0;
+
+  char line_name[64];
+  double ns_per_instruction;
+  rewind(baseline);
+  while (fscanf(baseline, "%63s %lf", line_name, &ns_per_instruction) == 2) {
+    if (strcmp(line_name, name) == 0) return ns_per_instruction;
+  }
+
+  return 0;
+}
+
+/*
+ * Write a workload into a file
+ * */
+static bool emit_workload(const char* directory, const char* name, uint8_t* buffer, size_t size) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%s.bc", directory, name);
+
+  FILE* fp = fopen(path, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "Could not open file: %s\n", path);
+    return false;
+  }
+
+  fwrite(buffer, size, 1, fp);
+  fclose(fp);
+  return true;
+}
+
+/*
+ * Flash the executable, verify it if asked to and run it to completion
+ *
+ * Flashing drops the native module, it is loaded again if there is one.
+ * Returns the duration of vm_run in seconds, or a negative number if the run failed
+ * */
+static double run_once(VM* vm, Executable* exe, bool verify, const char* module) {
+  if (vm_flash(vm, exe) != vm_err_regular_exit) return -1;
+
+  uint32_t address;
+  if (verify && vm_verify(vm, &address) != vm_err_regular_exit) return -1;
+  if (module && vm_aot_load(vm, module) != vm_err_regular_exit) return -1;
+
+  int exit_code;
+  double start = now();
+  int result = vm_run(vm, &exit_code);
+  double duration = now() - start;
+
+  return result == REGULAR_EXIT && exit_code == 0 ? duration : -1;
+}
+
+/*
+ * Count the instructions a workload executes, using the profiler
+ * */
+static uint64_t count_instructions(VM* vm, Executable* exe, bool verify) {
+  if (vm_profile_enable(vm) != vm_err_regular_exit) return 0;
+
+  uint64_t total = 0;
+  if (run_once(vm, exe, verify, NULL) >= 0) {
+    for (int i = 0; i < VM_PROFILE_OPCODES; i++) {
+      total += vm->profile->counts[i];
+    }
+  }
+
+  vm_profile_clean(vm);
+  return total;
+}
+
+/*
+ * Translate a workload into a native module at path
+ * Returns false if it couldn't be translated or compiled
+ * */
+static bool build_module(VM* vm, Executable* exe, const char* path, const char* name) {
+  if (vm_flash(vm, exe) != vm_err_regular_exit) return false;
+
+  uint32_t address;
+  uint32_t count;
+  VMError result = vm_aot_build(vm, path, &address, &count);
+  if (result != vm_err_regular_exit) {
+    fprintf(stderr, "%s: %s\n", name, vm_err(result));
+    return false;
+  }
+
+  return true;
+}
+
+/*
+ * Benchmark a single workload
+ * Returns false if it failed to run
+ * */
+static bool bench_workload(VM* vm, const Workload* workload, BenchOptions* options, FILE* baseline, FILE* save) {
+  Builder* builder = builder_create();
+  if (builder == NULL) return false;
+
+  uint32_t scale = workload->scale * options->scale;
+  workload->generate(builder, scale ? scale : 1);
+
+  size_t size;
+  uint8_t* buffer = builder_executable(builder, WORKLOAD_ENTRY, &size);
+  builder_clean(builder);
+  if (buffer == NULL) return false;
+
+  if (options->emit) {
+    bool emitted = emit_workload(options->emit, workload->name, buffer, size);
+    free(buffer);
+    return emitted;
+  }
+
+  Executable* exe;
+  ExecutableError exe_result = exe_create(&exe, buffer, size);
+  free(buffer);
+  if (exe_result != exe_err_success) {
+    fprintf(stderr, "%s: %s\n", workload->name, exe_err(exe_result));
+    return false;
+  }
+
+  uint64_t instructions = count_instructions(vm, exe, options->verify);
+
+  // The module is translated once, outside of the timed runs
+  char module_path[] = "/tmp/bench-aot-XXXXXX";
+  const char* module = NULL;
+  if (options->aot) {
+    int fd = mkstemp(module_path);
+    if (fd >= 0) close(fd);
+    if (fd < 0 || !build_module(vm, exe, module_path, workload->name)) {
+      if (fd >= 0) unlink(module_path);
+      exe_clean(exe);
+      return false;
+    }
+
+    module = module_path;
+  }
+
+  for (int i = 0; i < options->warmup; i++) {
+    run_once(vm, exe, options->verify, module);
+  }
+
+  double times[BENCH_MAXREPS];
+  for (int i = 0; i < options->reps; i++) {
+    times[i] = run_once(vm, exe, options->verify, module);
+    if (times[i] < 0) {
+      fprintf(stderr, "%s: run failed\n", workload->name);
+      if (module) unlink(module);
+      exe_clean(exe);
+      return false;
+    }
+  }
+
+  if (module) unlink(module);
+  exe_clean(exe);
+
+  qsort(times, options->reps, sizeof(double), compare_doubles);
+  double best = times[0];
+  double median = times[options->reps / 2];
+  double ns_per_instruction = instructions ? median * 1e9 / instructions : 0;
+
+  printf("%-8s %12llu %10.2f %10.2f %10.1f %9.2f",
+         workload->name, (unsigned long long) instructions,
+         best * 1e3, median * 1e3,
+         instructions / median / 1e6, ns_per_instruction);
+
+  double previous = baseline_lookup(baseline, workload->name);
+  if (previous > 0) {
+    printf(" %+8.1f%%", (ns_per_instruction / previous - 1) * 100);
+  }
+  printf("\n");
+
+  if (save) {
+    fprintf(save, "%s %.6f\n", workload->name, ns_per_instruction);
+  }
+
+  return true;
+}
+
+static bool selected(BenchOptions* options, const char* name) {
+  if (options->name_count == 0) return true;
+
+  for (int i = 0; i < options->name_count; i++) {
+    if (strcmp(options->names[i], name) == 0) return true;
+  }
+
+  return false;
+}
+
+int main(int argc, char** argv) {
+  BenchOptions options = { 5, 1, 1.0, false, false, false, false, NULL, NULL, NULL, NULL, 0 };
+  options.names = calloc(argc, sizeof(char*));
+
+  // Parse the command-line options
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) {
+      options.reps = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+      options.warmup = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+      options.scale = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--jit") == 0) {
+      options.jit = true;
+    } else if (strcmp(argv[i], "--guard") == 0) {
+      options.guard = true;
+    } else if (strcmp(argv[i], "--verify") == 0) {
+      options.verify = true;
+    } else if (strcmp(argv[i], "--aot") == 0) {
+      options.aot = true;
+    } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+      options.save = argv[++i];
+    } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+      options.baseline = argv[++i];
+    } else if (strcmp(argv[i], "--emit") == 0 && i + 1 < argc) {
+      options.emit = argv[++i];
+    } else {
+      options.names[options.name_count++] = argv[i];
+    }
+  }
+
+  if (options.reps < 1) options.reps = 1;
+  if (options.reps > BENCH_MAXREPS) options.reps = BENCH_MAXREPS;
+
+  FILE* baseline = NULL;
+  if (options.baseline) {
+    baseline = fopen(options.baseline, "r");
+    if (baseline == NULL) {
+      fprintf(stderr, "Could not open file: %s\n", options.baseline);
+      return 1;
+    }
+  }
+
+  FILE* save = NULL;
+  if (options.save) {
+    save = fopen(options.save, "w");
+    if (save == NULL) {
+      fprintf(stderr, "Could not open file: %s\n", options.save);
+      return 1;
+    }
+  }
+
+  // One machine runs every workload, its output is discarded
+  VM* vm;
+  VMError create_result = vm_create(&vm, NULL);
+  if (create_result != vm_err_regular_exit) {
+    fprintf(stderr, "Could not initialize vm\n");
+    fprintf(stderr, "Reason: %s\n", vm_err(create_result));
+    return 1;
+  }
+
+  FILE* null_output = fopen("/dev/null", "w");
+  if (null_output) {
+    vm_output_redirect(vm->output, null_output);
+  }
+
+  if (options.guard) {
+    VMError guard_result = vm_guard_enable(vm);
+    if (guard_result != vm_err_regular_exit) {
+      fprintf(stderr, "Could not enable guard pages: %s\n", vm_err(guard_result));
+    }
+  }
+
+  if (options.jit) {
+    VMError jit_result = vm_jit_enable(vm);
+    if (jit_result != vm_err_regular_exit) {
+      fprintf(stderr, "Could not enable the JIT: %s\n", vm_err(jit_result));
+    }
+  }
+
+  if (!options.emit) {
+    printf("%-8s %12s %10s %10s %10s %9s%s\n",
+           "workload", "instrs", "best ms", "median ms", "Minstr/s", "ns/instr",
+           baseline ? "  vs base" : "");
+  }
+
+  int failed = 0;
+  for (const Workload* workload = workloads; workload->name; workload++) {
+    if (!selected(&options, workload->name)) continue;
+    if (!bench_workload(vm, workload, &options, baseline, save)) failed++;
+  }
+
+  vm_output_redirect(vm->output, stdout);
+  vm_clean(vm);
+  free(vm);
+
+  if (null_output) fclose(null_output);
+  if (baseline) fclose(baseline);
+  if (save) fclose(save);
+  free(options.names);
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <string.h>
+#include "vm.h"
+#include "exe.h"
+#include "builder.h"
+
+/*
+ * Allocate an empty builder
+ * Returns NULL if allocation failed
+ * */
+Builder* builder_create(void) {
+  return calloc(1, sizeof(Builder));
+}
+
+/*
+ * Free a builder and its code
+ * */
+void builder_clean(Builder* builder) {
+  if (builder == NULL) return;
+  free(builder->code);
+  free(builder);
+}
+
+/*
+ * Wrap the code into an executable
+ *
+ * The load table is left empty, so the whole data segment is loaded
+ * at address 0. Returns NULL if allocation failed at any point.
+ * */
+uint8_t* builder_executable(Builder* builder, uint32_t entry, size_t* size) {
+  if (builder->failed) return NULL;
+
+  uint8_t* buffer = malloc(EXE_HEADER_MINSIZE + builder->size);
+  if (buffer == NULL) return NULL;
+
+  uint32_t header[3] = { EXE_HEADER_MAGIC, entry, 0 };
+  memcpy(buffer, header, sizeof(header));
+  memcpy(buffer + EXE_HEADER_MINSIZE, builder->code, builder->size);
+
+  *size = EXE_HEADER_MINSIZE + builder->size;
+  return buffer;
+}
+
+/*
+ * Address of the next byte that will be emitted
+ * */
+uint32_t builder_here(Builder* builder) {
+  return builder->size;
+}
+
+void builder_bytes(Builder* builder, const void* data, size_t size) {
+  if (builder->size + size > builder->capacity) {
+    size_t capacity = builder->capacity ? builder->capacity : 256;
+    while (capacity < builder->size + size) capacity *= 2;
+
+    uint8_t* code = realloc(builder->code, capacity);
+    if (code == NULL) {
+      builder->failed = true;
+      return;
+    }
+
+    builder->code = code;
+    builder->capacity = capacity;
+  }
+
+  memcpy(builder->code + builder->size, data, size);
+  builder->size += size;
+}
+
+void builder_byte(Builder* builder, uint8_t value) {
+  builder_bytes(builder, &value, 1);
+}
+
+void builder_u16(Builder* builder, uint16_t value) {
+  builder_bytes(builder, &value, 2);
+}
+
+void builder_u32(Builder* builder, uint32_t value) {
+  builder_bytes(builder, &value, 4);
+}
+
+void builder_u64(Builder* builder, uint64_t value) {
+  builder_bytes(builder, &value, 8);
+}
+
+/*
+ * Pad with zeroes up to address
+ * */
+void builder_align(Builder* builder, uint32_t address) {
+  while (!builder->failed && builder->size < address) {
+    builder_byte(builder, 0);
+  }
+}
+
+/*
+ * Overwrite four bytes which were already emitted, used to resolve forward jumps
+ * */
+void builder_patch(Builder* builder, uint32_t address, uint32_t value) {
+  if (builder->failed || address + 4 > builder->size) return;
+  memcpy(builder->code + address, &value, 4);
+}
+
+// Instructions without operands (ret, nop, syscall)
+void builder_op(Builder* builder, opcode op) {
+  builder_byte(builder, op);
+}
+
+// reg
+void builder_reg(Builder* builder, opcode op, uint8_t reg) {
+  builder_byte(builder, op);
+  builder_byte(builder, reg);
+}
+
+// reg, reg
+void builder_reg_reg(Builder* builder, opcode op, uint8_t target, uint8_t source) {
+  builder_byte(builder, op);
+  builder_byte(builder, target);
+  builder_byte(builder, source);
+}
+
+// reg, reg, reg (fill, cmpmem, findb)
+void builder_reg_reg_reg(Builder* builder, opcode op, uint8_t first, uint8_t second, uint8_t third) {
+  builder_byte(builder, op);
+  builder_byte(builder, first);
+  builder_byte(builder, second);
+  builder_byte(builder, third);
+}
+
+// reg, imm32 (load, readc, writes)
+void builder_reg_imm(Builder* builder, opcode op, uint8_t reg, uint32_t value) {
+  builder_byte(builder, op);
+  builder_byte(builder, reg);
+  builder_u32(builder, value);
+}
+
+// imm32, reg (store, reads, writec)
+void builder_imm_reg(Builder* builder, opcode op, uint32_t value, uint8_t reg) {
+  builder_byte(builder, op);
+  builder_u32(builder, value);
+  builder_byte(builder, reg);
+}
+
+/*
+ * Load a value into a register, the immediate is as wide as the register
+ * */
+void builder_loadi(Builder* builder, uint8_t reg, uint64_t value) {
+  builder_byte(builder, op_loadi);
+  builder_byte(builder, reg);
+  builder_bytes(builder, &value, vm_reg_size(reg));
+}
+
+void builder_push(Builder* builder, const void* data, uint32_t size) {
+  builder_byte(builder, op_push);
+  builder_u32(builder, size);
+  builder_bytes(builder, data, size);
+}
+
+void builder_push32(Builder* builder, uint32_t value) {
+  builder_push(builder, &value, 4);
+}
+
+void builder_copy(Builder* builder, uint8_t target, uint32_t size, uint8_t source) {
+  builder_byte(builder, op_copy);
+  builder_byte(builder, target);
+  builder_u32(builder, size);
+  builder_byte(builder, source);
+}
+
+void builder_copyc(Builder* builder, uint32_t target, uint32_t size, uint32_t source) {
+  builder_byte(builder, op_copyc);
+  builder_u32(builder, target);
+  builder_u32(builder, size);
+  builder_u32(builder, source);
+}
+
+/*
+ * Emit jz, jmp or call
+ * Returns the address of the target, for builder_patch
+ * */
+uint32_t builder_jump(Builder* builder, opcode op, uint32_t address) {
+  builder_byte(builder, op);
+  uint32_t patch = builder_here(builder);
+  builder_u32(builder, address);
+  return patch;
+}
+
+/*
+ * Call a function with argument_size bytes of arguments on the stack
+ *
+ * The size is pushed right before the call, ret uses it to drop
+ * the arguments again
+ * */
+uint32_t builder_call(Builder* builder, uint32_t address, uint32_t argument_size) {
+  builder_push32(builder, argument_size);
+  return builder_jump(builder, op_call, address);
+}
+
+void builder_syscall(Builder* builder, uint16_t id) {
+  builder_push(builder, &id, 2);
+  builder_op(builder, op_syscall);
+}
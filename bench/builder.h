@@ -0,0 +1,55 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "vm.h"
+#include "exe.h"
+
+#ifndef BUILDERH
+#define BUILDERH
+
+/*
+ * Emits instructions into a growing code buffer
+ *
+ * Addresses are offsets into the buffer, which is loaded at address 0
+ * by builder_executable. Allocation failures are sticky, they are only
+ * reported once the executable is built.
+ * */
+typedef struct Builder {
+  uint8_t* code;
+  size_t size;
+  size_t capacity;
+  bool failed;
+} Builder;
+
+// Builder methods
+Builder* builder_create(void);
+void builder_clean(Builder* builder);
+uint8_t* builder_executable(Builder* builder, uint32_t entry, size_t* size);
+
+// Raw data
+uint32_t builder_here(Builder* builder);
+void builder_bytes(Builder* builder, const void* data, size_t size);
+void builder_byte(Builder* builder, uint8_t value);
+void builder_u16(Builder* builder, uint16_t value);
+void builder_u32(Builder* builder, uint32_t value);
+void builder_u64(Builder* builder, uint64_t value);
+void builder_align(Builder* builder, uint32_t address);
+void builder_patch(Builder* builder, uint32_t address, uint32_t value);
+
+// Instructions
+void builder_op(Builder* builder, opcode op);
+void builder_reg(Builder* builder, opcode op, uint8_t reg);
+void builder_reg_reg(Builder* builder, opcode op, uint8_t target, uint8_t source);
+void builder_reg_reg_reg(Builder* builder, opcode op, uint8_t first, uint8_t second, uint8_t third);
+void builder_reg_imm(Builder* builder, opcode op, uint8_t reg, uint32_t value);
+void builder_imm_reg(Builder* builder, opcode op, uint32_t value, uint8_t reg);
+void builder_loadi(Builder* builder, uint8_t reg, uint64_t value);
+void builder_push(Builder* builder, const void* data, uint32_t size);
+void builder_push32(Builder* builder, uint32_t value);
+void builder_copy(Builder* builder, uint8_t target, uint32_t size, uint8_t source);
+void builder_copyc(Builder* builder, uint32_t target, uint32_t size, uint32_t source);
+uint32_t builder_jump(Builder* builder, opcode op, uint32_t address);
+uint32_t builder_call(Builder* builder, uint32_t address, uint32_t argument_size);
+void builder_syscall(Builder* builder, uint16_t id);
+
+#endif
@@ -0,0 +1,366 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "vm.h"
+#include "exe.h"
+#include "jit.h"
+#include "verify.h"
+#include "aot.h"
+#include "output.h"
+#include "builder.h"
+#include "workloads.h"
+
+/*
+ * Regression checks for the parts which take untrusted input or generate code
+ *
+ * bin/check
+ *
+ * verify    crafted programs are rejected, and compiled stores into verified
+ *           code don't leave stale trusted handlers behind
+ * pack      workloads survive a round trip through exe_pack and exe_create,
+ *           damaged files are rejected
+ * aot       translated workloads end in the same state as the interpreter,
+ *           also when $CC carries arguments
+ *
+ * Every workload is run at a fraction of its benchmark size. Prints one line
+ * per check and exits with 1 if any of them failed.
+ * */
+
+// Registers used by the programs below
+#define R1 (1 | VM_REGQWORD)
+#define R2 (2 | VM_REGQWORD)
+#define R5 (5 | VM_REGQWORD)
+#define R6 (6 | VM_REGQWORD)
+#define R7 (7 | VM_REGQWORD)
+
+// Workloads are scaled down by this much
+#define CHECK_SCALE_DIVISOR 1000
+
+// Layout of the patch program, the copyc sits on its own decode cache page
+#define PATCH_SCRATCH 0x100
+#define PATCH_TARGET  0x1000
+#define PATCH_COPY_A  0x2000
+#define PATCH_COPY_B  0x2100
+#define PATCH_END     0x2200
+
+typedef struct CheckRun {
+  int result;
+  int exit_code;
+} CheckRun;
+
+static int failures = 0;
+
+static void report(const char* check, const char* name, bool passed, const char* detail) {
+  printf("%-8s %-10s %s%s%s\n", check, name, passed ? "ok" : "FAILED",
+         detail ? ": " : "", detail ? detail : "");
+  fflush(stdout);
+  if (!passed) failures++;
+}
+
+/*
+ * Wrap the code of a builder into an executable
+ * Returns NULL if it couldn't be built
+ * */
+static Executable* check_executable(Builder* builder, uint32_t entry) {
+  size_t size;
+  uint8_t* buffer = builder_executable(builder, entry, &size);
+  if (buffer == NULL) return NULL;
+
+  Executable* exe;
+  ExecutableError result = exe_create(&exe, buffer, size);
+  free(buffer);
+  return result == exe_err_success ? exe : NULL;
+}
+
+/*
+ * Generate a workload at the size used by the checks
+ * */
+static Executable* workload_executable(const Workload* workload) {
+  Builder* builder = builder_create();
+  if (builder == NULL) return NULL;
+
+  uint32_t scale = workload->scale / CHECK_SCALE_DIVISOR;
+  workload->generate(builder, scale ? scale : workload->scale / 2);
+  Executable* exe = check_executable(builder, WORKLOAD_ENTRY);
+  builder_clean(builder);
+  return exe;
+}
+
+/*
+ * A program which compiles a hot write and then uses it to patch a
+ * verified copyc, which wasn't decoded yet, into copying 2 GiB
+ *
+ * Every configuration has to stop it with the same error.
+ * */
+static Executable* patch_executable(void) {
+  Builder* b = builder_create();
+  if (b == NULL) return NULL;
+
+  builder_align(b, WORKLOAD_ENTRY);
+  builder_loadi(b, R1, PATCH_SCRATCH);
+  builder_loadi(b, R2, 0x7fffffff);
+  builder_loadi(b, R5, 2 * VM_JIT_THRESHOLD);
+  builder_loadi(b, R6, 1);
+  builder_loadi(b, R7, 0);
+
+  uint32_t body = builder_here(b);
+  uint32_t hot_call = builder_call(b, 0, 0);
+  builder_reg_reg(b, op_sub, R5, R6);
+  builder_reg_reg(b, op_cmp, R5, R7);
+  uint32_t done = builder_jump(b, op_jz, 0);
+  builder_jump(b, op_jmp, body);
+
+  // Point the write at the size of the copyc
+  builder_patch(b, done, builder_here(b));
+  builder_loadi(b, R1, PATCH_TARGET + 5);
+  uint32_t patch_call = builder_call(b, 0, 0);
+  builder_jump(b, op_jmp, PATCH_TARGET);
+
+  uint32_t write = builder_here(b);
+  builder_patch(b, hot_call, write);
+  builder_patch(b, patch_call, write);
+  builder_reg_reg(b, op_write, R1, R2);
+  builder_op(b, op_ret);
+
+  builder_align(b, PATCH_TARGET);
+  builder_copyc(b, PATCH_COPY_A, 4, PATCH_COPY_B);
+  uint8_t code = 0;
+  builder_push(b, &code, 1);
+  builder_syscall(b, VM_SYS_EXIT);
+  builder_align(b, PATCH_END);
+
+  Executable* exe = check_executable(b, WORKLOAD_ENTRY);
+  builder_clean(b);
+  return exe;
+}
+
+/*
+ * Flash and run an executable, verifying it first if asked to
+ * Returns false if it couldn't be flashed or verified
+ * */
+static bool run_program(VM* vm, Executable* exe, bool verify, CheckRun* outcome) {
+  if (vm_flash(vm, exe) != vm_err_regular_exit) return false;
+
+  uint32_t address;
+  if (verify && vm_verify(vm, &address) != vm_err_regular_exit) return false;
+
+  outcome->result = vm_run(vm, &outcome->exit_code);
+  return true;
+}
+
+// Returns true if both machines ended with the same registers and memory
+static bool same_state(VM* left, VM* right) {
+  return left->memory_size == right->memory_size &&
+         memcmp(left->regs, right->regs, VM_REGCOUNT * sizeof(uint64_t)) == 0 &&
+         memcmp(left->memory, right->memory, left->memory_size) == 0;
+}
+
+/*
+ * Verify a program made of raw bytes at WORKLOAD_ENTRY
+ * Returns the result of vm_verify
+ * */
+static VMError verify_bytes(VM* vm, const uint8_t* code, size_t size) {
+  Builder* b = builder_create();
+  if (b == NULL) return vm_err_allocation;
+
+  builder_align(b, WORKLOAD_ENTRY);
+  builder_bytes(b, code, size);
+  builder_align(b, WORKLOAD_ENTRY + 64);
+  Executable* exe = check_executable(b, WORKLOAD_ENTRY);
+  builder_clean(b);
+  if (exe == NULL) return vm_err_allocation;
+
+  uint32_t address;
+  VMError result = vm_flash(vm, exe);
+  if (result == vm_err_regular_exit) result = vm_verify(vm, &address);
+  vm_verify_clean(vm);
+  exe_clean(exe);
+  return result;
+}
+
+static void check_verify(VM* vm, VM* jit_vm) {
+
+  // A jump into the immediate of the loadi before it
+  uint8_t overlapping[] = {
+    op_loadi, R1, 1, 2, 3, 4, 5, 6, 7, 8,
+    op_jmp, (WORKLOAD_ENTRY + 2) & 0xff, (WORKLOAD_ENTRY + 2) >> 8, 0, 0
+  };
+  VMError result = verify_bytes(vm, overlapping, sizeof(overlapping));
+  report("verify", "overlap", result == vm_err_overlapping_code, vm_err(result));
+
+  // A push whose end wraps around the 32 bit address space
+  uint8_t oversized[] = { op_push, 0xf0, 0xff, 0xff, 0xff };
+  result = verify_bytes(vm, oversized, sizeof(oversized));
+  report("verify", "oversized", result == vm_err_illegal_memory_access, vm_err(result));
+
+  Executable* exe = patch_executable();
+  if (exe == NULL) {
+    report("verify", "patch", false, "could not build the program");
+    return;
+  }
+
+  CheckRun plain;
+  CheckRun checked;
+  bool ran = run_program(vm, exe, false, &plain) && run_program(jit_vm, exe, true, &checked);
+  report("verify", "patch", ran && plain.result == checked.result && plain.exit_code == checked.exit_code,
+         jit_vm->jit ? NULL : "without the JIT");
+  exe_clean(exe);
+}
+
+/*
+ * Pack an executable and load the result again
+ * Returns NULL if either step failed, damage flips a byte of the packed file first
+ * */
+static Executable* repack(Executable* exe, bool damage) {
+  FILE* file = tmpfile();
+  if (file == NULL) return NULL;
+
+  size_t size = 0;
+  Executable* result = NULL;
+  uint8_t* buffer = NULL;
+  if (exe_pack(exe, file, &size) == exe_err_success && (buffer = malloc(size)) != NULL) {
+    rewind(file);
+    if (fread(buffer, 1, size, file) == size) {
+      if (damage) buffer[size / 2] ^= 0x40;
+      if (exe_create(&result, buffer, size) != exe_err_success) result = NULL;
+    }
+  }
+
+  free(buffer);
+  fclose(file);
+  return result;
+}
+
+static void check_pack(VM* vm, VM* packed_vm) {
+  for (const Workload* workload = workloads; workload->name; workload++) {
+    Executable* exe = workload_executable(workload);
+    Executable* packed = exe ? repack(exe, false) : NULL;
+    if (packed == NULL) {
+      report("pack", workload->name, false, "could not pack or load");
+      exe_clean(exe);
+      continue;
+    }
+
+    bool flashed = vm_flash(vm, exe) == vm_err_regular_exit && vm_flash(packed_vm, packed) == vm_err_regular_exit;
+    bool loaded = flashed && same_state(vm, packed_vm) && packed->header->version == EXE_VERSION;
+
+    CheckRun original;
+    CheckRun repacked;
+    bool ran = loaded && run_program(vm, exe, false, &original) && run_program(packed_vm, packed, false, &repacked);
+    report("pack", workload->name, ran && original.result == repacked.result && same_state(vm, packed_vm),
+           loaded ? NULL : "memory differs after loading");
+    exe_clean(packed);
+    exe_clean(exe);
+  }
+
+  // The checksum has to catch a flipped bit anywhere in the file
+  Executable* exe = workload_executable(workloads);
+  Executable* damaged = exe ? repack(exe, true) : NULL;
+  report("pack", "damaged", exe && damaged == NULL, damaged ? "was accepted" : NULL);
+  exe_clean(damaged);
+  exe_clean(exe);
+}
+
+/*
+ * Translate and load an executable into vm
+ * Returns false if it couldn't be translated, compiled or loaded
+ * */
+static bool load_module(VM* vm, Executable* exe, const char* path) {
+  uint32_t address;
+  uint32_t count;
+  return vm_flash(vm, exe) == vm_err_regular_exit &&
+         vm_aot_build(vm, path, &address, &count) == vm_err_regular_exit &&
+         vm_flash(vm, exe) == vm_err_regular_exit &&
+         vm_aot_load(vm, path) == vm_err_regular_exit;
+}
+
+static void check_aot_one(VM* vm, VM* aot_vm, const char* name, Executable* exe) {
+  if (exe == NULL) {
+    report("aot", name, false, "could not build the program");
+    return;
+  }
+
+  char path[] = "/tmp/check-aot-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    report("aot", name, false, "could not create a temporary file");
+    return;
+  }
+  close(fd);
+
+  CheckRun interpreted;
+  CheckRun translated;
+  bool loaded = load_module(aot_vm, exe, path);
+  if (loaded) {
+    translated.result = vm_run(aot_vm, &translated.exit_code);
+  }
+
+  bool passed = loaded && run_program(vm, exe, false, &interpreted) &&
+                interpreted.result == translated.result && interpreted.exit_code == translated.exit_code &&
+                same_state(vm, aot_vm);
+  report("aot", name, passed, loaded ? NULL : "could not translate or load the module");
+  unlink(path);
+}
+
+static void check_aot(VM* vm, VM* aot_vm) {
+  for (const Workload* workload = workloads; workload->name; workload++) {
+    Executable* exe = workload_executable(workload);
+    check_aot_one(vm, aot_vm, workload->name, exe);
+    exe_clean(exe);
+  }
+
+  Executable* exe = patch_executable();
+  check_aot_one(vm, aot_vm, "patch", exe);
+
+  // $CC is split into words, so a compiler with arguments works too
+  const char* compiler = getenv("CC");
+  char* saved = compiler ? strdup(compiler) : NULL;
+  char command[256];
+  snprintf(command, sizeof(command), "%s -O0", compiler && compiler[0] ? compiler : VM_AOT_CC);
+  setenv("CC", command, 1);
+  check_aot_one(vm, aot_vm, "cc args", exe);
+  if (saved) {
+    setenv("CC", saved, 1);
+    free(saved);
+  } else {
+    unsetenv("CC");
+  }
+
+  exe_clean(exe);
+}
+
+int main(void) {
+
+  // A reference machine, one to compare it with and one with the JIT
+  VM* machines[3];
+  for (int i = 0; i < 3; i++) {
+    VMError create_result = vm_create(&machines[i], NULL);
+    if (create_result != vm_err_regular_exit) {
+      fprintf(stderr, "Could not initialize vm\n");
+      fprintf(stderr, "Reason: %s\n", vm_err(create_result));
+      return 1;
+    }
+  }
+
+  vm_jit_enable(machines[2]);
+
+  // The output of the programs is discarded
+  FILE* null_output = fopen("/dev/null", "w");
+  if (null_output) {
+    for (int i = 0; i < 3; i++) vm_output_redirect(machines[i]->output, null_output);
+  }
+
+  check_verify(machines[0], machines[2]);
+  check_pack(machines[0], machines[1]);
+  check_aot(machines[0], machines[1]);
+
+  for (int i = 0; i < 3; i++) {
+    vm_output_redirect(machines[i]->output, stdout);
+    vm_clean(machines[i]);
+    free(machines[i]);
+  }
+
+  if (null_output) fclose(null_output);
+  return failures ? 1 : 0;
+}
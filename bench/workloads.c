@@ -0,0 +1,215 @@
+#include <string.h>
+#include "vm.h"
+#include "builder.h"
+#include "workloads.h"
+
+// Registers used by the workloads
+#define R1 (1 | VM_REGQWORD)
+#define R2 (2 | VM_REGQWORD)
+#define R3 (3 | VM_REGQWORD)
+#define R4 (4 | VM_REGQWORD)
+#define R5 (5 | VM_REGQWORD)
+#define R6 (6 | VM_REGQWORD)
+#define R7 (7 | VM_REGQWORD)
+#define R8 (8 | VM_REGQWORD)
+#define R9 (9 | VM_REGQWORD)
+#define R10 (10 | VM_REGQWORD)
+
+// Code starts on its own decode cache page, the first one is scratch memory
+#define CODE_START WORKLOAD_ENTRY
+#define SCRATCH_NEWLINE 0x20
+#define SCRATCH_SOURCE 0x40
+#define SCRATCH_TARGET 0x80
+
+// Buffers for the copy workload, far away from the code
+#define COPY_SIZE 4096
+#define COPY_A 0x10000
+#define COPY_B 0x20000
+
+/*
+ * Set up a loop counting R1 down from scale to zero
+ * Returns the address of the loop body
+ * */
+static uint32_t loop_begin(Builder* b, uint32_t scale) {
+  builder_loadi(b, R1, scale);
+  builder_loadi(b, R2, 1);
+  builder_loadi(b, R3, 0);
+  return builder_here(b);
+}
+
+/*
+ * Decrement the counter and jump back to the body until it reaches zero
+ * */
+static void loop_end(Builder* b, uint32_t body) {
+  builder_reg_reg(b, op_sub, R1, R2);
+  builder_reg_reg(b, op_cmp, R1, R3);
+  uint32_t done = builder_jump(b, op_jz, 0);
+  builder_jump(b, op_jmp, body);
+  builder_patch(b, done, builder_here(b));
+}
+
+static void exit_program(Builder* b) {
+  uint8_t code = 0;
+  builder_push(b, &code, 1);
+  builder_syscall(b, VM_SYS_EXIT);
+}
+
+/*
+ * Integer arithmetic and branches
+ * */
+static void workload_loop(Builder* b, uint32_t scale) {
+  builder_align(b, CODE_START);
+  builder_loadi(b, R4, 0);
+  builder_loadi(b, R5, 3);
+  uint32_t body = loop_begin(b, scale);
+  builder_reg_reg(b, op_add, R4, R1);
+  builder_reg_reg(b, op_xor, R4, R5);
+  builder_reg_reg(b, op_mul, R4, R5);
+  loop_end(b, body);
+  exit_program(b);
+}
+
+/*
+ * Naive recursive fibonacci, scale is n
+ *
+ * The argument lives on the stack at fp + 12, the result is returned in R10.
+ * R0 is left alone, the exit code is read from it
+ * */
+static void workload_fib(Builder* b, uint32_t scale) {
+  builder_align(b, CODE_START);
+  builder_loadi(b, R1, scale);
+  builder_reg(b, op_rpush, R1);
+  uint32_t entry_call = builder_call(b, 0, 8);
+  exit_program(b);
+
+  uint32_t fib = builder_here(b);
+  builder_patch(b, entry_call, fib);
+
+  // if (n < 2) return n
+  builder_reg_imm(b, op_load, R1, 12);
+  builder_loadi(b, R2, 2);
+  builder_reg_reg(b, op_lt, R1, R2);
+  uint32_t base = builder_jump(b, op_jz, 0);
+
+  // fib(n - 1), kept on the stack while fib(n - 2) runs
+  builder_loadi(b, R2, 1);
+  builder_reg_reg(b, op_sub, R1, R2);
+  builder_reg(b, op_rpush, R1);
+  builder_call(b, fib, 8);
+  builder_reg(b, op_rpush, R10);
+
+  // fib(n - 2)
+  builder_reg_imm(b, op_load, R1, 12);
+  builder_loadi(b, R2, 2);
+  builder_reg_reg(b, op_sub, R1, R2);
+  builder_reg(b, op_rpush, R1);
+  builder_call(b, fib, 8);
+
+  builder_reg(b, op_rpop, R3);
+  builder_reg_reg(b, op_add, R10, R3);
+  builder_op(b, op_ret);
+
+  builder_patch(b, base, builder_here(b));
+  builder_reg_reg(b, op_mov, R10, R1);
+  builder_op(b, op_ret);
+}
+
+static uint64_t double_bits(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, 8);
+  return bits;
+}
+
+/*
+ * Floating-point multiply, add, divide and pow
+ * */
+static void workload_float(Builder* b, uint32_t scale) {
+  builder_align(b, CODE_START);
+  uint32_t body = loop_begin(b, scale);
+  builder_loadi(b, R4, double_bits(1.0001));
+  builder_loadi(b, R5, double_bits(1.5));
+  builder_loadi(b, R6, double_bits(0.5));
+  builder_reg_reg(b, op_fmul, R4, R5);
+  builder_reg_reg(b, op_fadd, R5, R6);
+  builder_reg_reg(b, op_fdiv, R5, R6);
+  builder_reg_reg(b, op_fexp, R6, R6);
+  builder_reg_reg(b, op_fexp, R5, R6);
+  loop_end(b, body);
+  exit_program(b);
+}
+
+/*
+ * Block copies, large ones between fixed addresses and small
+ * ones through registers
+ *
+ * op_copy only sees the low byte of its address registers,
+ * its buffers have to live in the first 256 bytes
+ * */
+static void workload_copy(Builder* b, uint32_t scale) {
+  builder_align(b, CODE_START);
+  builder_loadi(b, R7, SCRATCH_TARGET);
+  builder_loadi(b, R8, SCRATCH_SOURCE);
+  uint32_t body = loop_begin(b, scale);
+  builder_copyc(b, COPY_A, COPY_SIZE, COPY_B);
+  builder_copyc(b, COPY_B, COPY_SIZE, COPY_A);
+  builder_copy(b, R7, 64, R8);
+  builder_copy(b, R8, 64, R7);
+  loop_end(b, body);
+  exit_program(b);
+}
+
+/*
+ * Bulk memory instructions on 4K buffers, the way a string library would use them
+ *
+ * Both buffers are filled with the same byte except for their last few bytes,
+ * then compared and searched for the byte that differs
+ * */
+static void workload_strings(Builder* b, uint32_t scale) {
+  builder_align(b, CODE_START);
+  builder_loadi(b, R5, COPY_A);
+  builder_loadi(b, R6, COPY_B);
+  builder_loadi(b, R7, 'a');
+  builder_loadi(b, R8, 'b');
+  uint32_t body = loop_begin(b, scale);
+  builder_loadi(b, R4, COPY_SIZE);
+  builder_reg_reg_reg(b, op_fill, R5, R4, R7);
+  builder_reg_reg_reg(b, op_fill, R6, R4, R7);
+  builder_imm_reg(b, op_writec, COPY_B + COPY_SIZE - 8, R8);
+  builder_reg_reg_reg(b, op_cmpmem, R5, R6, R4);
+  builder_loadi(b, R4, COPY_SIZE);
+  builder_reg_reg_reg(b, op_findb, R6, R4, R8);
+  loop_end(b, body);
+  exit_program(b);
+}
+
+/*
+ * Prints a number and a newline per iteration
+ * */
+static void workload_output(Builder* b, uint32_t scale) {
+  builder_align(b, CODE_START);
+  builder_patch(b, SCRATCH_NEWLINE, '\n');
+  builder_loadi(b, R9, 0x0123456789abcdef);
+  uint32_t body = loop_begin(b, scale);
+
+  uint8_t reg = R9;
+  builder_push(b, &reg, 1);
+  builder_syscall(b, VM_SYS_PUTS);
+
+  builder_push32(b, SCRATCH_NEWLINE);
+  builder_push32(b, 1);
+  builder_syscall(b, VM_SYS_WRITE);
+
+  builder_reg_reg(b, op_add, R9, R1);
+  loop_end(b, body);
+  exit_program(b);
+}
+
+const Workload workloads[] = {
+  { "loop", "integer arithmetic and branches", workload_loop, 5000000 },
+  { "fib", "recursive calls and returns", workload_fib, 27 },
+  { "float", "floating-point arithmetic", workload_float, 1000000 },
+  { "copy", "block copies", workload_copy, 1000000 },
+  { "strings", "fill, cmpmem and findb", workload_strings, 1000000 },
+  { "output", "write and puts syscalls", workload_output, 1000000 },
+  { NULL, NULL, NULL, 0 }
+};
@@ -0,0 +1,28 @@
+#include <stdint.h>
+#include "builder.h"
+
+#ifndef WORKLOADSH
+#define WORKLOADSH
+
+// Address every workload starts at
+#define WORKLOAD_ENTRY 0x400
+
+/*
+ * Generates a benchmark program into a builder
+ *
+ * scale is the number of iterations (or the argument of fib), the
+ * program starts at WORKLOAD_ENTRY and exits with exit code 0
+ * */
+typedef void (*WorkloadGenerator)(Builder* builder, uint32_t scale);
+
+typedef struct Workload {
+  const char* name;
+  const char* description;
+  WorkloadGenerator generate;
+  uint32_t scale;
+} Workload;
+
+// All workloads, terminated by an entry without a name
+extern const Workload workloads[];
+
+#endif
@@ -0,0 +1,89 @@
+#include <string.h>
+#include "bulk.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define VM_BULK_X86 1
+#else
+#define VM_BULK_X86 0
+#endif
+
+// Compares the bytes one by one, used for the tails of the vector loops
+static size_t vm_bulk_mismatch_scalar(const uint8_t* left, const uint8_t* right, size_t start, size_t size) {
+  for (size_t i = start; i < size; i++) {
+    if (left[i] != right[i]) return i;
+  }
+  return size;
+}
+
+#if VM_BULK_X86
+
+// 16 bytes per step, SSE2 is part of every x86-64 cpu
+static size_t vm_bulk_mismatch_sse2(const uint8_t* left, const uint8_t* right, size_t size) {
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(left + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(right + i));
+    uint32_t equal = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+    if (equal != 0xffff) {
+      return i + __builtin_ctz(~equal);
+    }
+  }
+
+  return vm_bulk_mismatch_scalar(left, right, i, size);
+}
+
+// 64 bytes per step, only used if the cpu supports AVX2
+__attribute__((target("avx2")))
+static size_t vm_bulk_mismatch_avx2(const uint8_t* left, const uint8_t* right, size_t size) {
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    __m256i a0 = _mm256_loadu_si256((const __m256i*)(left + i));
+    __m256i b0 = _mm256_loadu_si256((const __m256i*)(right + i));
+    __m256i a1 = _mm256_loadu_si256((const __m256i*)(left + i + 32));
+    __m256i b1 = _mm256_loadu_si256((const __m256i*)(right + i + 32));
+    __m256i equal = _mm256_and_si256(_mm256_cmpeq_epi8(a0, b0), _mm256_cmpeq_epi8(a1, b1));
+    if ((uint32_t) _mm256_movemask_epi8(equal) != 0xffffffff) break;
+  }
+
+  for (; i + 32 <= size; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(left + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(right + i));
+    uint32_t equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+    if (equal != 0xffffffff) {
+      return i + __builtin_ctz(~equal);
+    }
+  }
+
+  return vm_bulk_mismatch_scalar(left, right, i, size);
+}
+
+#endif
+
+/*
+ * Returns the offset of the first byte which differs between left and right,
+ * or size if both ranges are equal
+ *
+ * The widest vector unit the cpu supports is picked at runtime
+ * */
+size_t vm_bulk_mismatch(const uint8_t* left, const uint8_t* right, size_t size) {
+#if VM_BULK_X86
+  if (size >= 32 && __builtin_cpu_supports("avx2")) {
+    return vm_bulk_mismatch_avx2(left, right, size);
+  }
+  return vm_bulk_mismatch_sse2(left, right, size);
+#else
+  return vm_bulk_mismatch_scalar(left, right, 0, size);
+#endif
+}
+
+/*
+ * Returns the offset of the first byte equal to value, or size if there is none
+ *
+ * memchr of the C library already selects a vectorized implementation at
+ * runtime, a hand written kernel wouldn't beat it
+ * */
+size_t vm_bulk_find(const uint8_t* data, uint8_t value, size_t size) {
+  const uint8_t* found = memchr(data, value, size);
+  return found ? (size_t)(found - data) : size;
+}
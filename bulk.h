@@ -0,0 +1,18 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef BULKH
+#define BULKH
+
+/*
+ * Kernels behind the bulk memory instructions (fill, cmpmem, findb)
+ *
+ * The callers check the bounds of both ranges once, the kernels
+ * don't look at the machine at all.
+ * */
+
+// Bulk memory methods
+size_t vm_bulk_mismatch(const uint8_t* left, const uint8_t* right, size_t size);
+size_t vm_bulk_find(const uint8_t* data, uint8_t value, size_t size);
+
+#endif
@@ -0,0 +1,287 @@
+#include <stdlib.h>
+#include <string.h>
+#include "compress.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define EXE_CRC_X86 1
+#else
+#define EXE_CRC_X86 0
+#endif
+
+// Parameters of the LZ4 block format, matches have to end 5 bytes before
+// the end of the block and may not start within its last 12 bytes
+#define EXE_MINMATCH     4
+#define EXE_LASTLITERALS 5
+#define EXE_MFLIMIT      12
+#define EXE_MAXOFFSET    65535
+
+// The compressor remembers the last position of every hashed 4 byte sequence
+#define EXE_HASHBITS 16
+
+// Reflected polynomial of CRC-32C, the variant x86 computes in hardware
+#define EXE_CRC_POLYNOMIAL 0x82f63b78
+
+static uint32_t exe_read32(const uint8_t* data) {
+  uint32_t value;
+  memcpy(&value, data, 4);
+  return value;
+}
+
+static uint32_t exe_hash(uint32_t sequence) {
+  return (sequence * 2654435761u) >> (32 - EXE_HASHBITS);
+}
+
+// Writes what is left of a length after the 15 which fit into the token
+static uint8_t* exe_write_length(uint8_t* output, size_t length) {
+  while (length >= 255) {
+    *output++ = 255;
+    length -= 255;
+  }
+
+  *output++ = length;
+  return output;
+}
+
+/*
+ * Write a sequence of literals followed by a match
+ *
+ * A match_length of 0 writes the last sequence, which only has literals
+ * */
+static uint8_t* exe_write_sequence(uint8_t* output, const uint8_t* literals, size_t literal_count,
+                                   size_t offset, size_t match_length) {
+  uint8_t* token = output++;
+  *token = (literal_count < 15 ? literal_count : 15) << 4;
+  if (literal_count >= 15) output = exe_write_length(output, literal_count - 15);
+
+  memcpy(output, literals, literal_count);
+  output += literal_count;
+  if (match_length == 0) return output;
+
+  *output++ = offset & 0xff;
+  *output++ = offset >> 8;
+
+  size_t rest = match_length - EXE_MINMATCH;
+  *token |= rest < 15 ? rest : 15;
+  if (rest >= 15) output = exe_write_length(output, rest - 15);
+  return output;
+}
+
+/*
+ * Compress source into target as one LZ4 block
+ *
+ * Greedy, every match found through the hash table is taken. Positions are
+ * skipped faster the longer no match was found, so incompressible data
+ * doesn't take much longer than a copy.
+ * Returns the size of the block, 0 if target is smaller than EXE_COMPRESS_BOUND
+ * or the hash table couldn't be allocated
+ * */
+size_t exe_compress(uint8_t* target, size_t target_size, const uint8_t* source, size_t source_size) {
+  if (target_size < EXE_COMPRESS_BOUND(source_size)) return 0;
+
+  uint32_t* table = calloc((size_t) 1 << EXE_HASHBITS, sizeof(uint32_t));
+  if (table == NULL) return 0;
+
+  uint8_t* output = target;
+  size_t anchor = 0;
+
+  if (source_size > EXE_MFLIMIT) {
+    size_t limit = source_size - EXE_MFLIMIT;
+    size_t match_limit = source_size - EXE_LASTLITERALS;
+    size_t misses = 0;
+    size_t i = 1;
+
+    while (i < limit) {
+      uint32_t sequence = exe_read32(source + i);
+      uint32_t hash = exe_hash(sequence);
+      size_t candidate = table[hash];
+      table[hash] = i;
+
+      if (i - candidate > EXE_MAXOFFSET || exe_read32(source + candidate) != sequence) {
+        i += 1 + (misses++ >> 6);
+        continue;
+      }
+
+      size_t length = EXE_MINMATCH;
+      while (i + length + 8 <= match_limit &&
+             *(uint64_t *)(source + i + length) == *(uint64_t *)(source + candidate + length)) {
+        length += 8;
+      }
+      while (i + length < match_limit && source[i + length] == source[candidate + length]) {
+        length++;
+      }
+
+      // Matches may also start before the sequence which was hashed
+      while (i > anchor && candidate > 0 && source[i - 1] == source[candidate - 1]) {
+        i--;
+        candidate--;
+        length++;
+      }
+
+      output = exe_write_sequence(output, source + anchor, i - anchor, i - candidate, length);
+      i += length;
+      anchor = i;
+      misses = 0;
+    }
+  }
+
+  output = exe_write_sequence(output, source + anchor, source_size - anchor, 0, 0);
+  free(table);
+  return output - target;
+}
+
+// Adds the bytes following a length of 15 to it
+static bool exe_read_length(const uint8_t** input, const uint8_t* end, size_t* length) {
+  uint8_t byte;
+  do {
+    if (*input == end) return false;
+    byte = *(*input)++;
+    *length += byte;
+  } while (byte == 255);
+
+  return true;
+}
+
+/*
+ * Decompress an LZ4 block into target
+ *
+ * Every length and offset is checked, a damaged block can't write outside
+ * of target. Overlapping matches repeat the bytes before them, they are copied
+ * in chunks which double in size instead of byte by byte.
+ * Returns false unless the block expands to exactly target_size bytes
+ * */
+bool exe_decompress(uint8_t* target, size_t target_size, const uint8_t* source, size_t source_size) {
+  const uint8_t* input = source;
+  const uint8_t* input_end = source + source_size;
+  uint8_t* output = target;
+  uint8_t* output_end = target + target_size;
+
+  while (input < input_end) {
+    uint8_t token = *input++;
+
+    size_t literal_count = token >> 4;
+    if (literal_count == 15 && !exe_read_length(&input, input_end, &literal_count)) return false;
+    if ((size_t)(input_end - input) < literal_count || (size_t)(output_end - output) < literal_count) {
+      return false;
+    }
+
+    memcpy(output, input, literal_count);
+    input += literal_count;
+    output += literal_count;
+
+    // The last sequence ends after its literals
+    if (input == input_end) break;
+
+    if (input_end - input < 2) return false;
+    size_t offset = input[0] | input[1] << 8;
+    input += 2;
+    if (offset == 0 || offset > (size_t)(output - target)) return false;
+
+    size_t length = token & 15;
+    if (length == 15 && !exe_read_length(&input, input_end, &length)) return false;
+    length += EXE_MINMATCH;
+    if ((size_t)(output_end - output) < length) return false;
+
+    const uint8_t* match = output - offset;
+    while (length > 0) {
+      size_t chunk = output - match;
+      if (chunk > length) chunk = length;
+      memcpy(output, match, chunk);
+      output += chunk;
+      length -= chunk;
+    }
+  }
+
+  return output == output_end;
+}
+
+// CRC-32C of every byte value, entry i is i shifted through EXE_CRC_POLYNOMIAL
+static const uint32_t exe_crc32_lookup[256] = {
+  0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c,
+  0x26a1e7e8, 0xd4ca64eb, 0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+  0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24, 0x105ec76f, 0xe235446c,
+  0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+  0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc,
+  0xbc267848, 0x4e4dfb4b, 0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+  0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35, 0xaa64d611, 0x580f5512,
+  0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+  0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad,
+  0x1642ae59, 0xe4292d5a, 0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+  0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595, 0x417b1dbc, 0xb3109ebf,
+  0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+  0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f,
+  0xed03a29b, 0x1f682198, 0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+  0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38, 0xdbfc821c, 0x2997011f,
+  0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+  0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e,
+  0x4767748a, 0xb50cf789, 0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+  0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46, 0x7198540d, 0x83f3d70e,
+  0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+  0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de,
+  0xdde0eb2a, 0x2f8b6829, 0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+  0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93, 0x082f63b7, 0xfa44e0b4,
+  0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+  0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b,
+  0xb4091bff, 0x466298fc, 0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+  0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033, 0xa24bb5a6, 0x502036a5,
+  0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+  0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975,
+  0x0e330a81, 0xfc588982, 0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+  0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622, 0x38cc2a06, 0xcaa7a905,
+  0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+  0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8,
+  0xe52cc12c, 0x1747422f, 0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+  0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0, 0xd3d3e1ab, 0x21b862a8,
+  0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+  0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78,
+  0x7fab5e8c, 0x8dc0dd8f, 0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+  0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1, 0x69e9f0d5, 0x9b8273d6,
+  0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+  0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69,
+  0xd5cf889d, 0x27a40b9e, 0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+  0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
+};
+
+// Table driven CRC-32C, one byte per step
+static uint32_t exe_crc32_table(uint32_t crc, const uint8_t* data, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    crc = exe_crc32_lookup[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+
+  return crc;
+}
+
+#if EXE_CRC_X86
+
+// 8 bytes per step, only used if the cpu supports SSE4.2
+__attribute__((target("sse4.2")))
+static uint32_t exe_crc32_sse42(uint32_t crc, const uint8_t* data, size_t size) {
+  uint64_t value = crc;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    value = _mm_crc32_u64(value, exe_read32(data + i) | (uint64_t) exe_read32(data + i + 4) << 32);
+  }
+
+  crc = value;
+  for (; i < size; i++) {
+    crc = _mm_crc32_u8(crc, data[i]);
+  }
+
+  return crc;
+}
+
+#endif
+
+/*
+ * Returns the CRC-32C of data
+ *
+ * The crc32 instruction is used if the cpu has it
+ * */
+uint32_t exe_crc32(const uint8_t* data, size_t size) {
+#if EXE_CRC_X86
+  if (__builtin_cpu_supports("sse4.2")) {
+    return ~exe_crc32_sse42(0xffffffff, data, size);
+  }
+#endif
+  return ~exe_crc32_table(0xffffffff, data, size);
+}
@@ -0,0 +1,27 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef COMPRESSH
+#define COMPRESSH
+
+/*
+ * Compression and checksums of version 2 executables (see exe.h)
+ *
+ * Compressed segments use the LZ4 block format: a sequence starts with a
+ * token byte holding the literal count in its high and the match length
+ * minus 4 in its low nibble, 15 meaning more bytes of 255 follow until a
+ * smaller one. The literals come next, then the offset of the match (u16,
+ * little endian) and the rest of the match length. The last sequence only
+ * has literals.
+ * */
+
+// Largest output exe_compress can produce for size bytes of input
+#define EXE_COMPRESS_BOUND(SIZE) ((SIZE) + (SIZE) / 255 + 16)
+
+// Compression methods
+size_t exe_compress(uint8_t* target, size_t target_size, const uint8_t* source, size_t source_size);
+bool exe_decompress(uint8_t* target, size_t target_size, const uint8_t* source, size_t source_size);
+uint32_t exe_crc32(const uint8_t* data, size_t size);
+
+#endif
@@ -0,0 +1,601 @@
+#include <stdlib.h>
+#include <string.h>
+#include "vm.h"
+#include "decode.h"
+#include "framebuffer.h"
+#include "trace.h"
+#include "verify.h"
+#include "aot.h"
+
+/*
+ * Decode the instruction at ip into inst
+ *
+ * Returns the length of the instruction, or 0 if the instruction
+ * doesn't fit into the machine's memory
+ * */
+uint64_t vm_decode(VM* vm, uint32_t ip, opcode instruction, VMInstruction* inst) {
+  uint8_t* code = vm->memory + ip;
+  uint64_t length;
+
+  switch (instruction) {
+    case op_loadi:
+      length = 1 + 1 + vm_reg_size(code[1]);
+      break;
+    case op_push:
+      length = (uint64_t) 1 + 4 + *(uint32_t *)(code + 1);
+      break;
+    default:
+      length = instruction < op_num_types ? opcode_length_lookup_table[instruction] : 1;
+      break;
+  }
+
+  // Check if there is enough memory for the instruction, in 64 bits as push
+  // sizes close to 4 GiB would wrap around
+  if ((uint64_t) ip + length >= vm->memory_size) {
+    return 0;
+  }
+
+  inst->next = ip + length;
+  inst->native = NULL;
+  inst->hits = 0;
+  inst->kind = instruction < op_num_types ? (uint16_t) instruction : handler_invalid;
+
+  switch (instruction) {
+
+    // reg
+    case op_rpush:
+    case op_rpop:
+    case op_rst:
+    case op_not:
+    case op_inttofp:
+    case op_sinttofp:
+    case op_fptoint:
+    case op_jzr:
+    case op_jmpr:
+    case op_callr:
+      inst->r1 = code[1];
+      break;
+
+    // reg, reg
+    case op_mov:
+    case op_add:
+    case op_sub:
+    case op_mul:
+    case op_div:
+    case op_idiv:
+    case op_rem:
+    case op_irem:
+    case op_fadd:
+    case op_fsub:
+    case op_fmul:
+    case op_fdiv:
+    case op_frem:
+    case op_fexp:
+    case op_flt:
+    case op_fgt:
+    case op_cmp:
+    case op_lt:
+    case op_gt:
+    case op_ult:
+    case op_ugt:
+    case op_shr:
+    case op_shl:
+    case op_and:
+    case op_xor:
+    case op_or:
+    case op_loadr:
+    case op_read:
+    case op_write:
+      inst->r1 = code[1];
+      inst->r2 = code[2];
+      break;
+
+    // reg, value
+    case op_loadi:
+      inst->r1 = code[1];
+      switch (vm_reg_size(code[1])) {
+        case 1:
+          inst->value = *(uint8_t *)(code + 2);
+          break;
+        case 2:
+          inst->value = *(uint16_t *)(code + 2);
+          break;
+        case 4:
+          inst->value = *(uint32_t *)(code + 2);
+          break;
+        default:
+          inst->value = *(uint64_t *)(code + 2);
+          break;
+      }
+      break;
+
+    // reg, imm32
+    case op_load:
+    case op_readc:
+    case op_writes:
+      inst->r1 = code[1];
+      inst->a = *(uint32_t *)(code + 2);
+      break;
+
+    // imm32, reg
+    case op_store:
+    case op_reads:
+    case op_writec:
+      inst->a = *(uint32_t *)(code + 1);
+      inst->r1 = code[5];
+      break;
+
+    // imm32, imm32
+    case op_loads:
+    case op_readcs:
+    case op_writecs:
+      inst->a = *(uint32_t *)(code + 1);
+      inst->b = *(uint32_t *)(code + 5);
+      break;
+
+    // size, reg
+    //
+    // The offset register overlaps with the size, this is how
+    // the instruction has always been decoded
+    case op_loadsr:
+      inst->a = *(uint32_t *)(code + 1);
+      inst->r2 = code[2];
+      break;
+
+    // size, data
+    case op_push:
+      inst->a = *(uint32_t *)(code + 1);
+      break;
+
+    // reg, imm32, reg
+    case op_copy:
+      inst->r1 = code[1];
+      inst->a = *(uint32_t *)(code + 2);
+      inst->r2 = code[6];
+      break;
+
+    // imm32, imm32, imm32
+    case op_copyc:
+      inst->a = *(uint32_t *)(code + 1);
+      inst->b = *(uint32_t *)(code + 5);
+      inst->c = *(uint32_t *)(code + 9);
+      break;
+
+    // reg, reg, reg
+    //
+    // The third register is kept in a, so the decoded instruction doesn't grow
+    case op_fill:
+    case op_cmpmem:
+    case op_findb:
+      inst->r1 = code[1];
+      inst->r2 = code[2];
+      inst->a = code[3];
+      break;
+
+    // address
+    case op_jz:
+    case op_jmp:
+    case op_call:
+      inst->a = *(uint32_t *)(code + 1);
+      break;
+
+    default:
+      break;
+  }
+
+  return length;
+}
+
+// Registers the interpreter keeps in locals while it runs, see vm_loop.h
+static bool vm_decode_is_cached_reg(uint8_t reg) {
+  uint8_t code = reg & VM_CODEMASK;
+  return code == ((VM_REGIP) & VM_CODEMASK) || code == ((VM_REGFLAGS) & VM_CODEMASK);
+}
+
+/*
+ * Returns true if a register operand of the freshly decoded instruction is
+ * the instruction pointer or the flags register
+ *
+ * The operands are the ones vm_decode extracts for the opcode
+ * */
+static bool vm_decode_names_cached_reg(VMInstruction* inst) {
+  switch (inst->kind) {
+
+    // reg
+    case op_rpush:
+    case op_rpop:
+    case op_rst:
+    case op_not:
+    case op_inttofp:
+    case op_sinttofp:
+    case op_fptoint:
+    case op_jzr:
+    case op_jmpr:
+    case op_callr:
+    case op_loadi:
+    case op_load:
+    case op_readc:
+    case op_writes:
+    case op_store:
+    case op_reads:
+    case op_writec:
+      return vm_decode_is_cached_reg(inst->r1);
+
+    // reg, reg
+    case op_mov:
+    case op_add:
+    case op_sub:
+    case op_mul:
+    case op_div:
+    case op_idiv:
+    case op_rem:
+    case op_irem:
+    case op_fadd:
+    case op_fsub:
+    case op_fmul:
+    case op_fdiv:
+    case op_frem:
+    case op_fexp:
+    case op_flt:
+    case op_fgt:
+    case op_cmp:
+    case op_lt:
+    case op_gt:
+    case op_ult:
+    case op_ugt:
+    case op_shr:
+    case op_shl:
+    case op_and:
+    case op_xor:
+    case op_or:
+    case op_loadr:
+    case op_read:
+    case op_write:
+    case op_copy:
+      return vm_decode_is_cached_reg(inst->r1) || vm_decode_is_cached_reg(inst->r2);
+
+    case op_loadsr:
+      return vm_decode_is_cached_reg(inst->r2);
+
+    // reg, reg, reg
+    case op_fill:
+    case op_cmpmem:
+    case op_findb:
+      return vm_decode_is_cached_reg(inst->r1) || vm_decode_is_cached_reg(inst->r2) ||
+             vm_decode_is_cached_reg(inst->a);
+
+    default:
+      return false;
+  }
+}
+
+/*
+ * Try to fuse the decoded instruction at ip with the one following it
+ *
+ * A fused pair is executed by a single handler. The operands of the second
+ * instruction are stored in the unused fields of the first one, c receives
+ * the address after the second instruction:
+ *
+ * cmp, lt, gt, ult, ugt followed by jz   r1, r2 compared registers, a jump target
+ * loadi followed by an ALU instruction   r1, value loadi, a, b registers of the ALU instruction
+ * rpush followed by call                 r1 pushed register, a call target
+ * push followed by call                  a size of the pushed data, b call target
+ *
+ * The pair has to fit into VM_INSTRUCTION_MAXLENGTH bytes, so writes to
+ * either of the instructions invalidate it (see vm_memory_written)
+ * */
+static void vm_decode_fuse(VM* vm, uint32_t ip, VMInstruction* inst) {
+  uint32_t address = inst->next;
+  VMInstruction second;
+
+  if (!vm_legal_address(vm, address)) return;
+  if (vm_decode(vm, address, vm->memory[address], &second) == 0) return;
+  if (second.next - ip > VM_INSTRUCTION_MAXLENGTH) return;
+  if (vm_decode_names_cached_reg(&second)) return;
+
+  uint16_t kind;
+  switch (inst->kind) {
+    case op_cmp:
+    case op_lt:
+    case op_gt:
+    case op_ult:
+    case op_ugt:
+      if (second.kind != op_jz) return;
+      switch (inst->kind) {
+        case op_cmp:
+          kind = handler_cmp_jz;
+          break;
+        case op_lt:
+          kind = handler_lt_jz;
+          break;
+        case op_gt:
+          kind = handler_gt_jz;
+          break;
+        case op_ult:
+          kind = handler_ult_jz;
+          break;
+        default:
+          kind = handler_ugt_jz;
+          break;
+      }
+
+      inst->a = second.a;
+      break;
+
+    case op_loadi:
+      switch (second.kind) {
+        case op_add:
+          kind = handler_loadi_add;
+          break;
+        case op_sub:
+          kind = handler_loadi_sub;
+          break;
+        case op_mul:
+          kind = handler_loadi_mul;
+          break;
+        case op_and:
+          kind = handler_loadi_and;
+          break;
+        case op_xor:
+          kind = handler_loadi_xor;
+          break;
+        case op_or:
+          kind = handler_loadi_or;
+          break;
+        case op_cmp:
+          kind = handler_loadi_cmp;
+          break;
+        case op_lt:
+          kind = handler_loadi_lt;
+          break;
+        case op_gt:
+          kind = handler_loadi_gt;
+          break;
+        case op_ult:
+          kind = handler_loadi_ult;
+          break;
+        case op_ugt:
+          kind = handler_loadi_ugt;
+          break;
+        default:
+          return;
+      }
+
+      inst->a = second.r1;
+      inst->b = second.r2;
+      break;
+
+    case op_rpush:
+      if (second.kind != op_call) return;
+      kind = handler_rpush_call;
+      inst->a = second.a;
+      break;
+
+    // Calls push the size of their arguments right before the call
+    case op_push:
+      if (second.kind != op_call) return;
+      kind = handler_push_call;
+      inst->b = second.a;
+      break;
+
+    default:
+      return;
+  }
+
+  inst->kind = kind;
+  inst->c = second.next;
+}
+
+// Byte variant of the width specialized handler of each opcode, 0 if there is none
+static const uint16_t width_handlers[op_num_types] = {
+#define VM_WIDTH_HANDLER_ENTRY(OP) [op_##OP] = handler_##OP##_byte,
+  VM_WIDTH_HANDLERS(VM_WIDTH_HANDLER_ENTRY)
+#undef VM_WIDTH_HANDLER_ENTRY
+};
+
+/*
+ * Select the handler matching the width of the target register
+ *
+ * The variants are ordered byte, word, dword, qword, while the mode
+ * bits of these widths count down from 3 to 0
+ * */
+static void vm_decode_specialize(VMInstruction* inst) {
+  if (inst->kind >= op_num_types || width_handlers[inst->kind] == 0) return;
+  inst->kind = width_handlers[inst->kind] + 3 - ((inst->r1 & VM_MODEMASK) >> 6);
+}
+
+/*
+ * Select the handler without range checks for a verified instruction
+ *
+ * The verifier made sure the constant range of the instruction is inside
+ * memory (see verify.h), readc has already been specialized by width
+ * */
+static void vm_decode_trust(VMInstruction* inst) {
+  switch (inst->kind) {
+    case op_readcs:
+      inst->kind = handler_readcs_trusted;
+      break;
+    case op_writec:
+      inst->kind = handler_writec_trusted;
+      break;
+    case op_writecs:
+      inst->kind = handler_writecs_trusted;
+      break;
+    case op_copyc:
+      inst->kind = handler_copyc_trusted;
+      break;
+    case handler_readc_byte:
+    case handler_readc_word:
+    case handler_readc_dword:
+    case handler_readc_qword:
+      inst->kind += handler_readc_trusted_byte - handler_readc_byte;
+      break;
+    default:
+      break;
+  }
+}
+
+/*
+ * Returns the decoded instruction at ip, decoding it if it isn't cached yet
+ *
+ * Instructions which can't be cached are decoded into scratch
+ * Returns NULL if the instruction doesn't fit into the machine's memory
+ * */
+VMInstruction* vm_decode_cached(VM* vm, uint32_t ip, VMInstruction* scratch) {
+  uint64_t length = vm_decode(vm, ip, vm->memory[ip], scratch);
+
+  if (length == 0) {
+    return NULL;
+  }
+
+  // The interpreter keeps the instruction pointer and the flags in locals unless
+  // it profiles, instructions which name them as operands run through vm_execute
+  if (vm->profile == NULL && vm_decode_names_cached_reg(scratch)) {
+    scratch->kind = handler_synced;
+  }
+
+  if (length > VM_INSTRUCTION_MAXLENGTH) {
+    return scratch;
+  }
+
+  VMCodePage* page = vm->code_pages[ip >> VM_CODEPAGE_SHIFT];
+  if (page == NULL) {
+    page = calloc(1, sizeof(VMCodePage));
+
+    // Not being able to cache an instruction isn't fatal
+    if (page == NULL) {
+      return scratch;
+    }
+
+    vm->code_pages[ip >> VM_CODEPAGE_SHIFT] = page;
+  }
+
+  VMInstruction* inst = page->instructions + (ip & VM_CODEPAGE_MASK);
+  *inst = *scratch;
+
+  // The profiler counts instructions by opcode, see vm_profile_enable,
+  // a trace records every instruction on its own (see vm_trace_enable)
+  if (vm->profile == NULL) {
+    if (vm->trace == NULL) vm_decode_fuse(vm, ip, inst);
+    vm_decode_specialize(inst);
+    if (vm_verified(vm, ip)) vm_decode_trust(inst);
+  }
+
+  return inst;
+}
+
+/*
+ * Drop every decoded instruction
+ * */
+void vm_decode_flush(VM* vm) {
+  for (uint64_t i = 0; i < VM_CODEPAGE_COUNT(vm->memory_size); i++) {
+    free(vm->code_pages[i]);
+    vm->code_pages[i] = NULL;
+  }
+}
+
+/*
+ * Drop the compiled blocks of a page
+ *
+ * Hit counters start over, so blocks which are still hot get compiled again
+ * */
+void vm_decode_drop_native(VMCodePage* page) {
+  for (int i = 0; i < VM_CODEPAGE_SIZE; i++) {
+    page->instructions[i].native = NULL;
+    page->instructions[i].hits = 0;
+  }
+
+  page->has_native = false;
+}
+
+/*
+ * Notify the machine that a range of its memory was modified
+ *
+ * Invalidates all cached instructions which overlap with the range,
+ * every write to the machine's memory has to go through here. Compiled
+ * blocks are dropped for the whole page, as they span multiple instructions.
+ * Writes into VRAM are also reported to the framebuffer, if there is one,
+ * and every write to the trace. Overwritten instructions lose their verification,
+ * translated blocks holding them aren't entered anymore.
+ * */
+void vm_memory_written(VM* vm, uint32_t address, uint32_t size) {
+  if (size == 0) return;
+
+  if (vm->framebuffer && (uint64_t) address + size > VM_VRAM && address < VM_VRAM + VM_VRAMSIZE) {
+    vm_framebuffer_written(vm, address, size);
+  }
+
+  if (vm->trace) {
+    vm_trace_written(vm, address, size);
+  }
+
+  if (vm->verified) {
+    vm_verify_written(vm, address, size);
+  }
+
+  if (vm->aot) {
+    vm_aot_written(vm, address, size);
+  }
+
+  // Instructions starting before the range can still overlap with it
+  uint64_t start = address;
+  uint64_t end = (uint64_t) address + size;
+  start = start < VM_INSTRUCTION_MAXLENGTH ? 0 : start - (VM_INSTRUCTION_MAXLENGTH - 1);
+  if (end > vm->memory_size) end = vm->memory_size;
+
+  while (start < end) {
+    uint64_t page_end = (start | VM_CODEPAGE_MASK) + 1;
+    if (page_end > end) page_end = end;
+
+    VMCodePage* page = vm->code_pages[start >> VM_CODEPAGE_SHIFT];
+    if (page) {
+      if (page->has_native) {
+        vm_decode_drop_native(page);
+      }
+
+      for (uint64_t i = start; i < page_end; i++) {
+        page->instructions[i & VM_CODEPAGE_MASK].next = 0;
+      }
+    }
+
+    start = page_end;
+  }
+}
+
+// Names of the fused handlers, as shown by vm_decode_stats
+static const char* fused_handler_names[handler_num_types] = {
+  [handler_cmp_jz] = "cmp, jz",
+  [handler_lt_jz] = "lt, jz",
+  [handler_gt_jz] = "gt, jz",
+  [handler_ult_jz] = "ult, jz",
+  [handler_ugt_jz] = "ugt, jz",
+  [handler_loadi_add] = "loadi, add",
+  [handler_loadi_sub] = "loadi, sub",
+  [handler_loadi_mul] = "loadi, mul",
+  [handler_loadi_and] = "loadi, and",
+  [handler_loadi_xor] = "loadi, xor",
+  [handler_loadi_or] = "loadi, or",
+  [handler_loadi_cmp] = "loadi, cmp",
+  [handler_loadi_lt] = "loadi, lt",
+  [handler_loadi_gt] = "loadi, gt",
+  [handler_loadi_ult] = "loadi, ult",
+  [handler_loadi_ugt] = "loadi, ugt",
+  [handler_rpush_call] = "rpush, call",
+  [handler_push_call] = "push, call"
+};
+
+/*
+ * Print how often each fused pair of instructions was executed
+ * */
+void vm_decode_stats(VM* vm, FILE* out) {
+  uint64_t total = 0;
+
+  fprintf(out, "Fused instructions:\n");
+  for (int i = handler_invalid + 1; i < handler_num_types; i++) {
+    if (vm->fused_counts[i] == 0) continue;
+    fprintf(out, "  %-12s %12llu\n", fused_handler_names[i], (unsigned long long) vm->fused_counts[i]);
+    total += vm->fused_counts[i];
+  }
+
+  fprintf(out, "  %-12s %12llu\n", "total", (unsigned long long) total);
+}
@@ -0,0 +1,131 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "vm.h"
+
+#ifndef DECODEH
+#define DECODEH
+
+// The decode cache splits the machine's memory into pages of this size,
+// VM_CODEPAGE_COUNT is the number of pages memory of the given size needs
+#define VM_CODEPAGE_SHIFT 10
+#define VM_CODEPAGE_SIZE  (1 << VM_CODEPAGE_SHIFT)
+#define VM_CODEPAGE_MASK  (VM_CODEPAGE_SIZE - 1)
+#define VM_CODEPAGE_COUNT(MEMORYSIZE) (((uint64_t)(MEMORYSIZE) + VM_CODEPAGE_SIZE - 1) >> VM_CODEPAGE_SHIFT)
+
+// Instructions longer than this are decoded every time they run
+// This only affects push instructions with big immediate values
+#define VM_INSTRUCTION_MAXLENGTH 16
+
+/*
+ * Instructions with one handler per width of the register they write
+ * (or push, in the case of rpush)
+ *
+ * The decode cache selects the variant (handler_mov_byte, handler_mov_word, ...)
+ * matching the mode bits of r1, so these handlers don't have to look at the
+ * width at runtime
+ * */
+#define VM_WIDTH_HANDLERS(X)                                                   \
+  X(rpush)                                                                     \
+  X(rpop)                                                                      \
+  X(mov)                                                                       \
+  X(loadi)                                                                     \
+  X(rst)                                                                       \
+  X(add)                                                                       \
+  X(sub)                                                                       \
+  X(mul)                                                                       \
+  X(div)                                                                       \
+  X(idiv)                                                                      \
+  X(rem)                                                                       \
+  X(irem)                                                                      \
+  X(not)                                                                       \
+  X(load)                                                                      \
+  X(loadr)                                                                     \
+  X(read)                                                                      \
+  X(readc)
+
+/*
+ * Handlers the decoder can select for an instruction
+ *
+ * The first op_num_types handlers correspond to the opcode of the same value
+ * */
+typedef enum {
+  handler_invalid = op_num_types,
+
+  // Fused pairs of instructions, see vm_decode_fuse
+  handler_cmp_jz,
+  handler_lt_jz,
+  handler_gt_jz,
+  handler_ult_jz,
+  handler_ugt_jz,
+  handler_loadi_add,
+  handler_loadi_sub,
+  handler_loadi_mul,
+  handler_loadi_and,
+  handler_loadi_xor,
+  handler_loadi_or,
+  handler_loadi_cmp,
+  handler_loadi_lt,
+  handler_loadi_gt,
+  handler_loadi_ult,
+  handler_loadi_ugt,
+  handler_rpush_call,
+  handler_push_call,
+
+  // Width specialized handlers, see VM_WIDTH_HANDLERS
+#define VM_WIDTH_HANDLER_KINDS(OP)                                             \
+  handler_##OP##_byte,                                                         \
+  handler_##OP##_word,                                                         \
+  handler_##OP##_dword,                                                        \
+  handler_##OP##_qword,
+  VM_WIDTH_HANDLERS(VM_WIDTH_HANDLER_KINDS)
+
+  // Verified instructions without range checks, see vm_decode_trust
+  handler_readcs_trusted,
+  handler_writec_trusted,
+  handler_writecs_trusted,
+  handler_copyc_trusted,
+  VM_WIDTH_HANDLER_KINDS(readc_trusted)
+#undef VM_WIDTH_HANDLER_KINDS
+
+  // Instructions naming the instruction pointer or the flags register, see vm_decode_cached
+  handler_synced,
+
+  handler_num_types
+} VMHandler;
+
+/*
+ * A pre-decoded instruction
+ *
+ * All operands are extracted from the machine's memory, so the interpreter
+ * doesn't have to parse the instruction again. A next value of 0 marks an
+ * entry which hasn't been decoded (or was invalidated).
+ * */
+typedef struct VMInstruction {
+  const void* handler;  // label of the handler in the threaded interpreter
+  void* native;         // compiled block starting here, see jit.h
+  uint64_t value;       // immediate value of loadi
+  uint32_t next;        // address of the following instruction
+  uint32_t a;           // 32-bit immediates (addresses, sizes, offsets)
+  uint32_t b;
+  uint32_t c;
+  uint8_t r1;           // register operands
+  uint8_t r2;
+  uint16_t kind;        // VMHandler used by the switch based interpreter
+  uint32_t hits;        // number of times a block was entered here
+} VMInstruction;
+
+// A page of decoded instructions, indexed by their address inside the page
+typedef struct VMCodePage {
+  VMInstruction instructions[VM_CODEPAGE_SIZE];
+  bool has_native; // set if any compiled block starts on this page
+} VMCodePage;
+
+// Decode cache methods
+uint64_t vm_decode(VM* vm, uint32_t ip, opcode instruction, VMInstruction* inst);
+VMInstruction* vm_decode_cached(VM* vm, uint32_t ip, VMInstruction* scratch);
+void vm_decode_flush(VM* vm);
+void vm_decode_drop_native(VMCodePage* page);
+void vm_decode_stats(VM* vm, FILE* out);
+
+#endif
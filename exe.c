@@ -1,12 +1,48 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "exe.h"
+#include "compress.h"
+
+/*
+ * Check the load table of a version 2 executable
+ *
+ * Stored segments have to be inside the data, zero segments don't store
+ * anything and can't be compressed at the same time
+ * */
+static ExecutableError exe_check_segments(Header* header, size_t data_size) {
+  for (size_t i = 0; i < header->load_table_size; i++) {
+    LoadEntry* entry = header->load_table + i;
+    if (entry->offset == EXE_MEMORY_REQUEST) continue;
+
+    uint32_t known = EXE_SEGMENT_ZERO | EXE_SEGMENT_COMPRESSED | EXE_SEGMENT_READONLY | EXE_SEGMENT_EXEC;
+    if (entry->flags & ~known) return exe_err_invalid_segment;
+
+    if (entry->flags & EXE_SEGMENT_ZERO) {
+      if (entry->size != 0 || (entry->flags & EXE_SEGMENT_COMPRESSED)) return exe_err_invalid_segment;
+      continue;
+    }
+
+    if ((uint64_t) entry->offset + entry->size > data_size) return exe_err_invalid_segment;
+    if (!(entry->flags & EXE_SEGMENT_COMPRESSED) && entry->size != entry->memory_size) {
+      return exe_err_invalid_segment;
+    }
+  }
+
+  return exe_err_success;
+}
 
 /*
  * Parse an executable from buffer
+ *
+ * If copy is false, the data segment is used in place and has to
+ * outlive the executable. The load table is always copied, as the
+ * entries of both versions differ from LoadEntry.
  * */
-ExecutableError exe_create(Executable** result, uint8_t* buffer, size_t size) {
+static ExecutableError exe_parse(Executable** result, uint8_t* buffer, size_t size, bool copy) {
 
   // Make sure the specified buffer is big enough to contain the
   // minimum neccessary fields
@@ -14,88 +50,393 @@ ExecutableError exe_create(Executable** result, uint8_t* buffer, size_t size) {
     return exe_err_too_small;
   }
 
-  // Check the magic number
-  if (buffer[0] != 'N' || buffer[1] != 'I' || buffer[2] != 'C' || buffer[3] != 'E') {
+  // Check the magic number, versioned executables have their own
+  uint32_t magic = *(uint32_t *) buffer;
+  if (magic != EXE_HEADER_MAGIC && magic != EXE_HEADER_V2MAGIC) {
     return exe_err_invalid_magicnum;
   }
 
-  // Allocate and initialize the Header struct
-  Header* header = calloc(1, sizeof(Header));
-  if (!header) {
-    return exe_err_allocation;
+  uint32_t version = 1;
+  size_t header_size = EXE_HEADER_MINSIZE;
+  size_t entry_size = EXE_ENTRY_SIZE;
+  uint32_t* fields = (uint32_t *) buffer + 1;
+
+  if (magic == EXE_HEADER_V2MAGIC) {
+    if (size < EXE_HEADER_V2SIZE) {
+      return exe_err_too_small;
+    }
+
+    version = fields[0];
+    if (version != EXE_VERSION) {
+      return exe_err_unsupported_version;
+    }
+
+    // The checksum covers everything after it, including the entry address
+    if (exe_crc32(buffer + 12, size - 12) != fields[1]) {
+      return exe_err_checksum;
+    }
+
+    header_size = EXE_HEADER_V2SIZE;
+    entry_size = EXE_ENTRY_V2SIZE;
+    fields += 2;
   }
 
   // Read the entry address and the load table size
-  uint32_t entry_addr = *((uint32_t *) buffer + 1);
-  size_t load_table_size = *((uint32_t *) buffer + 2);
-
-  header->entry_addr = entry_addr;
-  header->load_table_size = load_table_size;
+  uint32_t entry_addr = fields[0];
+  size_t load_table_size = fields[1];
 
   // Check if there is enough memory for the load table
-  if ((size - 12) < load_table_size * 12) {
+  if ((size - header_size) / entry_size < load_table_size) {
     return exe_err_too_small;
   }
 
-  // Allocate space for the load table
+  // Allocate and initialize the Header struct
+  Header* header = calloc(1, sizeof(Header));
   LoadEntry* load_table = malloc(load_table_size * sizeof(LoadEntry));
-  if (!load_table) {
+  if (!header || (!load_table && load_table_size > 0)) {
+    free(header);
+    free(load_table);
     return exe_err_allocation;
   }
 
+  header->version = version;
+  header->entry_addr = entry_addr;
+  header->load_table_size = load_table_size;
   header->load_table = load_table;
 
   // Populate the table with the entries from the buffer
-  for (int i = 0; i < load_table_size; i++) {
-    load_table[i].offset = ((uint32_t *) buffer + 3 + (i * 3))[0];
-    load_table[i].size   = ((uint32_t *) buffer + 3 + (i * 3))[1];
-    load_table[i].load   = ((uint32_t *) buffer + 3 + (i * 3))[2];
+  for (size_t i = 0; i < load_table_size; i++) {
+    uint32_t* entry = (uint32_t *)(buffer + header_size + i * entry_size);
+    load_table[i].offset = entry[0];
+    load_table[i].size   = entry[1];
+    load_table[i].load   = entry[2];
+    load_table[i].memory_size = version == 1 ? entry[1] : entry[3];
+    load_table[i].flags       = version == 1 ? 0 : entry[4];
+  }
+
+  // Pick up the memory size request, if there is one
+  for (size_t i = 0; i < load_table_size; i++) {
+    if (header->load_table[i].offset == EXE_MEMORY_REQUEST) {
+      header->memory_size = header->load_table[i].load;
+    }
+  }
+
+  size_t data_segment_size = size - header_size - (load_table_size * entry_size);
+  uint8_t* input_data = buffer + header_size + (load_table_size * entry_size);
+  uint8_t* data_segment = input_data;
+
+  if (version > 1) {
+    ExecutableError segments_result = exe_check_segments(header, data_segment_size);
+    if (segments_result != exe_err_success) {
+      free(load_table);
+      free(header);
+      return segments_result;
+    }
   }
 
   // Allocate space for the executable
   *result = malloc(sizeof(Executable));
   if (!(*result)) {
+    free(load_table);
+    free(header);
     return exe_err_allocation;
   }
 
-  size_t data_segment_size = size - 12 - (load_table_size * 12);
-  uint8_t* input_data = buffer + 12 + (load_table_size * 12);
+  if (copy) {
 
-  // Allocate space for the data segment
-  uint8_t* data_segment = malloc(data_segment_size);
-  if (!data_segment) {
-    return exe_err_allocation;
-  }
+    // Allocate space for the data segment
+    data_segment = malloc(data_segment_size);
+    if (!data_segment) {
+      free(*result);
+      free(load_table);
+      free(header);
+      return exe_err_allocation;
+    }
 
-  // Copy the data segment from the input buffer into the buffer
-  // we just allocated
-  memcpy(data_segment, input_data, data_segment_size);
+    // Copy the data segment from the input buffer into the buffer
+    // we just allocated
+    memcpy(data_segment, input_data, data_segment_size);
+  }
 
   (*result)->header = header;
   (*result)->data = data_segment;
   (*result)->data_size = data_segment_size;
+  (*result)->fd = -1;
+  (*result)->data_offset = input_data - buffer;
+  (*result)->mapping = NULL;
+  (*result)->mapping_size = 0;
+
+  return exe_err_success;
+}
+
+/*
+ * Parse an executable from buffer
+ * */
+ExecutableError exe_create(Executable** result, uint8_t* buffer, size_t size) {
+  return exe_parse(result, buffer, size, true);
+}
+
+/*
+ * Map an executable from a file
+ *
+ * Only the load table is copied, the data stays in the mapping. The file
+ * descriptor is duplicated, so the caller may close its own.
+ * */
+ExecutableError exe_map(Executable** result, int fd) {
+  struct stat input_stat;
+  if (fstat(fd, &input_stat) < 0 || !S_ISREG(input_stat.st_mode)) {
+    return exe_err_io;
+  }
+
+  size_t size = input_stat.st_size;
+  if (size < EXE_HEADER_MINSIZE) {
+    return exe_err_too_small;
+  }
+
+  uint8_t* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mapping == MAP_FAILED) {
+    return exe_err_io;
+  }
+
+  ExecutableError err = exe_parse(result, mapping, size, false);
+  if (err != exe_err_success) {
+    munmap(mapping, size);
+    return err;
+  }
+
+  (*result)->fd = dup(fd);
+  (*result)->mapping = mapping;
+  (*result)->mapping_size = size;
+
+  if ((*result)->fd < 0) {
+    exe_clean(*result);
+    return exe_err_io;
+  }
 
   return exe_err_success;
 }
 
+// Runs of at least this many zero bytes become zero segments when packing
+#define EXE_PACK_ZERORUN 256
+
+// Load table and data of an executable being packed
+typedef struct ExePacker {
+  LoadEntry* entries;
+  size_t entry_count;
+  size_t entry_capacity;
+  uint8_t* data;
+  size_t data_size;
+  size_t data_capacity;
+} ExePacker;
+
+// Append an entry to the load table
+static bool exe_pack_entry(ExePacker* packer, LoadEntry entry) {
+  if (packer->entry_count == packer->entry_capacity) {
+    size_t capacity = packer->entry_capacity ? packer->entry_capacity * 2 : 16;
+    LoadEntry* entries = realloc(packer->entries, capacity * sizeof(LoadEntry));
+    if (entries == NULL) return false;
+    packer->entries = entries;
+    packer->entry_capacity = capacity;
+  }
+
+  packer->entries[packer->entry_count++] = entry;
+  return true;
+}
+
+// Make room for size more bytes of data
+static bool exe_pack_reserve(ExePacker* packer, size_t size) {
+  if (packer->data_capacity - packer->data_size >= size) return true;
+
+  size_t capacity = packer->data_capacity ? packer->data_capacity : 4096;
+  while (capacity - packer->data_size < size) capacity *= 2;
+
+  uint8_t* data = realloc(packer->data, capacity);
+  if (data == NULL) return false;
+  packer->data = data;
+  packer->data_capacity = capacity;
+  return true;
+}
+
+/*
+ * Append the bytes a segment loads to the packed executable
+ *
+ * Compressed unless that saves less than an eighth of them
+ * */
+static bool exe_pack_bytes(ExePacker* packer, const uint8_t* bytes, uint32_t size, uint32_t load, uint32_t flags) {
+  size_t bound = EXE_COMPRESS_BOUND((size_t) size);
+  if (!exe_pack_reserve(packer, bound)) return false;
+
+  LoadEntry entry = { packer->data_size, size, load, size, flags };
+  size_t compressed = exe_compress(packer->data + packer->data_size, bound, bytes, size);
+  if (compressed > 0 && compressed < size - size / 8) {
+    entry.size = compressed;
+    entry.flags |= EXE_SEGMENT_COMPRESSED;
+  } else {
+    memcpy(packer->data + packer->data_size, bytes, size);
+  }
+
+  packer->data_size += entry.size;
+  return exe_pack_entry(packer, entry);
+}
+
+/*
+ * Append a segment, runs of zeros are split off into zero segments
+ * */
+static bool exe_pack_segment(ExePacker* packer, const uint8_t* bytes, uint32_t size, uint32_t load, uint32_t flags) {
+  uint32_t start = 0;
+  uint32_t i = 0;
+
+  while (i < size) {
+    if (bytes[i] != 0) {
+      i++;
+      continue;
+    }
+
+    uint32_t run = i;
+    while (i < size && bytes[i] == 0) i++;
+    if (i - run < EXE_PACK_ZERORUN) continue;
+
+    if (run > start && !exe_pack_bytes(packer, bytes + start, run - start, load + start, flags)) return false;
+
+    LoadEntry zero = { 0, 0, load + run, i - run, flags | EXE_SEGMENT_ZERO };
+    if (!exe_pack_entry(packer, zero)) return false;
+    start = i;
+  }
+
+  if (size > start || size == 0) {
+    return exe_pack_bytes(packer, bytes + start, size - start, load + start, flags);
+  }
+
+  return true;
+}
+
+/*
+ * Write an executable in the version 2 format
+ *
+ * Segments are split at runs of zeros, which aren't stored anymore, and the
+ * remaining bytes are compressed (see exe_pack_bytes). Segments of version 2
+ * executables keep their readonly and exec markers. Executables without
+ * segments get one which loads their data at address 0, like vm_flash does.
+ * packed_size receives the size of the written executable.
+ * */
+ExecutableError exe_pack(Executable* exe, FILE* output, size_t* packed_size) {
+  ExePacker packer = { 0 };
+  ExecutableError result = exe_err_success;
+  bool loads = false;
+
+  for (size_t i = 0; i < exe->header->load_table_size && result == exe_err_success; i++) {
+    LoadEntry entry = exe->header->load_table[i];
+    uint32_t markers = entry.flags & (EXE_SEGMENT_READONLY | EXE_SEGMENT_EXEC);
+
+    if (entry.offset == EXE_MEMORY_REQUEST) {
+      entry.memory_size = 0;
+      entry.flags = 0;
+      if (!exe_pack_entry(&packer, entry)) result = exe_err_allocation;
+      continue;
+    }
+
+    loads = true;
+    if (entry.flags & EXE_SEGMENT_ZERO) {
+      if (!exe_pack_entry(&packer, entry)) result = exe_err_allocation;
+      continue;
+    }
+
+    if ((uint64_t) entry.offset + entry.size > exe->data_size) {
+      result = exe_err_invalid_segment;
+      break;
+    }
+
+    uint8_t* bytes = exe->data + entry.offset;
+    uint8_t* expanded = NULL;
+    if (entry.flags & EXE_SEGMENT_COMPRESSED) {
+      expanded = malloc(entry.memory_size ? entry.memory_size : 1);
+      if (expanded == NULL) {
+        result = exe_err_allocation;
+        break;
+      }
+
+      if (!exe_decompress(expanded, entry.memory_size, bytes, entry.size)) result = exe_err_invalid_segment;
+      bytes = expanded;
+    }
+
+    if (result == exe_err_success && !exe_pack_segment(&packer, bytes, entry.memory_size, entry.load, markers)) {
+      result = exe_err_allocation;
+    }
+
+    free(expanded);
+  }
+
+  if (result == exe_err_success && !loads &&
+      !exe_pack_segment(&packer, exe->data, exe->data_size, 0, 0)) {
+    result = exe_err_allocation;
+  }
+
+  // The checksum covers the file from the entry address on, so it's assembled in one piece
+  size_t table_size = packer.entry_count * EXE_ENTRY_V2SIZE;
+  size_t size = EXE_HEADER_V2SIZE + table_size + packer.data_size;
+  uint8_t* file = result == exe_err_success ? malloc(size) : NULL;
+  if (result == exe_err_success && file == NULL) result = exe_err_allocation;
+
+  if (result == exe_err_success) {
+    uint32_t* header = (uint32_t *) file;
+    header[0] = EXE_HEADER_V2MAGIC;
+    header[1] = EXE_VERSION;
+    header[3] = exe->header->entry_addr;
+    header[4] = packer.entry_count;
+
+    for (size_t i = 0; i < packer.entry_count; i++) {
+      uint32_t* entry = (uint32_t *)(file + EXE_HEADER_V2SIZE + i * EXE_ENTRY_V2SIZE);
+      entry[0] = packer.entries[i].offset;
+      entry[1] = packer.entries[i].size;
+      entry[2] = packer.entries[i].load;
+      entry[3] = packer.entries[i].memory_size;
+      entry[4] = packer.entries[i].flags;
+    }
+
+    memcpy(file + EXE_HEADER_V2SIZE + table_size, packer.data, packer.data_size);
+    header[2] = exe_crc32(file + 12, size - 12);
+
+    if (fwrite(file, 1, size, output) != size || fflush(output) != 0) {
+      result = exe_err_io;
+    }
+  }
+
+  free(file);
+  free(packer.entries);
+  free(packer.data);
+  if (result == exe_err_success) *packed_size = size;
+  return result;
+}
+
 /*
  * Prints information about a given executable
  * */
 void exe_print_info(Executable* exe) {
+  printf("Version: %u\n", exe->header->version);
   printf("Entry address: 0x%08x\n", exe->header->entry_addr);
   printf("Load Table:\n");
 
   size_t size = exe->header->load_table_size;
-  for (int i = 0; i < size; i++) {
-    printf("0x%08x : %7d bytes : 0x%08x\n",
-      exe->header->load_table[i].offset,
-      exe->header->load_table[i].size,
-      exe->header->load_table[i].load
+  for (size_t i = 0; i < size; i++) {
+    LoadEntry* entry = exe->header->load_table + i;
+    printf("0x%08x : %7d bytes : 0x%08x : %7d bytes%s%s%s%s\n",
+      entry->offset,
+      entry->size,
+      entry->load,
+      entry->memory_size,
+      entry->flags & EXE_SEGMENT_ZERO ? " zero" : "",
+      entry->flags & EXE_SEGMENT_COMPRESSED ? " compressed" : "",
+      entry->flags & EXE_SEGMENT_READONLY ? " readonly" : "",
+      entry->flags & EXE_SEGMENT_EXEC ? " exec" : ""
     );
   }
 
   printf("\n");
 
+  if (exe->header->memory_size) {
+    printf("Memory size: %u bytes\n", exe->header->memory_size);
+  }
+
   printf("Data size: %zu bytes\n", exe->data_size);
 
   return;
@@ -107,9 +448,15 @@ void exe_print_info(Executable* exe) {
 void exe_clean(Executable* exe) {
   if (exe == NULL) return;
 
+  if (exe->mapping) {
+    munmap(exe->mapping, exe->mapping_size);
+    if (exe->fd >= 0) close(exe->fd);
+  } else {
+    free(exe->data);
+  }
+
   free(exe->header->load_table);
   free(exe->header);
-  free(exe->data);
   free(exe);
   return;
 }
@@ -127,6 +474,14 @@ char* exe_err(ExecutableError errcode) {
       return "Invalid magic number";
     case exe_err_allocation:
       return "Allocation failure";
+    case exe_err_io:
+      return "Could not map executable";
+    case exe_err_unsupported_version:
+      return "Unsupported executable version";
+    case exe_err_checksum:
+      return "Checksum mismatch";
+    case exe_err_invalid_segment:
+      return "Invalid segment";
     default:
       return "Unknown error";
   }
@@ -1,4 +1,7 @@
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #ifndef EXEH
 #define EXEH
@@ -7,25 +10,71 @@
 #define EXE_HEADER_MINSIZE 12
 #define EXE_HEADER_MAGIC   0x4543494e
 
+// Versioned executables, see below
+#define EXE_HEADER_V2SIZE  20
+#define EXE_HEADER_V2MAGIC 0x5643494e // NICV
+#define EXE_VERSION        2
+
+// Size of a load table entry in the file
+#define EXE_ENTRY_SIZE     12
+#define EXE_ENTRY_V2SIZE   20
+
+// Load table entries with this offset don't load anything, they request
+// the memory size given as their load address (see vm_config_executable)
+#define EXE_MEMORY_REQUEST 0xffffffff
+
+// Flags of version 2 segments
+#define EXE_SEGMENT_ZERO       1  // nothing is stored, memory_size bytes are cleared
+#define EXE_SEGMENT_COMPRESSED 2  // size bytes of LZ4 block data expand to memory_size bytes
+#define EXE_SEGMENT_READONLY   4  // markers for tools, the machine doesn't enforce them
+#define EXE_SEGMENT_EXEC       8
+
+/*
+ * Executable formats
+ *
+ * Version 1 starts with the magic number NICE, the entry address and the size
+ * of the load table (u32 each). The load table entries consist of the offset of
+ * the segment in the data, its size and its load address (u32 each). The data
+ * takes up the rest of the file.
+ *
+ * Version 2 starts with the magic number NICV, the version, a CRC-32C
+ * (Castagnoli, reflected polynomial 0x82f63b78, see exe_crc32) of everything
+ * following it, the entry address and the size of the load table (u32 each).
+ * Its load table entries also hold the size of the segment in memory and its
+ * flags. Both versions are parsed into the same structs, version 1
+ * segments cover as many bytes in memory as they take up in the file.
+ * */
+
 // An entry in the executables load table
 typedef struct LoadEntry {
   unsigned int offset;
   unsigned int size;
   unsigned int load;
+  unsigned int memory_size; // bytes the segment covers in memory
+  unsigned int flags;       // EXE_SEGMENT_* flags
 } LoadEntry;
 
 // The header of an executable
 typedef struct Header {
+  uint32_t version;
   uint32_t entry_addr;
   size_t load_table_size;
   LoadEntry* load_table;
+  uint32_t memory_size;   // requested memory size, 0 if the executable didn't ask for one
 } Header;
 
 // An executable for the vm
+//
+// Executables loaded via exe_map point into a read-only mapping of their file,
+// the machine can map their uncompressed segments directly (see vm_flash)
 typedef struct Executable {
   Header* header;
   uint8_t* data;
   size_t data_size;
+  int fd;               // file the executable is mapped from, -1 if it was copied
+  size_t data_offset;   // offset of the data segment inside that file
+  uint8_t* mapping;
+  size_t mapping_size;
 } Executable;
 
 // Error codes for the exe_create function
@@ -33,13 +82,19 @@ typedef enum {
   exe_err_success,
   exe_err_too_small,
   exe_err_invalid_magicnum,
-  exe_err_allocation
+  exe_err_allocation,
+  exe_err_io,
+  exe_err_unsupported_version,
+  exe_err_checksum,
+  exe_err_invalid_segment
 } ExecutableError;
 
 // Executable methods
 ExecutableError exe_create(Executable** result, uint8_t* buffer, size_t size);
+ExecutableError exe_map(Executable** result, int fd);
 char* exe_err(ExecutableError errcode);
 void exe_print_info(Executable* exe);
 void exe_clean(Executable* exe);
+ExecutableError exe_pack(Executable* exe, FILE* output, size_t* packed_size);
 
 #endif
@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "vm.h"
+#include "jit.h"
+#include "framebuffer.h"
+
+/*
+ * Start streaming the VRAM of the machine into sink
+ *
+ * fps limits how many frames are written per second, 0 selects
+ * VM_FB_DEFAULT_FPS. Compiled blocks are dropped, they are compiled
+ * again with checks for writes into VRAM. Machines without VRAM (see
+ * VMConfig) return vm_err_invalid_config.
+ * */
+VMError vm_framebuffer_enable(VM* vm, FILE* sink, VMFrameFormat format, uint32_t fps) {
+  if (!vm->vram) {
+    return vm_err_invalid_config;
+  }
+
+  if (vm->framebuffer == NULL) {
+    vm->framebuffer = calloc(1, sizeof(VMFramebuffer));
+    if (vm->framebuffer == NULL) {
+      return vm_err_allocation;
+    }
+  }
+
+  VMFramebuffer* fb = vm->framebuffer;
+  fb->sink = sink;
+  fb->format = format;
+  fb->interval = 1000000000ULL / (fps ? fps : VM_FB_DEFAULT_FPS);
+  fb->frames = 0;
+  fb->header_written = false;
+
+  vm_framebuffer_reset(vm);
+  vm_jit_reset(vm);
+  return vm_err_regular_exit;
+}
+
+/*
+ * Stop streaming and free the framebuffer, the last frame isn't written
+ * */
+void vm_framebuffer_clean(VM* vm) {
+  if (vm->framebuffer == NULL) return;
+
+  free(vm->framebuffer);
+  vm->framebuffer = NULL;
+}
+
+/*
+ * Mark the whole screen as dirty, called whenever VRAM was changed
+ * behind the machine's back (flashing a new executable)
+ * */
+void vm_framebuffer_reset(VM* vm) {
+  VMFramebuffer* fb = vm->framebuffer;
+  if (fb == NULL) return;
+
+  memset(fb->dirty, 0xff, sizeof(fb->dirty));
+  fb->next_frame = 0;
+}
+
+/*
+ * Mark the scanlines a write into VRAM touched as dirty
+ *
+ * The write has to overlap with VRAM. A frame is written right away
+ * if the frame interval has already passed.
+ * */
+void vm_framebuffer_written(VM* vm, uint32_t address, uint32_t size) {
+  VMFramebuffer* fb = vm->framebuffer;
+
+  uint64_t start = address < VM_VRAM ? 0 : address - VM_VRAM;
+  uint64_t end = (uint64_t) address + size - VM_VRAM;
+  if (end > VM_VRAMSIZE) end = VM_VRAMSIZE;
+
+  for (uint64_t line = start / VM_VRAMWIDTH; line <= (end - 1) / VM_VRAMWIDTH; line++) {
+    fb->dirty[line / 64] |= 1ULL << (line % 64);
+  }
+
+  vm_framebuffer_present(vm, false);
+}
+
+static bool vm_framebuffer_is_dirty(VMFramebuffer* fb, uint32_t line) {
+  return (fb->dirty[line / 64] >> (line % 64)) & 1;
+}
+
+static void vm_framebuffer_put16(FILE* sink, uint16_t value) {
+  uint8_t bytes[2] = { value & 0xff, value >> 8 };
+  fwrite(bytes, 2, 1, sink);
+}
+
+static void vm_framebuffer_put32(FILE* sink, uint32_t value) {
+  uint8_t bytes[4] = { value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff, value >> 24 };
+  fwrite(bytes, 4, 1, sink);
+}
+
+/*
+ * Convert the dirty scanlines to RGB and write the whole image
+ * */
+static void vm_framebuffer_write_ppm(VM* vm, VMFramebuffer* fb) {
+  const uint8_t* vram = vm->memory + VM_VRAM;
+
+  for (uint32_t line = 0; line < VM_VRAMHEIGHT; line++) {
+    if (!vm_framebuffer_is_dirty(fb, line)) continue;
+
+    for (uint32_t x = 0; x < VM_VRAMWIDTH; x++) {
+      uint8_t pixel = vram[line * VM_VRAMWIDTH + x];
+      uint8_t* rgb = fb->rgb + (line * VM_VRAMWIDTH + x) * 3;
+      rgb[0] = (pixel >> 5) * 255 / 7;
+      rgb[1] = ((pixel >> 2) & 7) * 255 / 7;
+      rgb[2] = (pixel & 3) * 255 / 3;
+    }
+  }
+
+  fprintf(fb->sink, "P6\n%d %d\n255\n", VM_VRAMWIDTH, VM_VRAMHEIGHT);
+  fwrite(fb->rgb, sizeof(fb->rgb), 1, fb->sink);
+}
+
+/*
+ * Write every run of consecutive dirty scanlines
+ * */
+static void vm_framebuffer_write_delta(VM* vm, VMFramebuffer* fb) {
+  const uint8_t* vram = vm->memory + VM_VRAM;
+
+  if (!fb->header_written) {
+    vm_framebuffer_put32(fb->sink, VM_FB_DELTA_MAGIC);
+    vm_framebuffer_put16(fb->sink, VM_VRAMWIDTH);
+    vm_framebuffer_put16(fb->sink, VM_VRAMHEIGHT);
+    fb->header_written = true;
+  }
+
+  uint16_t runs = 0;
+  for (uint32_t line = 0; line < VM_VRAMHEIGHT; line++) {
+    if (vm_framebuffer_is_dirty(fb, line) && (line == 0 || !vm_framebuffer_is_dirty(fb, line - 1))) {
+      runs++;
+    }
+  }
+
+  vm_framebuffer_put32(fb->sink, fb->frames);
+  vm_framebuffer_put16(fb->sink, runs);
+
+  uint32_t line = 0;
+  while (line < VM_VRAMHEIGHT) {
+    if (!vm_framebuffer_is_dirty(fb, line)) {
+      line++;
+      continue;
+    }
+
+    uint32_t first = line;
+    while (line < VM_VRAMHEIGHT && vm_framebuffer_is_dirty(fb, line)) line++;
+
+    vm_framebuffer_put16(fb->sink, first);
+    vm_framebuffer_put16(fb->sink, line - first);
+    fwrite(vram + first * VM_VRAMWIDTH, (line - first) * VM_VRAMWIDTH, 1, fb->sink);
+  }
+}
+
+/*
+ * Write a frame if anything changed since the last one
+ *
+ * Unless force is set, frames which would come sooner than the
+ * frame interval allows are skipped, their changes end up in the next one.
+ * */
+void vm_framebuffer_present(VM* vm, bool force) {
+  VMFramebuffer* fb = vm->framebuffer;
+  if (fb == NULL) return;
+
+  bool dirty = false;
+  for (int i = 0; i < VM_FB_DIRTYWORDS; i++) {
+    dirty |= fb->dirty[i] != 0;
+  }
+  if (!dirty) return;
+
+  uint64_t now = vm_now_ns();
+  if (!force && now < fb->next_frame) return;
+  fb->next_frame = now + fb->interval;
+
+  if (fb->format == vm_fb_ppm) {
+    vm_framebuffer_write_ppm(vm, fb);
+  } else {
+    vm_framebuffer_write_delta(vm, fb);
+  }
+
+  fflush(fb->sink);
+  memset(fb->dirty, 0, sizeof(fb->dirty));
+  fb->frames++;
+}
@@ -0,0 +1,61 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "vm.h"
+
+#ifndef FRAMEBUFFERH
+#define FRAMEBUFFERH
+
+// Number of 64-bit words in the bitmap of dirty scanlines
+#define VM_FB_DIRTYWORDS ((VM_VRAMHEIGHT + 63) / 64)
+
+// Magic number at the start of a delta stream
+#define VM_FB_DELTA_MAGIC 0x42464d56 // VMFB
+
+// Frame rate used if none is configured
+#define VM_FB_DEFAULT_FPS 30
+
+/*
+ * Formats the framebuffer can be streamed in
+ *
+ * vm_fb_ppm writes every frame as a complete binary PPM image (P6),
+ * so the stream can be piped straight into most video encoders.
+ *
+ * vm_fb_delta only writes the scanlines which changed. The stream starts
+ * with the magic number, the width and the height (u32, u16, u16), every
+ * frame is its number (u32) and its count of runs (u16), followed by the
+ * runs. A run is its first scanline and its count of scanlines (u16, u16)
+ * and the raw VRAM bytes of those scanlines. All numbers are little endian.
+ * */
+typedef enum {
+  vm_fb_ppm,
+  vm_fb_delta
+} VMFrameFormat;
+
+/*
+ * Streams the VRAM of a machine
+ *
+ * Every byte of VRAM is one pixel, read as RGB 3-3-2. Writes into VRAM mark
+ * their scanlines dirty (see vm_memory_written), a frame is written once the
+ * frame interval passed and something changed. Only dirty scanlines are
+ * converted or written, an unchanged screen costs nothing.
+ * */
+typedef struct VMFramebuffer {
+  FILE* sink;
+  VMFrameFormat format;
+  uint64_t dirty[VM_FB_DIRTYWORDS];       // scanlines written since the last frame
+  uint64_t interval;                      // nanoseconds between two frames
+  uint64_t next_frame;                    // CLOCK_MONOTONIC time the next frame is due
+  uint32_t frames;                        // frames written so far
+  bool header_written;
+  uint8_t rgb[VM_VRAMSIZE * 3];           // last frame, converted to RGB
+} VMFramebuffer;
+
+// Framebuffer methods
+VMError vm_framebuffer_enable(VM* vm, FILE* sink, VMFrameFormat format, uint32_t fps);
+void vm_framebuffer_clean(VM* vm);
+void vm_framebuffer_reset(VM* vm);
+void vm_framebuffer_written(VM* vm, uint32_t address, uint32_t size);
+void vm_framebuffer_present(VM* vm, bool force);
+
+#endif
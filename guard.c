@@ -0,0 +1,115 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "vm.h"
+#include "decode.h"
+#include "framebuffer.h"
+#include "guard.h"
+
+// Innermost guarded machine running on this thread
+static _Thread_local VMGuardFrame* current_frame = NULL;
+
+// Handlers which were installed before ours, faults outside of a machine go there
+static struct sigaction previous_segv;
+static struct sigaction previous_bus;
+static bool handler_installed = false;
+static pthread_once_t handler_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Jump back into vm_run if the fault hit the mapping of the running machine
+ *
+ * Any other fault is a bug of the host, the previous handler is put back and
+ * the faulting instruction runs again to crash the way it always would have
+ * */
+static void vm_guard_handler(int signal, siginfo_t* info, void* context) {
+  (void) context;
+
+  VMGuardFrame* frame = current_frame;
+  if (frame != NULL) {
+    uint8_t* address = info->si_addr;
+    VM* vm = frame->vm;
+    if (address >= vm->memory_mapping && address < vm->memory_mapping + vm->memory_mapping_size) {
+      siglongjmp(frame->env, 1);
+    }
+  }
+
+  sigaction(signal, signal == SIGSEGV ? &previous_segv : &previous_bus, NULL);
+}
+
+static void vm_guard_install(void) {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = vm_guard_handler;
+  action.sa_flags = SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+
+  // Some systems report accesses to PROT_NONE pages as SIGBUS
+  handler_installed = sigaction(SIGSEGV, &action, &previous_segv) == 0 &&
+                      sigaction(SIGBUS, &action, &previous_bus) == 0;
+}
+
+/*
+ * Move the machine's memory in front of guard pages
+ *
+ * The contents of the memory are lost, this has to happen before the
+ * machine is flashed. The fault handler is installed for the whole
+ * process the first time this is called.
+ * */
+VMError vm_guard_enable(VM* vm) {
+  if (vm->guarded) return vm_err_regular_exit;
+
+  pthread_once(&handler_once, vm_guard_install);
+  if (!handler_installed) {
+    return vm_err_internal_failure;
+  }
+
+  // Only the pages holding the memory are accessible, the memory ends
+  // exactly where the first guard page starts
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t accessible = (vm->memory_size + page_size - 1) / page_size * page_size;
+  size_t offset = accessible - vm->memory_size;
+  size_t size = (offset + VM_GUARD_SPAN + VM_GUARD_MAXACCESS + page_size - 1) / page_size * page_size;
+
+  uint8_t* mapping = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mapping == MAP_FAILED) {
+    return vm_err_allocation;
+  }
+
+  if (mprotect(mapping, accessible, PROT_READ | PROT_WRITE) != 0) {
+    munmap(mapping, size);
+    return vm_err_allocation;
+  }
+
+  munmap(vm->memory_mapping, vm->memory_mapping_size);
+  vm->memory_mapping = mapping;
+  vm->memory_mapping_size = size;
+  vm->memory = mapping + offset;
+  vm->shared_memory = false;
+  vm->guarded = true;
+
+  vm_decode_flush(vm);
+  vm_framebuffer_reset(vm);
+  return vm_err_regular_exit;
+}
+
+/*
+ * Make frame the place faults of vm jump back to
+ *
+ * frame->env has to be set up with sigsetjmp by the caller
+ * */
+void vm_guard_enter(VMGuardFrame* frame, VM* vm) {
+  frame->vm = vm;
+  frame->previous = current_frame;
+  current_frame = frame;
+}
+
+/*
+ * Restore whatever frame was active before
+ * */
+void vm_guard_leave(VMGuardFrame* frame) {
+  current_frame = frame->previous;
+}
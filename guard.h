@@ -0,0 +1,44 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include "vm.h"
+
+#ifndef GUARDH
+#define GUARDH
+
+/*
+ * Guarded memory
+ *
+ * The machine's memory is placed at the end of its first pages, so that it
+ * ends exactly on a page boundary, and is followed by inaccessible pages
+ * covering every 32-bit address. Loads and stores of up to 8 bytes can't
+ * reach past those, so the interpreter doesn't check them. An access outside
+ * of the memory faults, the SIGSEGV handler jumps back into vm_run which
+ * stops the machine with ILLEGAL_MEMORY_ACCESS.
+ *
+ * Addresses are unsigned, nothing can go below the memory. Instructions
+ * with a size operand (copy, fill, ...) are still checked once up front,
+ * so they never stop halfway through.
+ * */
+
+// Every 32-bit address plus the widest access
+#define VM_GUARD_SPAN ((uint64_t) 1 << 32)
+#define VM_GUARD_MAXACCESS 8
+
+/*
+ * Where vm_run continues if the machine faults
+ *
+ * One of these is active per thread while a guarded machine is running
+ * */
+typedef struct VMGuardFrame {
+  VM* vm;
+  sigjmp_buf env;
+  struct VMGuardFrame* previous;
+} VMGuardFrame;
+
+// Guard methods
+VMError vm_guard_enable(VM* vm);
+void vm_guard_enter(VMGuardFrame* frame, VM* vm);
+void vm_guard_leave(VMGuardFrame* frame);
+
+#endif
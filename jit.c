@@ -0,0 +1,759 @@
+#include <stdlib.h>
+#include <string.h>
+#include "vm.h"
+#include "decode.h"
+#include "jit.h"
+#include "verify.h"
+
+#if VM_JIT_SUPPORTED
+
+#include <sys/mman.h>
+
+/*
+ * Template JIT for x86-64
+ *
+ * A block is the sequence of instructions starting at a branch target. It ends
+ * at the first jmp, at the first instruction the JIT doesn't support, or at the
+ * end of the code page it started in. Taken conditional jumps leave the block
+ * early, jumps back to its start loop inside the generated code.
+ *
+ * Every instruction is translated into a fixed sequence of host instructions
+ * which operate directly on the machine's register file, nothing is kept in
+ * host registers between instructions. Whenever an instruction would fault or
+ * has to be handled by the interpreter (e.g. a write into decoded code), the
+ * block stores the address of that instruction into the instruction pointer
+ * and returns, so the interpreter can execute it.
+ *
+ * Host registers used by the generated code:
+ *
+ * rbx            machine registers
+ * r12            machine memory
+ * r13            remaining fuel of a block which loops onto itself
+ * r14            decode cache pages
+ * r15b           flags register, written back whenever the block is left
+ * rax, rcx, rdx  scratch
+ * */
+
+#define HOST_RAX 0
+#define HOST_RCX 1
+#define HOST_RDX 2
+
+// Condition codes of the jcc instructions
+#define JB  0x82
+#define JAE 0x83
+#define JE  0x84
+#define JNE 0x85
+#define JA  0x87
+
+// Condition codes of the setcc instructions
+#define SETB 0x92
+#define SETE 0x94
+#define SETA 0x97
+#define SETL 0x9c
+#define SETG 0x9f
+
+// Limits of a single block while it is being generated
+#define JIT_MAXCODE  16384
+#define JIT_MAXEXITS 256
+
+// Offset of a machine register inside the register file
+#define REGOFFSET(REG) (((REG) & VM_CODEMASK) * 8)
+
+// Emits a sequence of bytes
+#define EMIT(E, ...)                                                           \
+  emit_bytes(E, (const uint8_t[]){ __VA_ARGS__ }, sizeof((const uint8_t[]){ __VA_ARGS__ }))
+
+// What the block compiler should do after an instruction was emitted
+typedef enum {
+  jit_unsupported,
+  jit_continue,
+  jit_terminated
+} JitResult;
+
+// A block while it is being generated
+typedef struct Emitter {
+  uint8_t code[JIT_MAXCODE];
+  size_t size;
+  struct {
+    size_t patch;   // offset of the rel32 of the jump
+    uint32_t ip;    // instruction the interpreter resumes at
+  } exits[JIT_MAXEXITS];
+  size_t exit_count;
+  bool overflow;
+  bool vram_checks;   // writes into VRAM are left to the interpreter (see framebuffer.h)
+  bool verified_checks;   // so are writes into verified code (see verify.h)
+  uint32_t verified_low;
+  uint32_t verified_high;
+  uint32_t memory_size;
+} Emitter;
+
+static void emit_bytes(Emitter* e, const uint8_t* bytes, size_t count) {
+  if (e->size + count > JIT_MAXCODE) {
+    e->overflow = true;
+    return;
+  }
+
+  memcpy(e->code + e->size, bytes, count);
+  e->size += count;
+}
+
+static void emit32(Emitter* e, uint32_t value) {
+  EMIT(e, value, value >> 8, value >> 16, value >> 24);
+}
+
+static void emit64(Emitter* e, uint64_t value) {
+  emit32(e, value);
+  emit32(e, value >> 32);
+}
+
+// Points the rel32 at offset patch to the current end of the code
+static void patch_jump(Emitter* e, size_t patch) {
+  int32_t rel = (int32_t)(e->size - (patch + 4));
+  memcpy(e->code + patch, &rel, 4);
+}
+
+// mov host, qword [rbx + reg]
+static void emit_read_reg(Emitter* e, uint8_t host, uint8_t reg) {
+  EMIT(e, 0x48, 0x8b, 0x83 | host << 3);
+  emit32(e, REGOFFSET(reg));
+}
+
+// Stores the low bytes of host into a machine register, according to its width
+static void emit_write_reg(Emitter* e, uint8_t host, uint8_t reg) {
+  switch (vm_reg_size(reg)) {
+    case 1:
+      EMIT(e, 0x88);
+      break;
+    case 2:
+      EMIT(e, 0x66, 0x89);
+      break;
+    case 4:
+      EMIT(e, 0x89);
+      break;
+    default:
+      EMIT(e, 0x48, 0x89);
+      break;
+  }
+
+  EMIT(e, 0x83 | host << 3);
+  emit32(e, REGOFFSET(reg));
+}
+
+// Loads size bytes at [rax] into rcx, zero-extended
+static void emit_load_memory(Emitter* e, uint32_t size) {
+  switch (size) {
+    case 1:
+      EMIT(e, 0x0f, 0xb6, 0x08);
+      break;
+    case 2:
+      EMIT(e, 0x0f, 0xb7, 0x08);
+      break;
+    case 4:
+      EMIT(e, 0x8b, 0x08);
+      break;
+    default:
+      EMIT(e, 0x48, 0x8b, 0x08);
+      break;
+  }
+}
+
+// Stores the low size bytes of rcx at [rax]
+static void emit_store_memory(Emitter* e, uint32_t size) {
+  switch (size) {
+    case 1:
+      EMIT(e, 0x88, 0x08);
+      break;
+    case 2:
+      EMIT(e, 0x66, 0x89, 0x08);
+      break;
+    case 4:
+      EMIT(e, 0x89, 0x08);
+      break;
+    default:
+      EMIT(e, 0x48, 0x89, 0x08);
+      break;
+  }
+}
+
+// Sets the zero bit of the machine to the value of dl
+static void emit_set_zero_bit(Emitter* e) {
+  EMIT(e, 0x41, 0x80, 0xe7, 0xfe);        // and r15b, 0xfe
+  EMIT(e, 0x41, 0x08, 0xd7);              // or r15b, dl
+}
+
+// Sets the zero bit of the machine if rax is zero
+static void emit_zero_test(Emitter* e) {
+  EMIT(e, 0x48, 0x85, 0xc0);              // test rax, rax
+  EMIT(e, 0x0f, SETE, 0xc2);              // sete dl
+  emit_set_zero_bit(e);
+}
+
+// Leaves the block, the interpreter continues at ip
+static void emit_exit(Emitter* e, uint32_t ip) {
+  EMIT(e, 0x44, 0x88, 0xbb);              // mov byte [rbx + flags], r15b
+  emit32(e, REGOFFSET(VM_REGFLAGS));
+  EMIT(e, 0xc7, 0x83);                    // mov dword [rbx + ip], imm32
+  emit32(e, REGOFFSET(VM_REGIP));
+  emit32(e, ip);
+  EMIT(e, 0x41, 0x5f);                    // pop r15
+  EMIT(e, 0x41, 0x5e);                    // pop r14
+  EMIT(e, 0x41, 0x5d);                    // pop r13
+  EMIT(e, 0x41, 0x5c);                    // pop r12
+  EMIT(e, 0x5b);                          // pop rbx
+  EMIT(e, 0xc3);                          // ret
+}
+
+// Leaves the block if condition is met, the interpreter continues at ip
+//
+// The exit itself is emitted after the block, see vm_jit_compile
+static void emit_side_exit(Emitter* e, uint8_t condition, uint32_t ip) {
+  if (e->exit_count == JIT_MAXEXITS) {
+    e->overflow = true;
+    return;
+  }
+
+  EMIT(e, 0x0f, condition);
+  e->exits[e->exit_count].patch = e->size;
+  e->exits[e->exit_count].ip = ip;
+  e->exit_count++;
+  emit32(e, 0);
+}
+
+// Continues execution at target
+//
+// Jumps back to the start of the block stay inside the generated code until
+// the block runs out of fuel
+static void emit_branch(Emitter* e, uint32_t target, uint32_t entry, size_t loop) {
+  if (target != entry) {
+    emit_exit(e, target);
+    return;
+  }
+
+  EMIT(e, 0x41, 0xff, 0xcd);              // dec r13d
+  emit_side_exit(e, JE, entry);
+  EMIT(e, 0xe9);                          // jmp loop
+  emit32(e, (uint32_t)(int32_t)(loop - (e->size + 4)));
+}
+
+// Leaves the block if size bytes at [memory + eax] overlap with [low, high)
+//
+// Clobbers ecx
+static void emit_check_region_write(Emitter* e, uint32_t low, uint32_t high, uint32_t size, uint32_t ip) {
+  uint64_t span = (uint64_t) high - low + size - 1;
+  EMIT(e, 0x8d, 0x88);                    // lea ecx, [rax + imm32]
+  emit32(e, (uint32_t)(-(int64_t)(low - (size - 1))));
+  EMIT(e, 0x81, 0xf9);                    // cmp ecx, imm32
+  emit32(e, span > UINT32_MAX ? UINT32_MAX : (uint32_t) span);
+  emit_side_exit(e, JB, ip);
+}
+
+// Returns true if size bytes at address overlap with VRAM
+static bool is_vram_write(uint32_t address, uint32_t size) {
+  return (uint64_t) address + size > VM_VRAM && address < VM_VRAM + VM_VRAMSIZE;
+}
+
+// Returns true if size bytes at address overlap with verified code
+static bool is_verified_write(Emitter* e, uint32_t address, uint32_t size) {
+  return e->verified_checks && (uint64_t) address + size > e->verified_low && address < e->verified_high;
+}
+
+// Same as vm_legal_address, for the machine the block is compiled for
+static bool is_legal_address(Emitter* e, uint32_t address) {
+  return address < e->memory_size;
+}
+
+// Leaves the block if writing size bytes at [memory + eax] could modify a
+// decoded instruction, the interpreter has to invalidate it (see vm_memory_written)
+//
+// Clobbers ecx
+static void emit_check_code_write(Emitter* e, uint32_t size, uint32_t ip) {
+
+  // The interpreter reports writes into VRAM to the framebuffer and clears
+  // the bits of verified instructions they hit (see vm_verify_written)
+  if (e->vram_checks) {
+    emit_check_region_write(e, VM_VRAM, VM_VRAM + VM_VRAMSIZE, size, ip);
+  }
+
+  if (e->verified_checks) {
+    emit_check_region_write(e, e->verified_low, e->verified_high, size, ip);
+  }
+
+  EMIT(e, 0x89, 0xc1);                    // mov ecx, eax
+  EMIT(e, 0x81, 0xe9);                    // sub ecx, imm32
+  emit32(e, VM_INSTRUCTION_MAXLENGTH - 1);
+  emit_side_exit(e, JB, ip);
+  EMIT(e, 0xc1, 0xe9, VM_CODEPAGE_SHIFT); // shr ecx, imm8
+  EMIT(e, 0x49, 0x83, 0x3c, 0xce, 0x00);  // cmp qword [r14 + rcx * 8], 0
+  emit_side_exit(e, JNE, ip);
+  EMIT(e, 0x8d, 0x88);                    // lea ecx, [rax + imm32]
+  emit32(e, size - 1);
+  EMIT(e, 0xc1, 0xe9, VM_CODEPAGE_SHIFT); // shr ecx, imm8
+  EMIT(e, 0x49, 0x83, 0x3c, 0xce, 0x00);  // cmp qword [r14 + rcx * 8], 0
+  emit_side_exit(e, JNE, ip);
+}
+
+// Same as emit_check_code_write, for an address known at compile time
+static void emit_check_code_write_const(Emitter* e, uint32_t address, uint32_t size, uint32_t ip) {
+  uint32_t first = address < VM_INSTRUCTION_MAXLENGTH ? 0 : address - (VM_INSTRUCTION_MAXLENGTH - 1);
+  uint32_t last = address + size - 1;
+
+  EMIT(e, 0x49, 0x83, 0xbe);              // cmp qword [r14 + imm32], 0
+  emit32(e, (first >> VM_CODEPAGE_SHIFT) * sizeof(VMCodePage*));
+  EMIT(e, 0x00);
+  emit_side_exit(e, JNE, ip);
+
+  if ((first >> VM_CODEPAGE_SHIFT) != (last >> VM_CODEPAGE_SHIFT)) {
+    EMIT(e, 0x49, 0x83, 0xbe);            // cmp qword [r14 + imm32], 0
+    emit32(e, (last >> VM_CODEPAGE_SHIFT) * sizeof(VMCodePage*));
+    EMIT(e, 0x00);
+    emit_side_exit(e, JNE, ip);
+  }
+}
+
+// Leaves the block unless [eax, eax + size) is inside the machine's memory
+//
+// Mirrors CHECK_RANGE of the interpreter, clobbers ecx
+static void emit_check_range(Emitter* e, uint32_t size, uint32_t ip) {
+  EMIT(e, 0x3d);                          // cmp eax, imm32
+  emit32(e, e->memory_size);
+  emit_side_exit(e, JAE, ip);
+  EMIT(e, 0x8d, 0x88);                    // lea ecx, [rax + imm32]
+  emit32(e, size);
+  EMIT(e, 0x81, 0xf9);                    // cmp ecx, imm32
+  emit32(e, e->memory_size);
+  emit_side_exit(e, JAE, ip);
+}
+
+// Computes the frame pointer relative address of load and store into eax
+//
+// Leaves the block if size bytes at that address don't fit into the machine's memory
+static void emit_frame_address(Emitter* e, uint32_t offset, uint32_t size, uint32_t ip) {
+  EMIT(e, 0x8b, 0x83);                    // mov eax, dword [rbx + fp]
+  emit32(e, REGOFFSET(VM_REGFP));
+  EMIT(e, 0x05);                          // add eax, imm32
+  emit32(e, offset);
+  EMIT(e, 0x3d);                          // cmp eax, imm32
+  emit32(e, e->memory_size - size);
+  emit_side_exit(e, JA, ip);
+}
+
+// Instructions which access the instruction pointer or the flags register
+// directly are left to the interpreter
+static bool is_special(uint8_t reg) {
+  uint8_t code = reg & VM_CODEMASK;
+  return code == (VM_REGIP & VM_CODEMASK) || code == (VM_REGFLAGS & VM_CODEMASK);
+}
+
+/*
+ * Emits the code for a single instruction
+ * */
+static JitResult emit_instruction(Emitter* e, uint32_t ip, VMInstruction* inst, uint32_t entry, size_t loop) {
+  uint8_t r1 = inst->r1;
+  uint8_t r2 = inst->r2;
+
+  switch (inst->kind) {
+    case op_mov:
+      if (is_special(r1) || is_special(r2)) return jit_unsupported;
+      emit_read_reg(e, HOST_RAX, r2);
+      emit_write_reg(e, HOST_RAX, r1);
+      return jit_continue;
+
+    case op_loadi:
+    case op_rst:
+      if (is_special(r1)) return jit_unsupported;
+      EMIT(e, 0x48, 0xb8);                // mov rax, imm64
+      emit64(e, inst->kind == op_loadi ? inst->value : 0);
+      emit_write_reg(e, HOST_RAX, r1);
+      return jit_continue;
+
+    case op_add:
+    case op_sub:
+    case op_mul:
+    case op_div:
+    case op_idiv:
+    case op_rem:
+    case op_irem:
+      if (is_special(r1) || is_special(r2)) return jit_unsupported;
+      emit_read_reg(e, HOST_RAX, r1);
+      emit_read_reg(e, HOST_RCX, r2);
+
+      switch (inst->kind) {
+        case op_add:
+          EMIT(e, 0x48, 0x01, 0xc8);      // add rax, rcx
+          break;
+        case op_sub:
+          EMIT(e, 0x48, 0x29, 0xc8);      // sub rax, rcx
+          break;
+        case op_mul:
+          EMIT(e, 0x48, 0x0f, 0xaf, 0xc1);// imul rax, rcx
+          break;
+        default:
+
+          // Division by zero is left to the interpreter
+          EMIT(e, 0x48, 0x85, 0xc9);      // test rcx, rcx
+          emit_side_exit(e, JE, ip);
+
+          if (inst->kind == op_div || inst->kind == op_rem) {
+            EMIT(e, 0x31, 0xd2);          // xor edx, edx
+            EMIT(e, 0x48, 0xf7, 0xf1);    // div rcx
+          } else {
+            EMIT(e, 0x48, 0x99);          // cqo
+            EMIT(e, 0x48, 0xf7, 0xf9);    // idiv rcx
+          }
+
+          if (inst->kind == op_rem || inst->kind == op_irem) {
+            EMIT(e, 0x48, 0x89, 0xd0);    // mov rax, rdx
+          }
+          break;
+      }
+
+      emit_zero_test(e);
+      emit_write_reg(e, HOST_RAX, r1);
+      return jit_continue;
+
+    case op_not:
+      if (is_special(r1)) return jit_unsupported;
+      emit_read_reg(e, HOST_RAX, r1);
+      EMIT(e, 0x48, 0xf7, 0xd0);          // not rax
+      emit_zero_test(e);
+      emit_write_reg(e, HOST_RAX, r1);
+      return jit_continue;
+
+    case op_shr:
+    case op_shl:
+    case op_and:
+    case op_xor:
+    case op_or:
+      if (is_special(r1) || is_special(r2)) return jit_unsupported;
+      emit_read_reg(e, HOST_RAX, r1);
+      emit_read_reg(e, HOST_RCX, r2);
+
+      switch (inst->kind) {
+        case op_shr:
+          EMIT(e, 0x48, 0xd3, 0xe0);      // shl rax, cl (op_shr shifts left)
+          break;
+        case op_shl:
+          EMIT(e, 0x48, 0xd3, 0xe8);      // shr rax, cl (op_shl shifts right)
+          break;
+        case op_and:
+          EMIT(e, 0x48, 0x21, 0xc8);      // and rax, rcx
+          break;
+        case op_xor:
+          EMIT(e, 0x48, 0x31, 0xc8);      // xor rax, rcx
+          break;
+        default:
+          EMIT(e, 0x48, 0x09, 0xc8);      // or rax, rcx
+          break;
+      }
+
+      emit_zero_test(e);
+      return jit_continue;
+
+    case op_cmp:
+    case op_lt:
+    case op_gt:
+    case op_ult:
+    case op_ugt: {
+      if (is_special(r1) || is_special(r2)) return jit_unsupported;
+      uint8_t condition;
+      switch (inst->kind) {
+        case op_cmp:
+          condition = SETE;
+          break;
+        case op_lt:
+          condition = SETL;
+          break;
+        case op_gt:
+          condition = SETG;
+          break;
+        case op_ult:
+          condition = SETB;
+          break;
+        default:
+          condition = SETA;
+          break;
+      }
+
+      emit_read_reg(e, HOST_RAX, r1);
+      emit_read_reg(e, HOST_RCX, r2);
+      EMIT(e, 0x48, 0x39, 0xc8);          // cmp rax, rcx
+      EMIT(e, 0x0f, condition, 0xc2);     // setcc dl
+      emit_set_zero_bit(e);
+      return jit_continue;
+    }
+
+    case op_load: {
+      if (is_special(r1)) return jit_unsupported;
+      uint32_t size = vm_reg_size(r1);
+      emit_frame_address(e, inst->a, size, ip);
+      EMIT(e, 0x4c, 0x01, 0xe0);          // add rax, r12
+      emit_load_memory(e, size);
+      emit_write_reg(e, HOST_RCX, r1);
+      return jit_continue;
+    }
+
+    case op_store: {
+      if (is_special(r1)) return jit_unsupported;
+      uint32_t size = vm_reg_size(r1);
+      emit_frame_address(e, inst->a, size, ip);
+      emit_check_code_write(e, size, ip);
+      emit_read_reg(e, HOST_RCX, r1);
+      EMIT(e, 0x4c, 0x01, 0xe0);          // add rax, r12
+      emit_store_memory(e, size);
+      return jit_continue;
+    }
+
+    case op_read: {
+      if (is_special(r1) || is_special(r2)) return jit_unsupported;
+      uint32_t size = vm_reg_size(r1);
+      EMIT(e, 0x8b, 0x83);                // mov eax, dword [rbx + r2]
+      emit32(e, REGOFFSET(r2));
+      emit_check_range(e, size, ip);
+      EMIT(e, 0x4c, 0x01, 0xe0);          // add rax, r12
+      emit_load_memory(e, size);
+      emit_write_reg(e, HOST_RCX, r1);
+      return jit_continue;
+    }
+
+    case op_readc: {
+      if (is_special(r1)) return jit_unsupported;
+      uint32_t size = vm_reg_size(r1);
+      uint32_t address = inst->a;
+
+      // A faulting access is left to the interpreter
+      if (!is_legal_address(e, address) || !is_legal_address(e, address + size)) {
+        return jit_unsupported;
+      }
+
+      EMIT(e, 0xb8);                      // mov eax, imm32
+      emit32(e, address);
+      EMIT(e, 0x4c, 0x01, 0xe0);          // add rax, r12
+      emit_load_memory(e, size);
+      emit_write_reg(e, HOST_RCX, r1);
+      return jit_continue;
+    }
+
+    // The source register decides how many bytes are written
+    case op_write: {
+      if (is_special(r1) || is_special(r2)) return jit_unsupported;
+      uint32_t size = vm_reg_size(r2);
+      EMIT(e, 0x8b, 0x83);                // mov eax, dword [rbx + r1]
+      emit32(e, REGOFFSET(r1));
+      emit_check_range(e, size, ip);
+      emit_check_code_write(e, size, ip);
+      emit_read_reg(e, HOST_RCX, r2);
+      EMIT(e, 0x4c, 0x01, 0xe0);          // add rax, r12
+      emit_store_memory(e, size);
+      return jit_continue;
+    }
+
+    case op_writec: {
+      if (is_special(r1)) return jit_unsupported;
+      uint32_t size = vm_reg_size(r1);
+      uint32_t address = inst->a;
+
+      if (!is_legal_address(e, address) || !is_legal_address(e, address + size)) {
+        return jit_unsupported;
+      }
+
+      if ((e->vram_checks && is_vram_write(address, size)) || is_verified_write(e, address, size)) {
+        return jit_unsupported;
+      }
+
+      emit_check_code_write_const(e, address, size, ip);
+      emit_read_reg(e, HOST_RCX, r1);
+      EMIT(e, 0xb8);                      // mov eax, imm32
+      emit32(e, address);
+      EMIT(e, 0x4c, 0x01, 0xe0);          // add rax, r12
+      emit_store_memory(e, size);
+      return jit_continue;
+    }
+
+    // A jump onto itself behaves like a jump to the next instruction
+    //
+    // The block continues after a conditional jump, a taken jump leaves it
+    // unless it goes back to the start of the block
+    case op_jz: {
+      uint32_t target = inst->a == ip ? inst->next : inst->a;
+      if (target == inst->next) return jit_continue;
+
+      EMIT(e, 0x41, 0xf6, 0xc7, VM_FLAG_ZERO); // test r15b, 1
+
+      if (target != entry) {
+        emit_side_exit(e, JNE, target);
+        return jit_continue;
+      }
+
+      EMIT(e, 0x0f, JE);                  // je not_taken
+      size_t not_taken = e->size;
+      emit32(e, 0);
+      emit_branch(e, target, entry, loop);
+      patch_jump(e, not_taken);
+      return jit_continue;
+    }
+
+    case op_jmp: {
+      uint32_t target = inst->a == ip ? inst->next : inst->a;
+      emit_branch(e, target, entry, loop);
+      return jit_terminated;
+    }
+
+    default:
+      return jit_unsupported;
+  }
+}
+
+/*
+ * Allocate the executable buffer and enable the JIT for a machine
+ * */
+VMError vm_jit_enable(VM* vm) {
+  if (vm->jit != NULL) return vm_err_regular_exit;
+
+  VMJit* jit = malloc(sizeof(VMJit));
+  if (jit == NULL) {
+    return vm_err_allocation;
+  }
+
+  void* buffer = mmap(NULL, VM_JIT_BUFFERSIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffer == MAP_FAILED) {
+    free(jit);
+    return vm_err_jit_unavailable;
+  }
+
+  jit->buffer = buffer;
+  jit->size = VM_JIT_BUFFERSIZE;
+  jit->used = 0;
+  vm->jit = jit;
+  return vm_err_regular_exit;
+}
+
+/*
+ * Release the executable buffer
+ * */
+void vm_jit_clean(VM* vm) {
+  if (vm->jit == NULL) return;
+
+  vm_jit_reset(vm);
+  munmap(vm->jit->buffer, vm->jit->size);
+  free(vm->jit);
+  vm->jit = NULL;
+}
+
+/*
+ * Drop every compiled block
+ * */
+void vm_jit_reset(VM* vm) {
+  if (vm->jit == NULL) return;
+
+  for (uint64_t i = 0; i < VM_CODEPAGE_COUNT(vm->memory_size); i++) {
+    if (vm->code_pages[i]) {
+      vm_decode_drop_native(vm->code_pages[i]);
+    }
+  }
+
+  vm->jit->used = 0;
+}
+
+/*
+ * Compile the block starting at ip
+ *
+ * inst has to be the decode cache entry of ip, it receives the compiled block.
+ * If not a single instruction of the block can be compiled, the block is left
+ * to the interpreter.
+ * */
+void vm_jit_compile(VM* vm, uint32_t ip, VMInstruction* inst) {
+  VMJit* jit = vm->jit;
+  uint32_t entry = ip;
+  uint32_t page = entry >> VM_CODEPAGE_SHIFT;
+
+  Emitter emitter;
+  Emitter* e = &emitter;
+  e->size = 0;
+  e->exit_count = 0;
+  e->overflow = false;
+  e->vram_checks = vm->framebuffer != NULL;
+  e->verified_checks = vm->verified != NULL;
+  e->verified_low = vm->verified ? vm->verified->low : 0;
+  e->verified_high = vm->verified ? vm->verified->high : 0;
+  e->memory_size = vm->memory_size;
+
+  EMIT(e, 0x53);                          // push rbx
+  EMIT(e, 0x41, 0x54);                    // push r12
+  EMIT(e, 0x41, 0x55);                    // push r13
+  EMIT(e, 0x41, 0x56);                    // push r14
+  EMIT(e, 0x41, 0x57);                    // push r15
+  EMIT(e, 0x48, 0x89, 0xfb);              // mov rbx, rdi
+  EMIT(e, 0x49, 0x89, 0xf4);              // mov r12, rsi
+  EMIT(e, 0x49, 0x89, 0xd6);              // mov r14, rdx
+  EMIT(e, 0x41, 0xbd);                    // mov r13d, imm32
+  emit32(e, VM_JIT_FUEL);
+  EMIT(e, 0x44, 0x0f, 0xb6, 0xbb);        // movzx r15d, byte [rbx + flags]
+  emit32(e, REGOFFSET(VM_REGFLAGS));
+  size_t loop = e->size;
+
+  // Blocks never leave the page they start in, so writes to other
+  // pages can't affect them (see vm_memory_written)
+  int count = 0;
+  bool terminated = false;
+  while (count < VM_JIT_MAXBLOCK) {
+    VMInstruction decoded;
+    uint64_t length = vm_decode(vm, ip, vm->memory[ip], &decoded);
+    if (length == 0 || (ip >> VM_CODEPAGE_SHIFT) != page || ((ip + length - 1) >> VM_CODEPAGE_SHIFT) != page) {
+      break;
+    }
+
+    JitResult result = emit_instruction(e, ip, &decoded, entry, loop);
+    if (result == jit_unsupported) break;
+
+    count++;
+    if (result == jit_terminated) {
+      terminated = true;
+      break;
+    }
+
+    ip = decoded.next;
+  }
+
+  if (count == 0) return;
+
+  if (!terminated) {
+    emit_exit(e, ip);
+  }
+
+  for (size_t i = 0; i < e->exit_count; i++) {
+    patch_jump(e, e->exits[i].patch);
+    emit_exit(e, e->exits[i].ip);
+  }
+
+  if (e->overflow) return;
+
+  // Start over once the buffer is full
+  if (jit->used + e->size > jit->size) {
+    vm_jit_reset(vm);
+  }
+
+  uint8_t* code = jit->buffer + jit->used;
+  memcpy(code, e->code, e->size);
+  jit->used = (jit->used + e->size + 15) & ~(size_t)15;
+
+  inst->native = code;
+  vm->code_pages[page]->has_native = true;
+}
+
+#else
+
+VMError vm_jit_enable(VM* vm) {
+  return vm_err_jit_unavailable;
+}
+
+void vm_jit_clean(VM* vm) {
+}
+
+void vm_jit_reset(VM* vm) {
+}
+
+void vm_jit_compile(VM* vm, uint32_t ip, VMInstruction* inst) {
+}
+
+#endif
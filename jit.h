@@ -0,0 +1,58 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "vm.h"
+#include "decode.h"
+
+#ifndef JITH
+#define JITH
+
+// The JIT only knows how to generate x86-64 code
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define VM_JIT_SUPPORTED 1
+#else
+#define VM_JIT_SUPPORTED 0
+#endif
+
+// Number of times a block has to be entered before it gets compiled
+#ifndef VM_JIT_THRESHOLD
+#define VM_JIT_THRESHOLD 1000
+#endif
+
+// Size of the executable buffer, it is reset once it runs full
+#define VM_JIT_BUFFERSIZE (4 * 1024 * 1024)
+
+// Maximum number of instructions in a compiled block
+#define VM_JIT_MAXBLOCK 64
+
+// Number of iterations a block which loops onto itself can run
+// before control is handed back to the interpreter
+#define VM_JIT_FUEL 4096
+
+/*
+ * A compiled block
+ *
+ * Runs the block on the machine's registers and memory. The instruction
+ * pointer register holds the address of the next instruction to execute
+ * once the block returns.
+ * */
+typedef void (*VMNativeBlock)(uint64_t* regs, uint8_t* memory, VMCodePage** code_pages);
+
+/*
+ * State of the JIT of a machine
+ *
+ * Blocks are allocated linearly out of buffer
+ * */
+typedef struct VMJit {
+  uint8_t* buffer;
+  size_t size;
+  size_t used;
+} VMJit;
+
+// JIT methods
+VMError vm_jit_enable(VM* vm);
+void vm_jit_clean(VM* vm);
+void vm_jit_reset(VM* vm);
+void vm_jit_compile(VM* vm, uint32_t ip, VMInstruction* inst);
+
+#endif
@@ -1,58 +1,378 @@
 #include <stdlib.h>
 #include <stdio.h>
-#include <sys/stat.h>
 #include <string.h>
+#include <unistd.h>
 #include "vm.h"
 #include "exe.h"
+#include "jit.h"
+#include "decode.h"
+#include "batch.h"
+#include "output.h"
+#include "profile.h"
+#include "sampler.h"
+#include "framebuffer.h"
+#include "guard.h"
+#include "trace.h"
+#include "verify.h"
+#include "aot.h"
 
-int main(int argc, char** argv) {
+/*
+ * Run every executable listed in a jobs file on a pool of threads
+ * */
+static int run_batch(char* filename, uint32_t threads, bool jit) {
+  FILE* fp = fopen(filename, "r");
 
-  // Check for the filename
-  if (argc <= 1) {
-    fprintf(stderr, "Missing filename\n");
+  if (fp == NULL) {
+    fprintf(stderr, "Could not open file: %s\n", filename);
     return 1;
   }
 
-  FILE* fp;
-  fp = fopen(argv[1], "r");
+  VMBatch* batch;
+  VMError create_result = vm_batch_create(&batch, fp, jit);
+  fclose(fp);
+
+  if (create_result != vm_err_regular_exit) {
+    fprintf(stderr, "Could not read jobs\n");
+    fprintf(stderr, "Reason: %s\n", vm_err(create_result));
+    return 1;
+  }
+
+  if (jit && !VM_JIT_SUPPORTED) {
+    fprintf(stderr, "Could not enable the JIT: %s\n", vm_err(vm_err_jit_unavailable));
+  }
+
+  VMError run_result = vm_batch_run(batch, threads);
+  if (run_result != vm_err_regular_exit) {
+    fprintf(stderr, "Could not run jobs\n");
+    fprintf(stderr, "Reason: %s\n", vm_err(run_result));
+    vm_batch_clean(batch);
+    return 1;
+  }
+
+  int failed = vm_batch_report(batch, stdout, stderr);
+  vm_batch_clean(batch);
+
+  return failed ? 1 : 0;
+}
+
+/*
+ * Write the stacks recorded by the sampler to a file, symbolized
+ * with the symbol map if there is one
+ * */
+static void write_samples(VMSampler* sampler, char* filename, char* symbols_filename) {
+  VMSymbols* symbols = NULL;
+  if (symbols_filename != NULL) {
+    FILE* fp = fopen(symbols_filename, "r");
+    if (fp == NULL) {
+      fprintf(stderr, "Could not open file: %s\n", symbols_filename);
+    } else {
+      VMError symbols_result = vm_symbols_load(&symbols, fp);
+      if (symbols_result != vm_err_regular_exit) {
+        fprintf(stderr, "Could not read symbols: %s\n", vm_err(symbols_result));
+      }
+      fclose(fp);
+    }
+  }
 
+  FILE* out = fopen(filename, "w");
+  if (out == NULL) {
+    fprintf(stderr, "Could not open file: %s\n", filename);
+  } else {
+    vm_sampler_dump(sampler, symbols, out);
+    fclose(out);
+  }
+
+  if (sampler->dropped) {
+    fprintf(stderr, "Dropped %llu of %llu samples, too many distinct stacks\n",
+            (unsigned long long) sampler->dropped,
+            (unsigned long long) (sampler->samples + sampler->dropped));
+  }
+
+  vm_symbols_clean(symbols);
+}
+
+/*
+ * Bring the machine into the state a trace recorded before the given
+ * instruction and print its registers, the memory is written to dump
+ * if there is one
+ * */
+static int replay_trace(VM* vm, char* filename, uint64_t index, char* dump) {
+  FILE* fp = fopen(filename, "rb");
   if (fp == NULL) {
-    fprintf(stderr, "Could not open file: %s\n", argv[1]);
+    fprintf(stderr, "Could not open file: %s\n", filename);
     return 1;
   }
 
-  struct stat inputStat;
-  if (fstat(fileno(fp), &inputStat) < 0) {
-    fprintf(stderr, "Could not stat file: %s\n", argv[1]);
+  uint64_t reached;
+  VMError replay_result = vm_trace_replay(vm, fp, index, &reached);
+  fclose(fp);
+
+  if (replay_result != vm_err_regular_exit) {
+    fprintf(stderr, "Could not replay the trace after %llu instructions\n", (unsigned long long) reached);
+    fprintf(stderr, "Reason: %s\n", vm_err(replay_result));
+    return 1;
+  }
+
+  printf("instruction %llu", (unsigned long long) reached);
+  if (vm->running) {
+    printf("\n");
+  } else {
+    printf(", stopped with exit code %d\n", vm->exit_code);
+  }
+
+  for (int i = 0; i < VM_REGCOUNT; i++) {
+    if (vm->regs[i] == 0) continue;
+    printf("r%-2d 0x%016llx\n", i, (unsigned long long) vm->regs[i]);
+  }
+
+  if (dump != NULL) {
+    FILE* out = fopen(dump, "wb");
+    if (out == NULL) {
+      fprintf(stderr, "Could not open file: %s\n", dump);
+      return 1;
+    }
+
+    fwrite(vm->memory, 1, vm->memory_size, out);
+    fclose(out);
+  }
+
+  return 0;
+}
+
+/*
+ * Write an executable in the compressed version 2 format (see exe_pack)
+ * */
+static int run_pack(Executable* exe, char* path) {
+  FILE* output = fopen(path, "wb");
+  if (output == NULL) {
+    fprintf(stderr, "Could not open file: %s\n", path);
+    return 1;
+  }
+
+  size_t packed_size = 0;
+  ExecutableError err = exe_pack(exe, output, &packed_size);
+  fclose(output);
+
+  if (err != exe_err_success) {
+    fprintf(stderr, "Could not pack executable: %s\n", exe_err(err));
+    return 1;
+  }
+
+  printf("Packed %zu bytes of data into %zu bytes\n", exe->data_size, packed_size);
+  exe_clean(exe);
+  return 0;
+}
+
+/*
+ * Translate the flashed program into a native module (see aot.h)
+ * */
+static int run_aot(VM* vm, char* path) {
+  uint32_t address = 0;
+  uint32_t count = 0;
+  VMError result = vm_aot_build(vm, path, &address, &count);
+
+  // The translator verifies the program first
+  if (result == vm_err_overlapping_code || result == vm_err_invalid_instruction ||
+      result == vm_err_illegal_memory_access) {
+    fprintf(stderr, "Verification failed at 0x%08x\n", address);
+  }
+
+  if (result != vm_err_regular_exit) {
+    fprintf(stderr, "Could not translate executable: %s\n", vm_err(result));
     return 1;
   }
 
-  uint8_t* buffer = malloc(inputStat.st_size);
+  printf("Translated %u instructions into %s\n", count, path);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+
+  // Parse the command-line options
+  char* filename = NULL;
+  char* batch = NULL;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  bool jit = false;
+  bool stats = false;
+  bool profile = false;
+  bool profile_json = false;
+  long buffer_size = VM_OUTPUT_BUFFERSIZE;
+  char* sample = NULL;
+  char* symbols = NULL;
+  long sample_interval = VM_SAMPLE_INTERVAL;
+  unsigned long long quota = 0;
+  char* framebuffer = NULL;
+  VMFrameFormat frame_format = vm_fb_ppm;
+  long fps = VM_FB_DEFAULT_FPS;
+  bool guard = false;
+  char* trace = NULL;
+  char* replay = NULL;
+  unsigned long long replay_at = UINT64_MAX;
+  char* dump = NULL;
+  bool verify = false;
+  bool stack_limit = false;
+  char* pack = NULL;
+  char* aot = NULL;
+  char* native = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--jit") == 0) {
+      jit = true;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      stats = true;
+    } else if (strcmp(argv[i], "--profile") == 0) {
+      profile = true;
+    } else if (strcmp(argv[i], "--profile-json") == 0) {
+      profile = true;
+      profile_json = true;
+    } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      batch = argv[++i];
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      threads = strtol(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--buffer") == 0 && i + 1 < argc) {
+      buffer_size = strtol(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc) {
+      sample = argv[++i];
+    } else if (strcmp(argv[i], "--sample-interval") == 0 && i + 1 < argc) {
+      sample_interval = strtol(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--symbols") == 0 && i + 1 < argc) {
+      symbols = argv[++i];
+    } else if (strcmp(argv[i], "--quota") == 0 && i + 1 < argc) {
+      quota = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--framebuffer") == 0 && i + 1 < argc) {
+      framebuffer = argv[++i];
+    } else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+      fps = strtol(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--frame-format") == 0 && i + 1 < argc) {
+      frame_format = strcmp(argv[++i], "delta") == 0 ? vm_fb_delta : vm_fb_ppm;
+    } else if (strcmp(argv[i], "--guard") == 0) {
+      guard = true;
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace = argv[++i];
+    } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      replay = argv[++i];
+    } else if (strcmp(argv[i], "--at") == 0 && i + 1 < argc) {
+      replay_at = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--dump") == 0 && i + 1 < argc) {
+      dump = argv[++i];
+    } else if (strcmp(argv[i], "--verify") == 0) {
+      verify = true;
+    } else if (strcmp(argv[i], "--stack-limit") == 0) {
+      stack_limit = true;
+    } else if (strcmp(argv[i], "--pack") == 0 && i + 1 < argc) {
+      pack = argv[++i];
+    } else if (strcmp(argv[i], "--aot") == 0 && i + 1 < argc) {
+      aot = argv[++i];
+    } else if (strcmp(argv[i], "--native") == 0 && i + 1 < argc) {
+      native = argv[++i];
+    } else {
+      filename = argv[i];
+    }
+  }
+
+  if (batch != NULL) {
+    return run_batch(batch, threads > 0 ? threads : 1, jit);
+  }
 
-  if (buffer == NULL) {
-    fprintf(stderr, "Could not allocate space for executable\n");
+  // A quota run only has the budget loop, these would be ignored
+  if (quota && (profile || guard || aot != NULL || native != NULL)) {
+    fprintf(stderr, "--quota can't be combined with --profile, --guard, --aot or --native\n");
     return 1;
   }
 
-  fread(buffer, inputStat.st_size, 1, fp);
+  // Check for the filename
+  if (filename == NULL) {
+    fprintf(stderr, "Missing filename\n");
+    return 1;
+  }
+
+  FILE* fp;
+  fp = fopen(filename, "r");
+
+  if (fp == NULL) {
+    fprintf(stderr, "Could not open file: %s\n", filename);
+    return 1;
+  }
 
+  // The executable is mapped instead of read, segments
+  // don't have to be copied around (see exe_map)
   Executable* exe;
-  ExecutableError err = exe_create(&exe, buffer, inputStat.st_size);
+  ExecutableError err = exe_map(&exe, fileno(fp));
 
   if (err != exe_err_success) {
     fprintf(stderr, "Could not parse executable: %s\n", exe_err(err));
     return 1;
   }
 
+  // Convert the executable instead of running it
+  if (pack != NULL) {
+    return run_pack(exe, pack);
+  }
+
   VM* vm;
 
-  VMError create_result = vm_create(&vm);
+  // The executable may ask for a memory size of its own
+  VMConfig config;
+  vm_config_default(&config);
+  vm_config_executable(&config, exe);
+  if (stack_limit) config.stack_size = VM_STACKSIZE;
+
+  VMError create_result = vm_create(&vm, &config);
   if (create_result != vm_err_regular_exit) {
     fprintf(stderr, "Could not initialize vm\n");
     fprintf(stderr, "Reason: %s\n", vm_err(create_result));
     return 1;
   }
 
+  // Terminals get to see each line as soon as it is written
+  VMFlushPolicy policy = isatty(STDOUT_FILENO) ? vm_flush_line : vm_flush_full;
+  VMError output_result = vm_output_configure(vm->output, buffer_size > 0 ? buffer_size : 0, policy);
+  if (output_result != vm_err_regular_exit) {
+    fprintf(stderr, "Could not allocate the output buffer\n");
+    fprintf(stderr, "Reason: %s\n", vm_err(output_result));
+    return 1;
+  }
+
+  // Has to happen before the executable is loaded, the memory is moved
+  if (guard) {
+    VMError guard_result = vm_guard_enable(vm);
+    if (guard_result != vm_err_regular_exit) {
+      fprintf(stderr, "Could not enable guard pages: %s\n", vm_err(guard_result));
+    }
+  }
+
+  // Fused pairs are only counted when somebody reads the counts
+  vm->count_fused = stats;
+
+  // The interpreter keeps working without the JIT
+  if (jit) {
+    VMError jit_result = vm_jit_enable(vm);
+    if (jit_result != vm_err_regular_exit) {
+      fprintf(stderr, "Could not enable the JIT: %s\n", vm_err(jit_result));
+    }
+  }
+
+  if (profile) {
+    VMError profile_result = vm_profile_enable(vm);
+    if (profile_result != vm_err_regular_exit) {
+      fprintf(stderr, "Could not enable the profiler: %s\n", vm_err(profile_result));
+    }
+  }
+
+  // Stream the VRAM, frames only contain what changed (see framebuffer.h)
+  FILE* framebuffer_fp = NULL;
+  if (framebuffer != NULL) {
+    framebuffer_fp = fopen(framebuffer, "wb");
+    if (framebuffer_fp == NULL) {
+      fprintf(stderr, "Could not open file: %s\n", framebuffer);
+      return 1;
+    }
+
+    VMError framebuffer_result = vm_framebuffer_enable(vm, framebuffer_fp, frame_format, fps > 0 ? fps : 0);
+    if (framebuffer_result != vm_err_regular_exit) {
+      fprintf(stderr, "Could not enable the framebuffer: %s\n", vm_err(framebuffer_result));
+    }
+  }
+
   VMError flash_result = vm_flash(vm, exe);
   if (flash_result != vm_err_regular_exit) {
     fprintf(stderr, "Could not load executable\n");
@@ -60,12 +380,107 @@ int main(int argc, char** argv) {
     return 1;
   }
 
+  // Verified code runs without range checks, code which doesn't pass isn't run at all
+  if (verify) {
+    uint32_t address;
+    VMError verify_result = vm_verify(vm, &address);
+    if (verify_result != vm_err_regular_exit) {
+      fprintf(stderr, "Verification failed at 0x%08x\n", address);
+      fprintf(stderr, "Reason: %s\n", vm_err(verify_result));
+      return 1;
+    }
+  }
+
+  // Translate the program instead of running it
+  if (aot != NULL) {
+    int aot_code = run_aot(vm, aot);
+    vm_clean(vm);
+    exe_clean(exe);
+    fclose(fp);
+    return aot_code;
+  }
+
+  // A module which doesn't belong to the executable isn't used at all
+  if (native != NULL) {
+    VMError native_result = vm_aot_load(vm, native);
+    if (native_result != vm_err_regular_exit) {
+      fprintf(stderr, "Could not load native module: %s\n", vm_err(native_result));
+      return 1;
+    }
+  }
+
+  // The trace is applied to the freshly flashed machine, nothing is executed
+  if (replay != NULL) {
+    int replay_code = replay_trace(vm, replay, replay_at, dump);
+    vm_clean(vm);
+    exe_clean(exe);
+    fclose(fp);
+    return replay_code;
+  }
+
+  // Every instruction from here on is recorded
+  FILE* trace_fp = NULL;
+  if (trace != NULL) {
+    trace_fp = fopen(trace, "wb");
+    if (trace_fp == NULL) {
+      fprintf(stderr, "Could not open file: %s\n", trace);
+      return 1;
+    }
+
+    VMError trace_result = vm_trace_enable(vm, trace_fp);
+    if (trace_result != vm_err_regular_exit) {
+      fprintf(stderr, "Could not start the trace: %s\n", vm_err(trace_result));
+    }
+  }
+
+  // Sample the call stacks of the program while it runs
+  VMSampler* sampler = NULL;
+  if (sample != NULL) {
+    VMError sampler_result = vm_sampler_create(&sampler, vm, sample_interval > 0 ? sample_interval : 0);
+    if (sampler_result == vm_err_regular_exit) {
+      sampler_result = vm_sampler_start(sampler);
+    }
+
+    if (sampler_result != vm_err_regular_exit) {
+      fprintf(stderr, "Could not start the sampler: %s\n", vm_err(sampler_result));
+      vm_sampler_clean(sampler);
+      sampler = NULL;
+    }
+  }
+
   int exit_code;
-  vm_run(vm, &exit_code);
+  if (quota) {
+
+    // The machine is stopped once it used up its quota
+    if (vm_run_for(vm, quota, &exit_code) == VM_YIELDED) {
+      vm_output_flush(vm->output);
+      vm_framebuffer_present(vm, true);
+      fprintf(stderr, "Instruction quota of %llu exceeded\n", quota);
+      exit_code = 1;
+    }
+  } else {
+    vm_run(vm, &exit_code);
+  }
+
+  if (sampler) {
+    vm_sampler_stop(sampler);
+    write_samples(sampler, sample, symbols);
+    vm_sampler_clean(sampler);
+  }
+
+  if (stats) {
+    vm_decode_stats(vm, stderr);
+  }
+
+  if (profile) {
+    vm_profile_dump(vm, stderr, profile_json);
+  }
 
   vm_clean(vm);
   exe_clean(exe);
   fclose(fp);
+  if (framebuffer_fp) fclose(framebuffer_fp);
+  if (trace_fp) fclose(trace_fp);
 
   return exit_code;
 }
@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "vm.h"
+#include "output.h"
+
+// Two decimal digits for each number below 100
+static const char decimal_pairs[200] =
+  "0001020304050607080910111213141516171819"
+  "2021222324252627282930313233343536373839"
+  "4041424344454647484950515253545556575859"
+  "6061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+/*
+ * Allocate the output of a machine
+ * */
+VMError vm_output_create(VMOutput** output, FILE* sink) {
+  VMOutput* output_ptr = malloc(sizeof(VMOutput));
+  uint8_t* buffer = malloc(VM_OUTPUT_BUFFERSIZE);
+
+  if (output_ptr == NULL || buffer == NULL) {
+    free(output_ptr);
+    free(buffer);
+    return vm_err_allocation;
+  }
+
+  output_ptr->sink = sink;
+  output_ptr->buffer = buffer;
+  output_ptr->size = VM_OUTPUT_BUFFERSIZE;
+  output_ptr->used = 0;
+  output_ptr->policy = vm_flush_full;
+
+  *output = output_ptr;
+  return vm_err_regular_exit;
+}
+
+/*
+ * Flush and free the output of a machine
+ * */
+void vm_output_clean(VMOutput* output) {
+  if (output == NULL) return;
+
+  vm_output_flush(output);
+  free(output->buffer);
+  free(output);
+}
+
+/*
+ * Write the buffer followed by some more data to the sink
+ * */
+static void vm_output_send(VMOutput* output, const uint8_t* data, size_t size) {
+  int fd = fileno(output->sink);
+
+  if (fd < 0) {
+    fwrite(output->buffer, 1, output->used, output->sink);
+    fwrite(data, 1, size, output->sink);
+    output->used = 0;
+    return;
+  }
+
+  // Anything the host printed through the stream goes first
+  fflush(output->sink);
+
+  struct iovec iov[2] = {
+    { output->buffer, output->used },
+    { (void*) data, size }
+  };
+  struct iovec* vec = iov;
+  int count = 2;
+
+  while (count > 0) {
+    ssize_t written = writev(fd, vec, count);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+
+    // Skip over everything that was written and retry the rest
+    while (count > 0 && (size_t) written >= vec->iov_len) {
+      written -= vec->iov_len;
+      vec++;
+      count--;
+    }
+
+    if (count > 0) {
+      vec->iov_base = (uint8_t*) vec->iov_base + written;
+      vec->iov_len -= written;
+    }
+  }
+
+  output->used = 0;
+}
+
+/*
+ * Append to the buffer, data which doesn't fit is written out right away
+ * */
+static void vm_output_append(VMOutput* output, const uint8_t* data, size_t size) {
+  if (output->used + size > output->size) {
+    vm_output_send(output, data, size);
+    return;
+  }
+
+  memcpy(output->buffer + output->used, data, size);
+  output->used += size;
+}
+
+/*
+ * Change the size of the buffer and when it gets flushed
+ *
+ * A size of 0 disables buffering
+ * */
+VMError vm_output_configure(VMOutput* output, size_t size, VMFlushPolicy policy) {
+  vm_output_flush(output);
+
+  uint8_t* buffer = realloc(output->buffer, size ? size : 1);
+  if (buffer == NULL) {
+    return vm_err_allocation;
+  }
+
+  output->buffer = buffer;
+  output->size = size;
+  output->policy = policy;
+  return vm_err_regular_exit;
+}
+
+/*
+ * Flush the buffer and write to another sink from now on
+ * */
+void vm_output_redirect(VMOutput* output, FILE* sink) {
+  vm_output_flush(output);
+  output->sink = sink;
+}
+
+/*
+ * Write data as is
+ * */
+void vm_output_write(VMOutput* output, const uint8_t* data, size_t size) {
+  vm_output_append(output, data, size);
+
+  if (output->policy == vm_flush_always ||
+     (output->policy == vm_flush_line && memchr(data, '\n', size) != NULL)) {
+    vm_output_flush(output);
+  }
+}
+
+/*
+ * Write an integer in decimal notation
+ * */
+void vm_output_integer(VMOutput* output, int64_t value) {
+  char digits[20];
+  char* cursor = digits + sizeof(digits);
+
+  // Negating in unsigned arithmetic also works for the smallest value
+  uint64_t magnitude = value < 0 ? -(uint64_t) value : (uint64_t) value;
+
+  while (magnitude >= 100) {
+    cursor -= 2;
+    memcpy(cursor, decimal_pairs + (magnitude % 100) * 2, 2);
+    magnitude /= 100;
+  }
+
+  if (magnitude >= 10) {
+    cursor -= 2;
+    memcpy(cursor, decimal_pairs + magnitude * 2, 2);
+  } else {
+    *--cursor = '0' + magnitude;
+  }
+
+  if (value < 0) {
+    *--cursor = '-';
+  }
+
+  vm_output_append(output, (uint8_t*) cursor, digits + sizeof(digits) - cursor);
+
+  if (output->policy == vm_flush_always) {
+    vm_output_flush(output);
+  }
+}
+
+/*
+ * Write out everything that is buffered
+ * */
+void vm_output_flush(VMOutput* output) {
+  if (output->used == 0) return;
+  vm_output_send(output, NULL, 0);
+}
@@ -0,0 +1,46 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "vm.h"
+
+#ifndef OUTPUTH
+#define OUTPUTH
+
+// Default size of the output buffer of a machine
+#define VM_OUTPUT_BUFFERSIZE (64 * 1024)
+
+// When the output buffer gets written to its sink
+//
+// The buffer is always flushed once it runs full, when the machine
+// stops or sleeps and when the guest issues the flush syscall
+typedef enum {
+  vm_flush_full,    // only in the cases listed above
+  vm_flush_line,    // after each syscall which wrote a newline
+  vm_flush_always   // after each syscall which wrote anything
+} VMFlushPolicy;
+
+/*
+ * Output written by the write and puts syscalls
+ *
+ * Sinks backed by a file descriptor are written to with writev,
+ * others (e.g. memory streams) with fwrite
+ * */
+typedef struct VMOutput {
+  FILE* sink;
+  uint8_t* buffer;
+  size_t size;
+  size_t used;
+  VMFlushPolicy policy;
+} VMOutput;
+
+// Output methods
+VMError vm_output_create(VMOutput** output, FILE* sink);
+void vm_output_clean(VMOutput* output);
+VMError vm_output_configure(VMOutput* output, size_t size, VMFlushPolicy policy);
+void vm_output_redirect(VMOutput* output, FILE* sink);
+void vm_output_write(VMOutput* output, const uint8_t* data, size_t size);
+void vm_output_integer(VMOutput* output, int64_t value);
+void vm_output_flush(VMOutput* output);
+
+#endif
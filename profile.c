@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "vm.h"
+#include "decode.h"
+#include "profile.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VM_PROFILE_UNIT "cycles"
+#else
+#define VM_PROFILE_UNIT "ns"
+#endif
+
+// Mnemonics of each opcode
+static const char* opcode_names[VM_PROFILE_OPCODES] = {
+  "rpush", "rpop", "mov", "loadi", "rst",
+  "add", "sub", "mul", "div", "idiv", "rem", "irem",
+  "fadd", "fsub", "fmul", "fdiv", "frem", "fexp",
+  "flt", "fgt",
+  "cmp", "lt", "gt", "ult", "ugt",
+  "shr", "shl", "and", "xor", "or", "not",
+  "inttofp", "sinttofp", "fptoint",
+  "load", "loadr", "loads", "loadsr", "store", "push",
+  "read", "readc", "reads", "readcs", "write", "writec", "writes", "writecs", "copy", "copyc",
+  "jz", "jzr", "jmp", "jmpr", "call", "callr", "ret",
+  "nop", "syscall",
+  "fill", "cmpmem", "findb",
+  "invalid"
+};
+
+// Names of the known syscalls
+static const char* syscall_names[VM_PROFILE_SYSCALLS] = {
+  [VM_SYS_EXIT] = "exit",
+  [VM_SYS_SLEEP] = "sleep",
+  [VM_SYS_WRITE] = "write",
+  [VM_SYS_PUTS] = "puts",
+  [VM_SYS_FLUSH] = "flush"
+};
+
+/*
+ * Start recording a profile on the next run of the machine
+ *
+ * Fused and width specialized instructions can't be told apart by opcode,
+ * so the decode cache is dropped and refilled without them. The JIT stays
+ * idle while profiling.
+ * */
+VMError vm_profile_enable(VM* vm) {
+  if (vm->profile == NULL) {
+    vm->profile = calloc(1, sizeof(VMProfile));
+    if (vm->profile == NULL) {
+      return vm_err_allocation;
+    }
+  }
+
+  vm_decode_flush(vm);
+  return vm_err_regular_exit;
+}
+
+/*
+ * Stop profiling and free the profile
+ * */
+void vm_profile_clean(VM* vm) {
+  if (vm->profile == NULL) return;
+
+  free(vm->profile);
+  vm->profile = NULL;
+  vm_decode_flush(vm);
+}
+
+/*
+ * Zero all counters
+ * */
+void vm_profile_reset(VM* vm) {
+  if (vm->profile == NULL) return;
+  memset(vm->profile, 0, sizeof(VMProfile));
+}
+
+/*
+ * Fill order with the indices of all entries which were executed,
+ * sorted by the time spent in them
+ *
+ * Returns the number of indices
+ * */
+static int vm_profile_order(int* order, const uint64_t* counts, const uint64_t* ticks, int count) {
+  int used = 0;
+  for (int i = 0; i < count; i++) {
+    if (counts[i] == 0) continue;
+
+    // There are only a few dozen entries, insertion sort is plenty
+    int j = used++;
+    while (j > 0 && ticks[order[j - 1]] < ticks[i]) {
+      order[j] = order[j - 1];
+      j--;
+    }
+    order[j] = i;
+  }
+
+  return used;
+}
+
+/*
+ * Print the profile as a table or as JSON
+ * */
+void vm_profile_dump(VM* vm, FILE* out, bool json) {
+  VMProfile* profile = vm->profile;
+  if (profile == NULL) return;
+
+  int opcodes[VM_PROFILE_OPCODES];
+  int syscalls[VM_PROFILE_SYSCALLS];
+  int opcode_count = vm_profile_order(opcodes, profile->counts, profile->ticks, VM_PROFILE_OPCODES);
+  int syscall_count = vm_profile_order(syscalls, profile->syscall_counts, profile->syscall_ticks, VM_PROFILE_SYSCALLS);
+
+  uint64_t total_count = 0;
+  uint64_t total_ticks = 0;
+  for (int i = 0; i < VM_PROFILE_OPCODES; i++) {
+    total_count += profile->counts[i];
+    total_ticks += profile->ticks[i];
+  }
+
+  if (json) {
+    fprintf(out, "{\"unit\": \"%s\", \"count\": %llu, \"%s\": %llu, \"opcodes\": [",
+            VM_PROFILE_UNIT, (unsigned long long) total_count, VM_PROFILE_UNIT, (unsigned long long) total_ticks);
+    for (int i = 0; i < opcode_count; i++) {
+      int op = opcodes[i];
+      fprintf(out, "%s{\"name\": \"%s\", \"count\": %llu, \"%s\": %llu}", i ? ", " : "",
+              opcode_names[op], (unsigned long long) profile->counts[op],
+              VM_PROFILE_UNIT, (unsigned long long) profile->ticks[op]);
+    }
+    fprintf(out, "], \"syscalls\": [");
+    for (int i = 0; i < syscall_count; i++) {
+      int id = syscalls[i];
+      fprintf(out, "%s{\"id\": %d, \"name\": \"%s\", \"count\": %llu, \"%s\": %llu}", i ? ", " : "",
+              id, syscall_names[id] ? syscall_names[id] : "unknown",
+              (unsigned long long) profile->syscall_counts[id],
+              VM_PROFILE_UNIT, (unsigned long long) profile->syscall_ticks[id]);
+    }
+    fprintf(out, "]}\n");
+    return;
+  }
+
+  fprintf(out, "Opcodes:\n");
+  fprintf(out, "  %-10s %14s %16s %7s %10s\n", "opcode", "count", VM_PROFILE_UNIT, "%", "per op");
+  for (int i = 0; i < opcode_count; i++) {
+    int op = opcodes[i];
+    fprintf(out, "  %-10s %14llu %16llu %6.2f%% %10.1f\n", opcode_names[op],
+            (unsigned long long) profile->counts[op], (unsigned long long) profile->ticks[op],
+            total_ticks ? 100.0 * profile->ticks[op] / total_ticks : 0.0,
+            (double) profile->ticks[op] / profile->counts[op]);
+  }
+  fprintf(out, "  %-10s %14llu %16llu\n", "total", (unsigned long long) total_count, (unsigned long long) total_ticks);
+
+  if (syscall_count == 0) return;
+
+  fprintf(out, "Syscalls:\n");
+  fprintf(out, "  %-10s %14s %16s %7s %10s\n", "syscall", "count", VM_PROFILE_UNIT, "%", "per call");
+  for (int i = 0; i < syscall_count; i++) {
+    int id = syscalls[i];
+    fprintf(out, "  %-10s %14llu %16llu %6.2f%% %10.1f\n", syscall_names[id] ? syscall_names[id] : "unknown",
+            (unsigned long long) profile->syscall_counts[id], (unsigned long long) profile->syscall_ticks[id],
+            total_ticks ? 100.0 * profile->syscall_ticks[id] / total_ticks : 0.0,
+            (double) profile->syscall_ticks[id] / profile->syscall_counts[id]);
+  }
+}
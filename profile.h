@@ -0,0 +1,54 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "vm.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#ifndef PROFILEH
+#define PROFILEH
+
+// Every opcode plus one entry for invalid instructions
+#define VM_PROFILE_OPCODES (op_num_types + 1)
+
+// Syscalls with an id below this are counted individually
+#define VM_PROFILE_SYSCALLS 16
+
+/*
+ * Execution counts and time spent per opcode and syscall
+ *
+ * The time of an instruction is measured from its dispatch up to the
+ * dispatch of the next one. Syscalls are also included in the time of
+ * the syscall instruction.
+ * */
+typedef struct VMProfile {
+  uint64_t counts[VM_PROFILE_OPCODES];
+  uint64_t ticks[VM_PROFILE_OPCODES];
+  uint64_t syscall_counts[VM_PROFILE_SYSCALLS];
+  uint64_t syscall_ticks[VM_PROFILE_SYSCALLS];
+} VMProfile;
+
+/*
+ * Current time, in cycles of the time-stamp counter on x86
+ * and in nanoseconds elsewhere
+ * */
+static inline uint64_t vm_profile_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+// Profile methods
+VMError vm_profile_enable(VM* vm);
+void vm_profile_clean(VM* vm);
+void vm_profile_reset(VM* vm);
+void vm_profile_dump(VM* vm, FILE* out, bool json);
+
+#endif
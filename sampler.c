@@ -0,0 +1,352 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include "vm.h"
+#include "sampler.h"
+
+// Older C libraries only expose the thread id of a timer event under its internal name
+#if defined(__linux__) && !defined(sigev_notify_thread_id)
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// Number of slots probed before a sample is dropped
+#define VM_SAMPLE_PROBES 64
+
+// The sampler of the current thread, the signal handler has no other way to find it
+static _Thread_local VMSampler* current_sampler;
+
+/*
+ * Allocate a sampler for a machine
+ *
+ * interval is the cpu time between two samples in microseconds
+ * */
+VMError vm_sampler_create(VMSampler** sampler, VM* vm, uint32_t interval) {
+  VMSampler* sampler_ptr = calloc(1, sizeof(VMSampler));
+  VMSampleSlot* slots = calloc(VM_SAMPLE_SLOTS, sizeof(VMSampleSlot));
+
+  if (sampler_ptr == NULL || slots == NULL) {
+    free(sampler_ptr);
+    free(slots);
+    return vm_err_allocation;
+  }
+
+  sampler_ptr->vm = vm;
+  sampler_ptr->slots = slots;
+  sampler_ptr->interval = interval ? interval : VM_SAMPLE_INTERVAL;
+
+  *sampler = sampler_ptr;
+  return vm_err_regular_exit;
+}
+
+/*
+ * Record the current call stack of the sampled machine
+ *
+ * Runs inside the signal handler, registers might be in the middle of
+ * being updated. Every access to guest memory is checked, a torn frame
+ * chain only cuts the sample short. The interpreter keeps the instruction
+ * pointer in a local, the register holds the start of the current block
+ * (see vm_loop.h).
+ * */
+static void vm_sampler_signal(int signal) {
+  (void) signal;
+
+  VMSampler* sampler = current_sampler;
+  if (sampler == NULL || !sampler->running) return;
+
+  VM* vm = sampler->vm;
+  uint32_t frames[VM_SAMPLE_DEPTH];
+  uint32_t depth = 0;
+
+  frames[depth++] = vm->regs[(VM_REGIP) & VM_CODEMASK];
+
+  // Walk the chain of saved frame pointers, see vm_push_stack_frame
+  uint32_t fp = vm->regs[(VM_REGFP) & VM_CODEMASK];
+  while (depth < VM_SAMPLE_DEPTH && fp <= vm->memory_size - 8) {
+    uint32_t saved_fp;
+    uint32_t return_address;
+    memcpy(&saved_fp, vm->memory + fp, 4);
+    memcpy(&return_address, vm->memory + fp + 4, 4);
+    frames[depth++] = return_address;
+
+    // The stack grows downwards, callers always live above their callees
+    if (saved_fp <= fp) break;
+    fp = saved_fp;
+  }
+
+  uint32_t hash = 2166136261u;
+  for (uint32_t i = 0; i < depth; i++) {
+    hash = (hash ^ frames[i]) * 16777619u;
+  }
+
+  for (uint32_t probe = 0; probe < VM_SAMPLE_PROBES; probe++) {
+    VMSampleSlot* slot = sampler->slots + ((hash + probe) & (VM_SAMPLE_SLOTS - 1));
+
+    if (slot->count == 0) {
+      slot->hash = hash;
+      slot->depth = depth;
+      memcpy(slot->frames, frames, depth * sizeof(uint32_t));
+      slot->count = 1;
+      sampler->samples++;
+      return;
+    }
+
+    if (slot->hash == hash && slot->depth == depth &&
+        memcmp(slot->frames, frames, depth * sizeof(uint32_t)) == 0) {
+      slot->count++;
+      sampler->samples++;
+      return;
+    }
+  }
+
+  sampler->dropped++;
+}
+
+/*
+ * Start sampling the machine on the calling thread
+ *
+ * The timer counts cpu time of the calling thread on Linux, and of
+ * the whole process elsewhere
+ * */
+VMError vm_sampler_start(VMSampler* sampler) {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = vm_sampler_signal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+
+  if (sigaction(SIGPROF, &action, NULL) != 0) {
+    return vm_err_internal_failure;
+  }
+
+  current_sampler = sampler;
+  sampler->running = true;
+
+  time_t seconds = sampler->interval / 1000000;
+  long microseconds = sampler->interval % 1000000;
+
+#ifdef __linux__
+  struct sigevent event;
+  memset(&event, 0, sizeof(event));
+  event.sigev_notify = SIGEV_THREAD_ID;
+  event.sigev_signo = SIGPROF;
+  event.sigev_notify_thread_id = syscall(SYS_gettid);
+
+  if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &sampler->timer) != 0) {
+    sampler->running = false;
+    current_sampler = NULL;
+    return vm_err_internal_failure;
+  }
+
+  struct itimerspec spec = {
+    { seconds, microseconds * 1000 },
+    { seconds, microseconds * 1000 }
+  };
+  timer_settime(sampler->timer, 0, &spec, NULL);
+#else
+  struct itimerval spec = {
+    { seconds, microseconds },
+    { seconds, microseconds }
+  };
+  setitimer(ITIMER_PROF, &spec, NULL);
+#endif
+
+  return vm_err_regular_exit;
+}
+
+/*
+ * Stop taking samples, the recorded ones are kept
+ * */
+void vm_sampler_stop(VMSampler* sampler) {
+  if (!sampler->running) return;
+
+#ifdef __linux__
+  timer_delete(sampler->timer);
+#else
+  struct itimerval spec;
+  memset(&spec, 0, sizeof(spec));
+  setitimer(ITIMER_PROF, &spec, NULL);
+#endif
+
+  sampler->running = false;
+  current_sampler = NULL;
+}
+
+// A symbolized stack and how often it was seen
+typedef struct VMFoldedStack {
+  char* stack;
+  uint64_t count;
+} VMFoldedStack;
+
+static int vm_folded_compare(const void* left, const void* right) {
+  return strcmp(((const VMFoldedStack*) left)->stack, ((const VMFoldedStack*) right)->stack);
+}
+
+/*
+ * Print the recorded stacks in the folded format of flamegraph.pl
+ *
+ * Each line lists the frames of a stack from the outermost to the
+ * innermost, separated by semicolons, followed by the number of samples.
+ * Without symbols, frames are printed as addresses.
+ * */
+void vm_sampler_dump(VMSampler* sampler, VMSymbols* symbols, FILE* out) {
+  VMFoldedStack* folded = malloc(VM_SAMPLE_SLOTS * sizeof(VMFoldedStack));
+  if (folded == NULL) return;
+
+  size_t count = 0;
+  for (size_t i = 0; i < VM_SAMPLE_SLOTS; i++) {
+    VMSampleSlot* slot = sampler->slots + i;
+    if (slot->count == 0) continue;
+
+    char* stack = NULL;
+    size_t size = 0;
+    FILE* line = open_memstream(&stack, &size);
+    if (line == NULL) continue;
+
+    for (uint32_t j = slot->depth; j-- > 0;) {
+
+      // Return addresses point behind the call, the call itself belongs to the caller
+      uint32_t address = slot->frames[j];
+      const char* name = vm_symbols_lookup(symbols, j ? address - 1 : address);
+
+      if (name) {
+        fprintf(line, "%s%s", name, j ? ";" : "");
+      } else {
+        fprintf(line, "0x%08x%s", address, j ? ";" : "");
+      }
+    }
+
+    fclose(line);
+    folded[count].stack = stack;
+    folded[count].count = slot->count;
+    count++;
+  }
+
+  // Different addresses can end up with the same names, merge them
+  qsort(folded, count, sizeof(VMFoldedStack), vm_folded_compare);
+  for (size_t i = 0; i < count; i++) {
+    uint64_t total = folded[i].count;
+    while (i + 1 < count && strcmp(folded[i].stack, folded[i + 1].stack) == 0) {
+      free(folded[i].stack);
+      total += folded[++i].count;
+    }
+
+    fprintf(out, "%s %llu\n", folded[i].stack, (unsigned long long) total);
+    free(folded[i].stack);
+  }
+
+  free(folded);
+}
+
+/*
+ * Stop the sampler and free its resources
+ * */
+void vm_sampler_clean(VMSampler* sampler) {
+  if (sampler == NULL) return;
+
+  vm_sampler_stop(sampler);
+  free(sampler->slots);
+  free(sampler);
+}
+
+static int vm_symbol_compare(const void* left, const void* right) {
+  uint32_t a = ((const VMSymbol*) left)->address;
+  uint32_t b = ((const VMSymbol*) right)->address;
+  return (a > b) - (a < b);
+}
+
+/*
+ * Read a symbol map
+ *
+ * Empty lines, lines starting with a # and lines which can't be parsed are ignored
+ * */
+VMError vm_symbols_load(VMSymbols** symbols, FILE* file) {
+  VMSymbols* symbols_ptr = calloc(1, sizeof(VMSymbols));
+  if (symbols_ptr == NULL) {
+    return vm_err_allocation;
+  }
+
+  size_t capacity = 0;
+  char* line = NULL;
+  size_t line_size = 0;
+  while (getline(&line, &line_size, file) != -1) {
+    if (line[0] == '#') continue;
+
+    char* end;
+    unsigned long address = strtoul(line, &end, 16);
+    if (end == line) continue;
+
+    // The name runs up to the next whitespace
+    char* name = end + strspn(end, " \t");
+    size_t length = strcspn(name, " \t\r\n");
+    if (length == 0) continue;
+
+    if (symbols_ptr->count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      VMSymbol* grown = realloc(symbols_ptr->symbols, capacity * sizeof(VMSymbol));
+      if (grown == NULL) {
+        free(line);
+        vm_symbols_clean(symbols_ptr);
+        return vm_err_allocation;
+      }
+      symbols_ptr->symbols = grown;
+    }
+
+    VMSymbol* symbol = symbols_ptr->symbols + symbols_ptr->count;
+    symbol->address = address;
+    symbol->name = strndup(name, length);
+    if (symbol->name == NULL) {
+      free(line);
+      vm_symbols_clean(symbols_ptr);
+      return vm_err_allocation;
+    }
+
+    symbols_ptr->count++;
+  }
+
+  free(line);
+  qsort(symbols_ptr->symbols, symbols_ptr->count, sizeof(VMSymbol), vm_symbol_compare);
+
+  *symbols = symbols_ptr;
+  return vm_err_regular_exit;
+}
+
+/*
+ * Name of the symbol an address belongs to
+ * Returns NULL if there is none
+ * */
+const char* vm_symbols_lookup(VMSymbols* symbols, uint32_t address) {
+  if (symbols == NULL || symbols->count == 0) return NULL;
+
+  // Find the last symbol at or below the address
+  size_t low = 0;
+  size_t high = symbols->count;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (symbols->symbols[middle].address <= address) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  return low ? symbols->symbols[low - 1].name : NULL;
+}
+
+/*
+ * Free a symbol map
+ * */
+void vm_symbols_clean(VMSymbols* symbols) {
+  if (symbols == NULL) return;
+
+  for (size_t i = 0; i < symbols->count; i++) {
+    free(symbols->symbols[i].name);
+  }
+
+  free(symbols->symbols);
+  free(symbols);
+}
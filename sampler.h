@@ -0,0 +1,84 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <signal.h>
+#include <time.h>
+#include "vm.h"
+
+#ifndef SAMPLERH
+#define SAMPLERH
+
+// Default time between two samples, in microseconds of cpu time
+#define VM_SAMPLE_INTERVAL 1000
+
+// Maximum number of frames recorded per sample, deeper stacks are cut off
+#define VM_SAMPLE_DEPTH 32
+
+// Number of distinct stacks which can be recorded, must be a power of two
+#define VM_SAMPLE_SLOTS 16384
+
+/*
+ * A distinct stack and how often it was seen
+ *
+ * frames[0] is the instruction pointer, followed by the return
+ * addresses of the enclosing frames
+ * */
+typedef struct VMSampleSlot {
+  uint64_t count;
+  uint32_t hash;
+  uint32_t depth;
+  uint32_t frames[VM_SAMPLE_DEPTH];
+} VMSampleSlot;
+
+/*
+ * Samples the call stack of a machine from a timer signal
+ *
+ * The signal handler only reads the machine's registers and memory and
+ * counts the stack in a preallocated hash table, nothing is allocated
+ * while the machine runs. Only the thread which started the sampler
+ * is sampled.
+ * */
+typedef struct VMSampler {
+  VM* vm;
+  VMSampleSlot* slots;
+  uint64_t samples;
+  uint64_t dropped;   // samples which didn't fit into the table
+  uint32_t interval;
+  bool running;
+#ifdef __linux__
+  timer_t timer;
+#endif
+} VMSampler;
+
+// A named address in guest memory
+typedef struct VMSymbol {
+  uint32_t address;
+  char* name;
+} VMSymbol;
+
+/*
+ * Maps addresses to the names of guest functions
+ *
+ * Loaded from a text file with one "<address> <name>" pair per line,
+ * addresses are hexadecimal. An address belongs to the closest
+ * symbol at or below it.
+ * */
+typedef struct VMSymbols {
+  VMSymbol* symbols;
+  size_t count;
+} VMSymbols;
+
+// Sampler methods
+VMError vm_sampler_create(VMSampler** sampler, VM* vm, uint32_t interval);
+VMError vm_sampler_start(VMSampler* sampler);
+void vm_sampler_stop(VMSampler* sampler);
+void vm_sampler_dump(VMSampler* sampler, VMSymbols* symbols, FILE* out);
+void vm_sampler_clean(VMSampler* sampler);
+
+// Symbol methods
+VMError vm_symbols_load(VMSymbols** symbols, FILE* file);
+const char* vm_symbols_lookup(VMSymbols* symbols, uint32_t address);
+void vm_symbols_clean(VMSymbols* symbols);
+
+#endif
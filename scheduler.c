@@ -0,0 +1,224 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "vm.h"
+#include "scheduler.h"
+
+/*
+ * Allocate an empty scheduler
+ *
+ * slice is the number of instructions a machine runs per turn,
+ * 0 selects VM_SCHED_SLICE
+ * */
+VMError vm_scheduler_create(VMScheduler** scheduler, uint64_t slice) {
+  VMScheduler* scheduler_ptr = calloc(1, sizeof(VMScheduler));
+  if (scheduler_ptr == NULL) {
+    return vm_err_allocation;
+  }
+
+  scheduler_ptr->slice = slice ? slice : VM_SCHED_SLICE;
+
+  *scheduler = scheduler_ptr;
+  return vm_err_regular_exit;
+}
+
+/*
+ * Make room for more tasks, the ring of runnable tasks is
+ * unrolled to the start of the new buffer
+ * */
+static bool vm_scheduler_grow(VMScheduler* scheduler) {
+  size_t capacity = scheduler->capacity ? scheduler->capacity * 2 : 16;
+
+  VMTask* tasks = realloc(scheduler->tasks, capacity * sizeof(VMTask));
+  if (tasks == NULL) return false;
+  scheduler->tasks = tasks;
+
+  size_t* timers = realloc(scheduler->timers, capacity * sizeof(size_t));
+  if (timers == NULL) return false;
+  scheduler->timers = timers;
+
+  size_t* queue = malloc(capacity * sizeof(size_t));
+  if (queue == NULL) return false;
+
+  for (size_t i = 0; i < scheduler->runnable; i++) {
+    queue[i] = scheduler->queue[(scheduler->head + i) % scheduler->capacity];
+  }
+
+  free(scheduler->queue);
+  scheduler->queue = queue;
+  scheduler->head = 0;
+  scheduler->capacity = capacity;
+  return true;
+}
+
+/*
+ * Append a task to the ring of runnable tasks
+ * */
+static void vm_scheduler_enqueue(VMScheduler* scheduler, size_t index) {
+  scheduler->tasks[index].state = vm_task_runnable;
+  scheduler->queue[(scheduler->head + scheduler->runnable) % scheduler->capacity] = index;
+  scheduler->runnable++;
+}
+
+static bool vm_scheduler_earlier(VMScheduler* scheduler, size_t left, size_t right) {
+  return scheduler->tasks[scheduler->timers[left]].wakeup < scheduler->tasks[scheduler->timers[right]].wakeup;
+}
+
+static void vm_scheduler_swap_timers(VMScheduler* scheduler, size_t left, size_t right) {
+  size_t index = scheduler->timers[left];
+  scheduler->timers[left] = scheduler->timers[right];
+  scheduler->timers[right] = index;
+}
+
+/*
+ * Park a task in the timer heap until its wakeup time
+ * */
+static void vm_scheduler_park(VMScheduler* scheduler, size_t index) {
+  scheduler->tasks[index].state = vm_task_sleeping;
+
+  size_t slot = scheduler->sleeping++;
+  scheduler->timers[slot] = index;
+  while (slot > 0 && vm_scheduler_earlier(scheduler, slot, (slot - 1) / 2)) {
+    vm_scheduler_swap_timers(scheduler, slot, (slot - 1) / 2);
+    slot = (slot - 1) / 2;
+  }
+}
+
+/*
+ * Remove the task with the earliest wakeup time from the timer heap
+ * */
+static size_t vm_scheduler_unpark(VMScheduler* scheduler) {
+  size_t index = scheduler->timers[0];
+  scheduler->timers[0] = scheduler->timers[--scheduler->sleeping];
+
+  size_t slot = 0;
+  for (;;) {
+    size_t earliest = slot;
+    size_t left = 2 * slot + 1;
+    size_t right = left + 1;
+    if (left < scheduler->sleeping && vm_scheduler_earlier(scheduler, left, earliest)) earliest = left;
+    if (right < scheduler->sleeping && vm_scheduler_earlier(scheduler, right, earliest)) earliest = right;
+    if (earliest == slot) break;
+
+    vm_scheduler_swap_timers(scheduler, slot, earliest);
+    slot = earliest;
+  }
+
+  return index;
+}
+
+/*
+ * Move every task whose wakeup time has passed back into the run queue
+ *
+ * If wait is set and no task is due yet, the thread sleeps
+ * until the earliest one is
+ * */
+static void vm_scheduler_wake(VMScheduler* scheduler, bool wait) {
+  uint64_t now = vm_now_ns();
+
+  if (wait) {
+    uint64_t wakeup = scheduler->tasks[scheduler->timers[0]].wakeup;
+    while (now < wakeup) {
+      uint64_t remaining = wakeup - now;
+      struct timespec duration = { remaining / 1000000000ULL, remaining % 1000000000ULL };
+      if (nanosleep(&duration, NULL) != 0 && errno != EINTR) break;
+      now = vm_now_ns();
+    }
+  }
+
+  while (scheduler->sleeping > 0 && scheduler->tasks[scheduler->timers[0]].wakeup <= now) {
+    vm_scheduler_enqueue(scheduler, vm_scheduler_unpark(scheduler));
+  }
+}
+
+/*
+ * Add a flashed machine to the scheduler
+ *
+ * quota limits the number of instructions the machine may run in total,
+ * 0 means no limit. The index of the task is written to task if it isn't NULL.
+ * The machine still belongs to the caller, its sleep syscalls are parked
+ * from now on (see vm_run_for).
+ * */
+VMError vm_scheduler_add(VMScheduler* scheduler, VM* vm, uint64_t quota, size_t* task) {
+  if (scheduler->count == scheduler->capacity && !vm_scheduler_grow(scheduler)) {
+    return vm_err_allocation;
+  }
+
+  size_t index = scheduler->count++;
+  VMTask* added = scheduler->tasks + index;
+  memset(added, 0, sizeof(VMTask));
+  added->vm = vm;
+  added->quota = quota;
+  vm->park_sleep = true;
+  vm_scheduler_enqueue(scheduler, index);
+
+  if (task) *task = index;
+  return vm_err_regular_exit;
+}
+
+/*
+ * Run the next runnable machine for one slice
+ *
+ * Sleeping machines whose time has come are woken up first. If all
+ * machines are asleep, this blocks until the first one wakes up.
+ * Returns false if there was nothing left to run
+ * */
+bool vm_scheduler_step(VMScheduler* scheduler) {
+  if (scheduler->sleeping > 0) {
+    vm_scheduler_wake(scheduler, scheduler->runnable == 0);
+  }
+
+  if (scheduler->runnable == 0) return false;
+
+  size_t index = scheduler->queue[scheduler->head];
+  scheduler->head = (scheduler->head + 1) % scheduler->capacity;
+  scheduler->runnable--;
+
+  VMTask* task = scheduler->tasks + index;
+  uint64_t slice = scheduler->slice;
+  if (task->quota && task->quota - task->used < slice) {
+    slice = task->quota - task->used;
+  }
+
+  task->result = vm_run_for(task->vm, slice, &task->exit_code);
+  task->used += slice - task->vm->budget;
+
+  if (task->result != VM_YIELDED && task->result != VM_SLEEPING) {
+    task->state = vm_task_exited;
+    return true;
+  }
+
+  if (task->quota && task->used >= task->quota) {
+    task->state = vm_task_over_quota;
+    return true;
+  }
+
+  if (task->result == VM_SLEEPING) {
+    task->wakeup = vm_now_ns() + task->vm->sleep_ns;
+    vm_scheduler_park(scheduler, index);
+    return true;
+  }
+
+  vm_scheduler_enqueue(scheduler, index);
+  return true;
+}
+
+/*
+ * Run until every machine stopped or ran out of quota
+ * */
+void vm_scheduler_run(VMScheduler* scheduler) {
+  while (vm_scheduler_step(scheduler));
+}
+
+/*
+ * Free the scheduler, the machines aren't touched
+ * */
+void vm_scheduler_clean(VMScheduler* scheduler) {
+  if (scheduler == NULL) return;
+
+  free(scheduler->tasks);
+  free(scheduler->queue);
+  free(scheduler->timers);
+  free(scheduler);
+}
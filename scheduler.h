@@ -0,0 +1,65 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "vm.h"
+
+#ifndef SCHEDULERH
+#define SCHEDULERH
+
+// Default number of instructions a machine runs before the next one gets its turn
+#define VM_SCHED_SLICE 10000
+
+typedef enum {
+  vm_task_runnable,
+  vm_task_sleeping,
+  vm_task_exited,
+  vm_task_over_quota
+} VMTaskState;
+
+/*
+ * A machine managed by the scheduler
+ *
+ * Machines which ran out of quota are left as they were,
+ * they can be resumed with vm_run or vm_run_for
+ *
+ * A machine which executed the sleep syscall is parked until its wakeup
+ * time, the other machines keep running in the meantime
+ * */
+typedef struct VMTask {
+  VM* vm;
+  VMTaskState state;
+  uint64_t quota;     // most instructions the machine may run, 0 for no limit
+  uint64_t used;      // instructions the machine has run so far
+  uint64_t wakeup;    // CLOCK_MONOTONIC time in nanoseconds a sleeping machine becomes runnable again
+  int result;         // return value of vm_run_for once the machine stopped
+  int exit_code;
+} VMTask;
+
+/*
+ * Runs many machines on a single thread, each one for a time slice
+ * of instructions at a time (see vm_run_for)
+ *
+ * Runnable tasks are kept in a ring, finished ones cost nothing.
+ * Sleeping tasks are kept in a min-heap ordered by their wakeup time,
+ * the thread only blocks once every remaining task is asleep.
+ * */
+typedef struct VMScheduler {
+  VMTask* tasks;
+  size_t count;
+  size_t capacity;
+  size_t* queue;      // ring of the runnable tasks
+  size_t head;
+  size_t runnable;
+  size_t* timers;     // heap of the sleeping tasks, earliest wakeup first
+  size_t sleeping;
+  uint64_t slice;
+} VMScheduler;
+
+// Scheduler methods
+VMError vm_scheduler_create(VMScheduler** scheduler, uint64_t slice);
+VMError vm_scheduler_add(VMScheduler* scheduler, VM* vm, uint64_t quota, size_t* task);
+bool vm_scheduler_step(VMScheduler* scheduler);
+void vm_scheduler_run(VMScheduler* scheduler);
+void vm_scheduler_clean(VMScheduler* scheduler);
+
+#endif
@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "vm.h"
+#include "snapshot.h"
+
+/*
+ * Create an anonymous file which is removed once it is closed
+ * Returns -1 on failure
+ * */
+static int vm_snapshot_file(void) {
+#ifdef __linux__
+  return memfd_create("vm-snapshot", MFD_CLOEXEC);
+#else
+  char path[] = "/tmp/vm-snapshot-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd >= 0) unlink(path);
+  return fd;
+#endif
+}
+
+/*
+ * Capture the memory and registers of a machine
+ *
+ * Pages which only contain zeroes aren't written, the file
+ * stays sparse for them
+ * */
+VMError vm_snapshot(VM* vm, VMSnapshot** snapshot) {
+  VMSnapshot* snapshot_ptr = malloc(sizeof(VMSnapshot));
+  if (snapshot_ptr == NULL) {
+    return vm_err_allocation;
+  }
+
+  int fd = vm_snapshot_file();
+  if (fd < 0 || ftruncate(fd, vm->memory_size) != 0) {
+    if (fd >= 0) close(fd);
+    free(snapshot_ptr);
+    return vm_err_internal_failure;
+  }
+
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  uint8_t* zero = calloc(1, page_size);
+  if (zero == NULL) {
+    close(fd);
+    free(snapshot_ptr);
+    return vm_err_allocation;
+  }
+
+  for (size_t offset = 0; offset < vm->memory_size; offset += page_size) {
+    size_t size = vm->memory_size - offset < page_size ? vm->memory_size - offset : page_size;
+    if (memcmp(vm->memory + offset, zero, size) == 0) continue;
+
+    if (pwrite(fd, vm->memory + offset, size, offset) != (ssize_t) size) {
+      free(zero);
+      close(fd);
+      free(snapshot_ptr);
+      return vm_err_internal_failure;
+    }
+  }
+
+  free(zero);
+
+  snapshot_ptr->fd = fd;
+  snapshot_ptr->config.memory_size = vm->memory_size;
+  snapshot_ptr->config.stack_start = vm->stack_start;
+  snapshot_ptr->config.stack_size = vm->stack_size;
+  snapshot_ptr->config.vram = vm->vram;
+  memcpy(snapshot_ptr->regs, vm->regs, VM_REGCOUNT * sizeof(uint64_t));
+  snapshot_ptr->running = vm->running;
+  snapshot_ptr->exit_code = vm->exit_code;
+
+  *snapshot = snapshot_ptr;
+  return vm_err_regular_exit;
+}
+
+/*
+ * Create a machine in the state captured by a snapshot
+ *
+ * The memory of the machine is a private mapping of the snapshot,
+ * pages are only copied once the machine writes to them. The machine
+ * gets the memory layout of the one the snapshot was taken from.
+ * */
+VMError vm_clone(VMSnapshot* snapshot, VM** vm) {
+  VM* vm_ptr;
+  VMError create_result = vm_create(&vm_ptr, &snapshot->config);
+  if (create_result != vm_err_regular_exit) {
+    return create_result;
+  }
+
+  // Replace the anonymous memory of the new machine
+  void* memory = mmap(vm_ptr->memory, vm_ptr->memory_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_FIXED, snapshot->fd, 0);
+  if (memory == MAP_FAILED) {
+    vm_clean(vm_ptr);
+    free(vm_ptr);
+    return vm_err_internal_failure;
+  }
+
+  vm_ptr->shared_memory = true;
+  memcpy(vm_ptr->regs, snapshot->regs, VM_REGCOUNT * sizeof(uint64_t));
+  vm_ptr->running = snapshot->running;
+  vm_ptr->exit_code = snapshot->exit_code;
+
+  *vm = vm_ptr;
+  return vm_err_regular_exit;
+}
+
+/*
+ * Release a snapshot
+ *
+ * Machines cloned from it keep working, their mappings
+ * keep the file alive
+ * */
+void vm_snapshot_clean(VMSnapshot* snapshot) {
+  if (snapshot == NULL) return;
+  close(snapshot->fd);
+  free(snapshot);
+}
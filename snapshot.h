@@ -0,0 +1,27 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include "vm.h"
+
+#ifndef SNAPSHOTH
+#define SNAPSHOTH
+
+/*
+ * The state of a machine at some point in time
+ *
+ * The memory lives in an anonymous file, machines cloned from the snapshot
+ * map it copy-on-write. They only pay for the pages they write to.
+ * */
+typedef struct VMSnapshot {
+  int fd;
+  VMConfig config;              // memory layout of the machine
+  uint64_t regs[VM_REGCOUNT];
+  bool running;
+  uint8_t exit_code;
+} VMSnapshot;
+
+// Snapshot methods
+VMError vm_snapshot(VM* vm, VMSnapshot** snapshot);
+VMError vm_clone(VMSnapshot* snapshot, VM** vm);
+void vm_snapshot_clean(VMSnapshot* snapshot);
+
+#endif
@@ -0,0 +1,507 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "vm.h"
+#include "decode.h"
+#include "trace.h"
+
+// Support macros
+#define CHUNK(TRACE, INDEX) ((TRACE)->ring + ((INDEX) % VM_TRACE_CHUNKS) * VM_TRACE_CHUNKSIZE)
+
+/*
+ * Append value as unsigned LEB128 varint, returns the end of the encoding
+ * */
+static inline uint8_t* vm_trace_varint(uint8_t* out, uint64_t value) {
+  while (value >= 0x80) {
+    *out++ = (uint8_t) value | 0x80;
+    value >>= 7;
+  }
+  *out++ = (uint8_t) value;
+  return out;
+}
+
+// Small negative numbers get small encodings as well
+static inline uint64_t vm_trace_zigzag(int64_t value) {
+  return ((uint64_t) value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t vm_trace_unzigzag(uint64_t value) {
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/*
+ * Drain full chunks into the sink until the trace is finished
+ *
+ * The lock is only held while looking for work, the machine can keep
+ * filling chunks while one is written
+ * */
+static void* vm_trace_writer(void* argument) {
+  VMTrace* trace = argument;
+
+  pthread_mutex_lock(&trace->lock);
+  for (;;) {
+    while (trace->head == trace->tail && !trace->finished) {
+      pthread_cond_wait(&trace->filled, &trace->lock);
+    }
+    if (trace->head == trace->tail) break;
+
+    uint8_t* chunk = CHUNK(trace, trace->head);
+    size_t size = trace->sizes[trace->head % VM_TRACE_CHUNKS];
+    pthread_mutex_unlock(&trace->lock);
+
+    if (!trace->failed && fwrite(chunk, 1, size, trace->sink) != size) {
+      trace->failed = true;
+    }
+
+    pthread_mutex_lock(&trace->lock);
+    trace->head++;
+    pthread_cond_signal(&trace->drained);
+  }
+  pthread_mutex_unlock(&trace->lock);
+
+  if (fflush(trace->sink) != 0) {
+    trace->failed = true;
+  }
+
+  return NULL;
+}
+
+/*
+ * Hand the chunk being filled to the writer and continue with the next one
+ *
+ * Waits if the writer didn't drain that one yet
+ * */
+static void vm_trace_submit(VMTrace* trace) {
+  pthread_mutex_lock(&trace->lock);
+  trace->sizes[trace->tail % VM_TRACE_CHUNKS] = trace->position;
+  trace->tail++;
+  pthread_cond_signal(&trace->filled);
+
+  if (trace->tail - trace->head == VM_TRACE_CHUNKS) {
+    trace->stalls++;
+    while (trace->tail - trace->head == VM_TRACE_CHUNKS) {
+      pthread_cond_wait(&trace->drained, &trace->lock);
+    }
+  }
+  pthread_mutex_unlock(&trace->lock);
+
+  trace->position = 0;
+}
+
+/*
+ * Returns room for size bytes in the chunk being filled, size can't
+ * exceed VM_TRACE_CHUNKSIZE
+ *
+ * The caller advances trace->position by what it actually used
+ * */
+static inline uint8_t* vm_trace_reserve(VMTrace* trace, size_t size) {
+  if (VM_TRACE_CHUNKSIZE - trace->position < size) {
+    vm_trace_submit(trace);
+  }
+
+  return CHUNK(trace, trace->tail) + trace->position;
+}
+
+/*
+ * Append data of any size, spreading it over as many chunks as needed
+ * */
+static void vm_trace_put(VMTrace* trace, const uint8_t* data, size_t size) {
+  while (size > 0) {
+    if (trace->position == VM_TRACE_CHUNKSIZE) {
+      vm_trace_submit(trace);
+    }
+
+    size_t room = VM_TRACE_CHUNKSIZE - trace->position;
+    size_t count = size < room ? size : room;
+    memcpy(CHUNK(trace, trace->tail) + trace->position, data, count);
+    trace->position += count;
+    data += count;
+    size -= count;
+  }
+}
+
+/*
+ * Append the registers in candidates which changed since the last entry
+ *
+ * Nothing is appended if none of them did
+ * */
+static inline uint8_t* vm_trace_encode_regs(VMTrace* trace, const uint64_t* regs, uint64_t candidates, uint8_t* out) {
+  uint64_t changed = 0;
+  while (candidates) {
+    int i = __builtin_ctzll(candidates);
+    candidates &= candidates - 1;
+    if (regs[i] != trace->shadow[i]) changed |= 1ULL << i;
+  }
+
+  if (changed == 0) return out;
+
+  uint8_t* cursor = out + 2;
+  out[0] = vm_tr_regs;
+  out[1] = 0;
+
+  while (changed) {
+    int i = __builtin_ctzll(changed);
+    changed &= changed - 1;
+
+    *cursor++ = i;
+    cursor = vm_trace_varint(cursor, regs[i] ^ trace->shadow[i]);
+    trace->shadow[i] = regs[i];
+    out[1]++;
+  }
+
+  return cursor;
+}
+
+/*
+ * Start recording every instruction the machine executes into sink
+ *
+ * The trace starts with the next instruction vm_run executes, the machine
+ * should be flashed by then. Fused instructions are turned off, so the
+ * decode cache is dropped. Compiled blocks and vm_run_for aren't traced.
+ * */
+VMError vm_trace_enable(VM* vm, FILE* sink) {
+  if (vm->trace) return vm_err_regular_exit;
+
+  VMTrace* trace = calloc(1, sizeof(VMTrace));
+  if (trace == NULL) {
+    return vm_err_allocation;
+  }
+
+  trace->ring = malloc(VM_TRACE_CHUNKS * VM_TRACE_CHUNKSIZE);
+  if (trace->ring == NULL) {
+    free(trace);
+    return vm_err_allocation;
+  }
+
+  trace->sink = sink;
+  pthread_mutex_init(&trace->lock, NULL);
+  pthread_cond_init(&trace->filled, NULL);
+  pthread_cond_init(&trace->drained, NULL);
+
+  uint32_t header[2] = { VM_TRACE_MAGIC, VM_TRACE_VERSION };
+  vm_trace_put(trace, (uint8_t*) header, sizeof(header));
+
+  if (pthread_create(&trace->writer, NULL, vm_trace_writer, trace) != 0) {
+    pthread_cond_destroy(&trace->drained);
+    pthread_cond_destroy(&trace->filled);
+    pthread_mutex_destroy(&trace->lock);
+    free(trace->ring);
+    free(trace);
+    return vm_err_internal_failure;
+  }
+
+  vm->trace = trace;
+  vm_decode_flush(vm);
+  return vm_err_regular_exit;
+}
+
+/*
+ * Stop recording, write everything that's left and free the trace
+ *
+ * The trace is ended with the exit code if the machine stopped
+ * */
+void vm_trace_clean(VM* vm) {
+  VMTrace* trace = vm->trace;
+  if (trace == NULL) return;
+
+  if (trace->started) {
+    uint8_t* out = vm_trace_reserve(trace, VM_TRACE_MAXSTEP);
+    uint8_t* end = vm_trace_encode_regs(trace, vm->regs, ~0ULL, out);
+    if (!vm->running) {
+      *end++ = vm_tr_end;
+      *end++ = vm->exit_code;
+    }
+    trace->position += end - out;
+  }
+
+  pthread_mutex_lock(&trace->lock);
+  trace->sizes[trace->tail % VM_TRACE_CHUNKS] = trace->position;
+  trace->tail++;
+  trace->finished = true;
+  pthread_cond_signal(&trace->filled);
+  pthread_mutex_unlock(&trace->lock);
+  pthread_join(trace->writer, NULL);
+
+  if (trace->failed) {
+    fprintf(stderr, "Could not write the trace, it is incomplete\n");
+  }
+
+  pthread_cond_destroy(&trace->drained);
+  pthread_cond_destroy(&trace->filled);
+  pthread_mutex_destroy(&trace->lock);
+  free(trace->ring);
+  free(trace);
+  vm->trace = NULL;
+  vm_decode_flush(vm);
+}
+
+/*
+ * Record that the instruction at ip is executed next
+ *
+ * The registers the previous instruction changed are recorded first,
+ * the first instruction is preceded by all registers instead.
+ *
+ * Instructions only write to the registers they name and to the special
+ * registers (and the exit syscall to r0), only those are compared. Comparing
+ * all of them would cost more than the instruction itself.
+ * */
+void vm_trace_step(VM* vm, uint32_t ip, const VMInstruction* inst) {
+  VMTrace* trace = vm->trace;
+  uint8_t* out = vm_trace_reserve(trace, VM_TRACE_MAXSTEP);
+  uint8_t* end;
+
+  if (trace->started) {
+    end = vm_trace_encode_regs(trace, vm->regs, trace->candidates, out);
+  } else {
+    *out = vm_tr_keyframe;
+    memcpy(out + 1, vm->regs, VM_REGCOUNT * sizeof(uint64_t));
+    memcpy(trace->shadow, vm->regs, VM_REGCOUNT * sizeof(uint64_t));
+    end = out + 1 + VM_REGCOUNT * sizeof(uint64_t);
+    trace->started = true;
+  }
+
+  *end++ = vm_tr_step;
+  *end++ = vm->memory[ip];
+  trace->position += end - out;
+  trace->steps++;
+
+  trace->candidates = VM_TRACE_SPECIAL |
+                      1ULL << (inst->r1 & VM_CODEMASK) |
+                      1ULL << (inst->r2 & VM_CODEMASK) |
+                      1ULL << (inst->a & VM_CODEMASK) |
+                      1ULL << (inst->b & VM_CODEMASK);
+}
+
+/*
+ * Record what a write left in memory, see vm_memory_written
+ * */
+void vm_trace_written(VM* vm, uint32_t address, uint32_t size) {
+  VMTrace* trace = vm->trace;
+  if (!trace->started) return;
+
+  if (trace->write_recorded) {
+    trace->write_recorded = false;
+    return;
+  }
+
+  uint8_t* out = vm_trace_reserve(trace, 21);
+  uint8_t* end = out;
+  *end++ = vm_tr_write;
+  end = vm_trace_varint(end, vm_trace_zigzag((int64_t) address - trace->last_write));
+  end = vm_trace_varint(end, size);
+  trace->position += end - out;
+  trace->last_write = address + size;
+
+  vm_trace_put(trace, vm->memory + address, size);
+}
+
+/*
+ * Record a copy within memory, instead of the bytes it wrote
+ *
+ * Replaying the copy produces the same bytes, as memory is replayed
+ * exactly. Has to be called right before the copy is reported to
+ * vm_memory_written.
+ * */
+void vm_trace_copied(VM* vm, uint32_t target, uint32_t source, uint32_t size) {
+  VMTrace* trace = vm->trace;
+  if (!trace->started || size == 0) return;
+
+  uint8_t* out = vm_trace_reserve(trace, 31);
+  uint8_t* end = out;
+  *end++ = vm_tr_copy;
+  end = vm_trace_varint(end, vm_trace_zigzag((int64_t) target - trace->last_write));
+  end = vm_trace_varint(end, vm_trace_zigzag((int64_t) source - target));
+  end = vm_trace_varint(end, size);
+  trace->position += end - out;
+  trace->last_write = target + size;
+  trace->write_recorded = true;
+}
+
+/*
+ * Record a fill, instead of the bytes it wrote
+ *
+ * Has to be called right before the fill is reported to vm_memory_written
+ * */
+void vm_trace_filled(VM* vm, uint32_t address, uint8_t value, uint32_t size) {
+  VMTrace* trace = vm->trace;
+  if (!trace->started || size == 0) return;
+
+  uint8_t* out = vm_trace_reserve(trace, 22);
+  uint8_t* end = out;
+  *end++ = vm_tr_fill;
+  end = vm_trace_varint(end, vm_trace_zigzag((int64_t) address - trace->last_write));
+  end = vm_trace_varint(end, size);
+  *end++ = value;
+  trace->position += end - out;
+  trace->last_write = address + size;
+  trace->write_recorded = true;
+}
+
+/*
+ * Read an unsigned LEB128 varint, returns false at the end of the file
+ * */
+static bool vm_trace_read_varint(FILE* source, uint64_t* value) {
+  uint64_t result = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int byte = getc(source);
+    if (byte == EOF) return false;
+
+    result |= (uint64_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      *value = result;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/*
+ * Bring a machine into the state it was in before the instruction with the
+ * given index was executed, counting from 0
+ *
+ * The machine has to be freshly flashed with the executable the trace was
+ * recorded from. If the trace ends before index, the machine is left in its
+ * final state. reached receives the index the machine is at.
+ * */
+VMError vm_trace_replay(VM* vm, FILE* source, uint64_t index, uint64_t* reached) {
+  uint32_t header[2];
+  if (fread(header, sizeof(header), 1, source) != 1 ||
+      header[0] != VM_TRACE_MAGIC || header[1] != VM_TRACE_VERSION) {
+    return vm_err_invalid_trace;
+  }
+
+  uint64_t steps = 0;
+  uint32_t last_write = 0;
+  VMError result = vm_err_regular_exit;
+  vm->running = true;
+
+  for (;;) {
+    int tag = getc(source);
+    if (tag == EOF) break;
+
+    switch (tag) {
+      case vm_tr_keyframe: {
+        if (fread(vm->regs, sizeof(uint64_t), VM_REGCOUNT, source) != VM_REGCOUNT) {
+          result = vm_err_invalid_trace;
+        }
+        break;
+      }
+
+      case vm_tr_step: {
+
+        // The executable has to match the one the trace was recorded from
+        uint32_t ip = vm_read_reg(vm, VM_REGIP);
+        int opcode = getc(source);
+        if (opcode == EOF || !vm_legal_address(vm, ip) || vm->memory[ip] != opcode) {
+          result = vm_err_invalid_trace;
+          break;
+        }
+
+        if (steps == index) goto done;
+        steps++;
+        break;
+      }
+
+      case vm_tr_regs: {
+        int count = getc(source);
+        if (count == EOF) count = -1;
+
+        for (int i = 0; i < count; i++) {
+          int reg = getc(source);
+          uint64_t delta;
+          if (reg == EOF || reg >= VM_REGCOUNT || !vm_trace_read_varint(source, &delta)) {
+            result = vm_err_invalid_trace;
+            break;
+          }
+          vm->regs[reg] ^= delta;
+        }
+
+        if (count < 0) result = vm_err_invalid_trace;
+        break;
+      }
+
+      case vm_tr_write: {
+        uint64_t distance;
+        uint64_t size;
+        if (!vm_trace_read_varint(source, &distance) || !vm_trace_read_varint(source, &size)) {
+          result = vm_err_invalid_trace;
+          break;
+        }
+
+        int64_t address = (int64_t) last_write + vm_trace_unzigzag(distance);
+        if (address < 0 || (uint64_t) address + size > vm->memory_size ||
+            fread(vm->memory + address, 1, size, source) != size) {
+          result = vm_err_invalid_trace;
+          break;
+        }
+
+        vm_memory_written(vm, address, size);
+        last_write = address + size;
+        break;
+      }
+
+      case vm_tr_copy:
+      case vm_tr_fill: {
+        uint64_t distance;
+        uint64_t size;
+        uint64_t operand;
+        if (!vm_trace_read_varint(source, &distance)) {
+          result = vm_err_invalid_trace;
+          break;
+        }
+
+        int64_t address = (int64_t) last_write + vm_trace_unzigzag(distance);
+        if (tag == vm_tr_copy) {
+          if (!vm_trace_read_varint(source, &operand) || !vm_trace_read_varint(source, &size)) {
+            result = vm_err_invalid_trace;
+            break;
+          }
+
+          int64_t from = address + vm_trace_unzigzag(operand);
+          if (address < 0 || from < 0 || (uint64_t) address + size > vm->memory_size ||
+              (uint64_t) from + size > vm->memory_size) {
+            result = vm_err_invalid_trace;
+            break;
+          }
+          memmove(vm->memory + address, vm->memory + from, size);
+        } else {
+          int value;
+          if (!vm_trace_read_varint(source, &size) || (value = getc(source)) == EOF ||
+              address < 0 || (uint64_t) address + size > vm->memory_size) {
+            result = vm_err_invalid_trace;
+            break;
+          }
+          memset(vm->memory + address, value, size);
+        }
+
+        vm_memory_written(vm, address, size);
+        last_write = address + size;
+        break;
+      }
+
+      case vm_tr_end: {
+        int exit_code = getc(source);
+        if (exit_code == EOF) {
+          result = vm_err_invalid_trace;
+          break;
+        }
+
+        vm->exit_code = exit_code;
+        vm->running = false;
+        goto done;
+      }
+
+      default:
+        result = vm_err_invalid_trace;
+        break;
+    }
+
+    if (result != vm_err_regular_exit) break;
+  }
+
+done:
+  *reached = steps;
+  return result;
+}
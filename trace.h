@@ -0,0 +1,98 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "vm.h"
+#include "decode.h"
+
+#ifndef TRACEH
+#define TRACEH
+
+// Magic number and version at the start of a trace
+#define VM_TRACE_MAGIC 0x52544d56 // VMTR
+#define VM_TRACE_VERSION 1
+
+// The ring buffer consists of this many chunks of this size, the writer
+// thread takes over a chunk once the machine filled it
+#define VM_TRACE_CHUNKSIZE (256 * 1024)
+#define VM_TRACE_CHUNKS 16
+
+// Registers every instruction may change, r0 and the special registers
+#define VM_TRACE_SPECIAL (1ULL | 0xfULL << 60)
+
+// Largest entries vm_trace_step appends at once, either a register entry
+// with every register changed or a keyframe, followed by the step
+#define VM_TRACE_MAXSTEP (2 + VM_REGCOUNT * 11 + 2)
+
+/*
+ * Entries of a trace
+ *
+ * A trace starts with the magic number and the version (u32, u32), followed
+ * by entries which each start with their tag (u8). Numbers are unsigned
+ * LEB128 varints unless noted otherwise, signed ones are zigzag encoded first.
+ *
+ * vm_tr_keyframe all registers (u64 each, little endian)
+ * vm_tr_step     the opcode (u8) of the instruction which is executed next,
+ *                its address is the instruction pointer at that point
+ * vm_tr_regs     the count of registers which changed (u8), followed by the
+ *                register (u8) and its old value XOR its new value for each
+ * vm_tr_write    the address as distance from the end of the previous write
+ *                (signed), the size and the bytes memory holds after the write
+ * vm_tr_copy     a copy within memory, the target like the address of a write,
+ *                the distance of the source from the target (signed) and the size
+ * vm_tr_fill     a fill, the address like the one of a write, the size and the
+ *                value (u8)
+ * vm_tr_end      the exit code (u8), the machine stopped
+ *
+ * Writes, copies and fills follow the step of the instruction which made them, the registers
+ * it changed follow its writes. The first step is preceded by a keyframe.
+ * */
+typedef enum {
+  vm_tr_keyframe,
+  vm_tr_step,
+  vm_tr_regs,
+  vm_tr_write,
+  vm_tr_copy,
+  vm_tr_fill,
+  vm_tr_end
+} VMTraceTag;
+
+/*
+ * Records every instruction a machine executes
+ *
+ * The machine encodes entries into a ring buffer of chunks, a writer thread
+ * drains full chunks into the sink. The machine only waits if all chunks
+ * are full, stalls counts how often that happened.
+ * */
+typedef struct VMTrace {
+  FILE* sink;
+  uint8_t* ring;                          // VM_TRACE_CHUNKS chunks of VM_TRACE_CHUNKSIZE bytes
+  size_t sizes[VM_TRACE_CHUNKS];          // bytes used in each chunk handed to the writer
+  uint64_t head;                          // chunks the writer has drained
+  uint64_t tail;                          // chunks handed to the writer, the machine fills chunk tail
+  size_t position;                        // bytes used in the chunk being filled
+  bool finished;                          // the writer exits once it drained everything
+  bool failed;                            // writing to the sink failed
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t filled;                  // signalled when a chunk was handed to the writer
+  pthread_cond_t drained;                 // signalled when the writer drained a chunk
+  bool started;                           // the keyframe was written
+  uint64_t shadow[VM_REGCOUNT];           // registers as of the last entry
+  uint64_t candidates;                    // registers the previous instruction may have changed
+  uint32_t last_write;                    // end of the previous write
+  bool write_recorded;                    // the next write was already recorded as a copy or fill
+  uint64_t steps;                         // instructions recorded
+  uint64_t stalls;                        // times the machine waited for the writer
+} VMTrace;
+
+// Trace methods
+VMError vm_trace_enable(VM* vm, FILE* sink);
+void vm_trace_clean(VM* vm);
+void vm_trace_step(VM* vm, uint32_t ip, const VMInstruction* inst);
+void vm_trace_written(VM* vm, uint32_t address, uint32_t size);
+void vm_trace_copied(VM* vm, uint32_t target, uint32_t source, uint32_t size);
+void vm_trace_filled(VM* vm, uint32_t address, uint8_t value, uint32_t size);
+VMError vm_trace_replay(VM* vm, FILE* source, uint64_t index, uint64_t* reached);
+
+#endif
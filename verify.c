@@ -0,0 +1,231 @@
+#include <stdlib.h>
+#include <string.h>
+#include "vm.h"
+#include "decode.h"
+#include "verify.h"
+
+// Bitmaps with one bit per address of the machine's memory
+#define VM_VERIFY_WORDS(SIZE) (((uint64_t)(SIZE) + 63) / 64)
+
+static bool vm_verify_test(const uint64_t* bits, uint64_t address) {
+  return (bits[address / 64] >> (address % 64)) & 1;
+}
+
+static void vm_verify_set(uint64_t* bits, uint64_t address) {
+  bits[address / 64] |= 1ULL << (address % 64);
+}
+
+// Clears the bits of [start, end) a word at a time, writes mostly touch one or two words
+static void vm_verify_clear(uint64_t* bits, uint64_t start, uint64_t end) {
+  while (start < end) {
+    uint64_t word_end = (start | 63) + 1;
+    if (word_end > end) word_end = end;
+
+    uint64_t count = word_end - start;
+    uint64_t mask = count == 64 ? ~0ULL : ((1ULL << count) - 1) << (start % 64);
+    bits[start / 64] &= ~mask;
+    start = word_end;
+  }
+}
+
+// Returns true if size bytes at address are inside memory, like CHECK_RANGE of the interpreter
+static bool vm_verify_range(VM* vm, uint32_t address, uint64_t size) {
+  return (uint64_t) address + size < vm->memory_size;
+}
+
+/*
+ * Check the constant addresses of a decoded instruction
+ * */
+static VMError vm_verify_operands(VM* vm, opcode instruction, VMInstruction* inst) {
+  bool legal;
+  switch (instruction) {
+    case op_readc:
+    case op_writec:
+      legal = vm_verify_range(vm, inst->a, vm_reg_size(inst->r1));
+      break;
+    case op_readcs:
+      legal = vm_verify_range(vm, inst->b, inst->a);
+      break;
+    case op_writecs:
+      legal = vm_verify_range(vm, inst->a, inst->b);
+      break;
+    case op_copyc:
+      legal = vm_verify_range(vm, inst->a, inst->b) && vm_verify_range(vm, inst->c, inst->b);
+      break;
+    case op_jz:
+    case op_jmp:
+    case op_call:
+      legal = vm_legal_address(vm, inst->a);
+      break;
+    default:
+      legal = true;
+      break;
+  }
+
+  return legal ? vm_err_regular_exit : vm_err_illegal_memory_access;
+}
+
+/*
+ * Verify the code reachable from the instruction pointer
+ *
+ * Has to be called after vm_flash, before the machine runs. On failure,
+ * address receives the address of the offending instruction and the
+ * machine stays unverified. The decode cache is flushed on success.
+ * */
+VMError vm_verify(VM* vm, uint32_t* address) {
+  vm_verify_clean(vm);
+
+  size_t words = VM_VERIFY_WORDS(vm->memory_size);
+  uint64_t* starts = calloc(words, sizeof(uint64_t));
+  uint64_t* covered = calloc(words, sizeof(uint64_t));
+  size_t capacity = 64;
+  size_t pending = 0;
+  uint32_t* worklist = malloc(capacity * sizeof(uint32_t));
+
+  if (starts == NULL || covered == NULL || worklist == NULL) {
+    free(starts);
+    free(covered);
+    free(worklist);
+    return vm_err_allocation;
+  }
+
+  VMError result = vm_err_regular_exit;
+  uint32_t ip = vm_read_reg(vm, VM_REGIP);
+  uint32_t low = ip;
+  uint32_t high = ip;
+  worklist[pending++] = ip;
+
+  while (result == vm_err_regular_exit && pending > 0) {
+    ip = worklist[--pending];
+
+    // Set if the previous instruction pushed the id of the exit syscall
+    bool exits = false;
+
+    // Follow the path until it ends or joins code which was verified already
+    for (;;) {
+      if (!vm_legal_address(vm, ip)) {
+        result = vm_err_illegal_memory_access;
+        break;
+      }
+
+      if (vm_verify_test(starts, ip)) break;
+
+      opcode instruction = vm->memory[ip];
+      if (instruction >= op_num_types) {
+        result = vm_err_invalid_instruction;
+        break;
+      }
+
+      VMInstruction inst;
+      uint64_t length = vm_decode(vm, ip, instruction, &inst);
+      if (length == 0 || (uint64_t) ip + length > vm->memory_size) {
+        result = vm_err_illegal_memory_access;
+        break;
+      }
+
+      // The instruction may neither start nor end inside another one
+      bool overlaps = vm_verify_test(covered, ip);
+      for (uint64_t i = 1; i < length && !overlaps; i++) {
+        overlaps = vm_verify_test(starts, ip + i) || vm_verify_test(covered, ip + i);
+      }
+
+      if (overlaps) {
+        result = vm_err_overlapping_code;
+        break;
+      }
+
+      result = vm_verify_operands(vm, instruction, &inst);
+      if (result != vm_err_regular_exit) break;
+
+      vm_verify_set(starts, ip);
+      if (ip < low) low = ip;
+      if ((uint64_t) ip + length > high) high = ip + length;
+      for (uint64_t i = 1; i < length; i++) {
+        vm_verify_set(covered, ip + i);
+      }
+
+      // Constant targets are verified once the current path ended
+      if (instruction == op_jz || instruction == op_jmp || instruction == op_call) {
+        if (pending == capacity) {
+          uint32_t* grown = realloc(worklist, capacity * 2 * sizeof(uint32_t));
+          if (grown == NULL) {
+            result = vm_err_allocation;
+            break;
+          }
+
+          worklist = grown;
+          capacity *= 2;
+        }
+
+        worklist[pending++] = inst.a;
+      }
+
+      bool ends = instruction == op_jmp || instruction == op_jmpr || instruction == op_ret ||
+                  (instruction == op_syscall && exits);
+      if (ends) break;
+
+      exits = instruction == op_push && inst.a == 2 && *(uint16_t *)(vm->memory + ip + 5) == VM_SYS_EXIT;
+      ip = inst.next;
+    }
+  }
+
+  free(worklist);
+  free(covered);
+
+  VMVerified* verified = NULL;
+  if (result == vm_err_regular_exit) {
+    verified = malloc(sizeof(VMVerified));
+    if (verified == NULL) result = vm_err_allocation;
+  }
+
+  if (result != vm_err_regular_exit) {
+    free(starts);
+    *address = ip;
+    return result;
+  }
+
+  // Instructions which were decoded before have the checked handlers
+  verified->starts = starts;
+  verified->low = low;
+  verified->high = high;
+  vm->verified = verified;
+  vm_decode_flush(vm);
+  return vm_err_regular_exit;
+}
+
+/*
+ * Drop the verification, every instruction is checked again
+ * */
+void vm_verify_clean(VM* vm) {
+  if (vm->verified == NULL) return;
+
+  free(vm->verified->starts);
+  free(vm->verified);
+  vm->verified = NULL;
+}
+
+/*
+ * Instructions overlapping with a write aren't verified anymore
+ *
+ * Only instructions of up to VM_INSTRUCTION_MAXLENGTH bytes get handlers
+ * without checks, so only their bits have to be cleared. Writes to data
+ * outside of the verified code return right away.
+ * */
+void vm_verify_written(VM* vm, uint32_t address, uint32_t size) {
+  VMVerified* verified = vm->verified;
+  if (verified == NULL) return;
+  if (address >= verified->high || (uint64_t) address + size <= verified->low) return;
+
+  uint64_t start = address < VM_INSTRUCTION_MAXLENGTH ? 0 : address - (VM_INSTRUCTION_MAXLENGTH - 1);
+  uint64_t end = (uint64_t) address + size;
+  if (end > vm->memory_size) end = vm->memory_size;
+
+  vm_verify_clear(verified->starts, start, end);
+}
+
+/*
+ * Returns true if the instruction at address was verified
+ * */
+bool vm_verified(VM* vm, uint32_t address) {
+  return vm->verified && vm_legal_address(vm, address) && vm_verify_test(vm->verified->starts, address);
+}
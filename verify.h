@@ -0,0 +1,35 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include "vm.h"
+
+#ifndef VERIFYH
+#define VERIFYH
+
+/*
+ * Load-time verification of the code a machine can reach
+ *
+ * vm_verify walks the code reachable from the instruction pointer of a
+ * freshly flashed machine, following fall-through, constant jumps and calls.
+ * Jumps through registers and returns aren't followed, a syscall preceded by
+ * a push of the exit syscall's id ends the path. Every instruction on the way
+ * has to have a valid opcode, fit into memory and must not overlap with another
+ * one, which also puts constant jump and call targets on instruction boundaries.
+ * The ranges of readc, readcs, writec, writecs and copyc have to be inside memory.
+ *
+ * The start of every instruction which passed is kept in a bitmap. The decode
+ * cache selects handlers without range checks for them (see vm_decode_cached),
+ * until a write to the instruction clears its bit again.
+ * */
+typedef struct VMVerified {
+  uint64_t* starts;                       // one bit per address of memory, set for verified instructions
+  uint32_t low;                           // lowest verified instruction start
+  uint32_t high;                          // end of the highest verified instruction
+} VMVerified;
+
+// Verify methods
+VMError vm_verify(VM* vm, uint32_t* address);
+void vm_verify_clean(VM* vm);
+void vm_verify_written(VM* vm, uint32_t address, uint32_t size);
+bool vm_verified(VM* vm, uint32_t address);
+
+#endif
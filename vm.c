@@ -4,27 +4,232 @@
 #include <string.h>
 #include <unistd.h>
 #include <math.h>
+#include <time.h>
+#include <sys/mman.h>
 #include "vm.h"
 #include "exe.h"
+#include "compress.h"
+#include "decode.h"
+#include "jit.h"
+#include "output.h"
+#include "profile.h"
+#include "framebuffer.h"
+#include "bulk.h"
+#include "guard.h"
+#include "trace.h"
+#include "verify.h"
+#include "aot.h"
 
 // Support macros
 #define REG(X) vm_read_reg(vm, X)
 
+// Small helpers which are used by every instruction have to be inlined
+// into the interpreter loop, no matter how big it gets
+#if defined(__GNUC__) || defined(__clang__)
+#define VM_INLINE inline __attribute__((always_inline))
+#else
+#define VM_INLINE inline
+#endif
+
+// Interpreter loops, instantiated from vm_loop.h further down
+static void vm_loop(VM* vm);
+static void vm_loop_jit(VM* vm);
+static void vm_loop_profile(VM* vm);
+static void vm_loop_budget(VM* vm);
+static void vm_loop_guarded(VM* vm);
+static void vm_loop_trace(VM* vm);
+
+/*
+ * Map the machine's memory
+ *
+ * The memory is backed by anonymous pages, which the kernel only allocates
+ * (and zeroes) once the program touches them
+ * Returns NULL if the mapping failed
+ * */
+static uint8_t* vm_memory_map(uint32_t size) {
+  void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return memory == MAP_FAILED ? NULL : memory;
+}
+
+/*
+ * Zero the machine's memory by handing its pages back to the kernel
+ *
+ * Only the pages which were touched since the last reset cost anything
+ * Returns false if the memory couldn't be reset
+ * */
+static bool vm_memory_reset(VM* vm) {
+
+  // The memory doesn't have to start on a page boundary (see guard.h),
+  // the pages in front of it belong to the mapping as well
+  size_t size = (vm->memory - vm->memory_mapping) + vm->memory_size;
+
+  // Memory mapped from a file has to be replaced with anonymous pages,
+  // dropping the pages would bring back the contents of the file
+  if (vm->shared_memory) {
+    void* memory = mmap(vm->memory_mapping, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    if (memory == MAP_FAILED) return false;
+    vm->shared_memory = false;
+    return true;
+  }
+
+#ifdef __linux__
+
+  // Private anonymous pages read as zero after MADV_DONTNEED on Linux
+  return madvise(vm->memory_mapping, size, MADV_DONTNEED) == 0;
+#else
+
+  // Elsewhere MADV_DONTNEED may keep the contents, map fresh pages over them instead
+  void* memory = mmap(vm->memory_mapping, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  return memory != MAP_FAILED;
+#endif
+}
+
+/*
+ * Copy a segment of an executable into the machine's memory
+ *
+ * Segments of mapped executables (see exe_map) are mapped copy-on-write
+ * wherever the load address and the offset in the file line up on page
+ * boundaries, only the partial pages at both ends are copied
+ * */
+static void vm_load_segment(VM* vm, Executable* exe, uint32_t offset, uint32_t size, uint32_t load) {
+  if (exe->fd >= 0) {
+
+    // Page boundaries of the host, the machine's memory doesn't have to start on one
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t target = (uintptr_t)(vm->memory + load);
+    uintptr_t start = (target + page_size - 1) / page_size * page_size;
+    uintptr_t end = (target + size) / page_size * page_size;
+    size_t file_offset = exe->data_offset + offset + (start - target);
+
+    if (file_offset % page_size == 0 && start < end) {
+      void* memory = mmap((void*) start, end - start, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_FIXED, exe->fd, file_offset);
+
+      if (memory != MAP_FAILED) {
+        vm->shared_memory = true;
+        memmove(vm->memory + load, exe->data + offset, start - target);
+        memmove((uint8_t*) end, exe->data + offset + (end - target), target + size - end);
+        return;
+      }
+    }
+  }
+
+  memmove(vm->memory + load, exe->data + offset, size);
+}
+
+/*
+ * Clear the memory of a zero segment (see exe.h)
+ *
+ * The memory was reset before the executable was loaded, only the bytes
+ * which segments before it loaded into have to be cleared again
+ * */
+static void vm_clear_segment(VM* vm, Executable* exe, size_t index) {
+  LoadEntry* zero = exe->header->load_table + index;
+  uint64_t zero_end = (uint64_t) zero->load + zero->memory_size;
+
+  for (size_t i = 0; i < index; i++) {
+    LoadEntry* entry = exe->header->load_table + i;
+    if (entry->offset == EXE_MEMORY_REQUEST || (entry->flags & EXE_SEGMENT_ZERO)) continue;
+
+    uint64_t start = entry->load > zero->load ? entry->load : zero->load;
+    uint64_t end = (uint64_t) entry->load + entry->memory_size;
+    if (end > zero_end) end = zero_end;
+    if (start < end) memset(vm->memory + start, 0, end - start);
+  }
+}
+
+/*
+ * The standard memory layout, 8 megabytes with VRAM
+ * */
+void vm_config_default(VMConfig* config) {
+  config->memory_size = VM_MEMORYSIZE;
+  config->stack_start = VM_STACK_START;
+  config->stack_size = 0;
+  config->vram = true;
+}
+
+/*
+ * Adjust a config to the memory size an executable requests
+ *
+ * The stack keeps its start unless the memory ends before it, VRAM is
+ * turned off if the memory doesn't cover it
+ * */
+void vm_config_executable(VMConfig* config, Executable* exe) {
+  uint32_t size = exe->header->memory_size;
+  if (size == 0) return;
+
+  config->memory_size = size;
+  if (config->stack_start > size) config->stack_start = size;
+  if (size < VM_VRAM + VM_VRAMSIZE) config->vram = false;
+}
+
 /*
  * Allocate the memory for VM struct
- * Returns false if allocation failed
+ *
+ * config may be NULL for the default layout (see vm_config_default)
+ * Returns vm_err_invalid_config if the layout doesn't fit into the memory
  * */
-VMError vm_create(VM** vm) {
+VMError vm_create(VM** vm, const VMConfig* config) {
+  VMConfig defaults;
+  if (config == NULL) {
+    vm_config_default(&defaults);
+    config = &defaults;
+  }
+
+  if (config->memory_size < VM_MEMORY_MINSIZE || config->memory_size > VM_MEMORY_MAXSIZE ||
+      config->stack_start > config->memory_size ||
+      (config->vram && config->memory_size < VM_VRAM + VM_VRAMSIZE)) {
+    return vm_err_invalid_config;
+  }
+
   VM* vm_ptr = malloc(sizeof(VM));
-  uint8_t* memory = malloc(VM_MEMORYSIZE * sizeof(uint8_t));
+  uint8_t* memory = vm_memory_map(config->memory_size);
   uint64_t* regs = malloc(VM_REGCOUNT * sizeof(uint64_t));
-
-  if (vm_ptr == NULL || memory == NULL || regs == NULL) {
+  VMCodePage** code_pages = calloc(VM_CODEPAGE_COUNT(config->memory_size), sizeof(VMCodePage*));
+  uint64_t* fused_counts = calloc(handler_num_types, sizeof(uint64_t));
+  VMOutput* output = NULL;
+  vm_output_create(&output, stdout);
+
+  if (vm_ptr == NULL || memory == NULL || regs == NULL || code_pages == NULL || fused_counts == NULL || output == NULL) {
+    free(vm_ptr);
+    if (memory != NULL) munmap(memory, config->memory_size);
+    free(regs);
+    free(code_pages);
+    free(fused_counts);
+    vm_output_clean(output);
     return vm_err_allocation;
   }
 
   vm_ptr->memory = memory;
+  vm_ptr->memory_size = config->memory_size;
+  vm_ptr->stack_start = config->stack_start;
+  vm_ptr->stack_size = config->stack_size;
+  vm_ptr->stack_limit = 0;
+  if (config->stack_size != 0 && config->stack_size < config->stack_start) {
+    vm_ptr->stack_limit = config->stack_start - config->stack_size;
+  }
+  vm_ptr->vram = config->vram;
+  vm_ptr->memory_mapping = memory;
+  vm_ptr->memory_mapping_size = config->memory_size;
+  vm_ptr->guarded = false;
   vm_ptr->regs = regs;
+  vm_ptr->code_pages = code_pages;
+  vm_ptr->jit = NULL;
+  vm_ptr->fused_counts = fused_counts;
+  vm_ptr->shared_memory = false;
+  vm_ptr->output = output;
+  vm_ptr->profile = NULL;
+  vm_ptr->framebuffer = NULL;
+  vm_ptr->trace = NULL;
+  vm_ptr->verified = NULL;
+  vm_ptr->aot = NULL;
+  vm_ptr->budget = 0;
+  vm_ptr->count_fused = false;
+  vm_ptr->park_sleep = false;
+  vm_ptr->sleeping = false;
+  vm_ptr->sleep_ns = 0;
   vm_ptr->running = true;
   vm_ptr->exit_code = 0;
 
@@ -38,7 +243,17 @@ VMError vm_create(VM** vm) {
 void vm_clean(VM* vm) {
   if (vm == NULL) return;
 
-  free(vm->memory);
+  vm_output_clean(vm->output);
+  vm_trace_clean(vm);
+  vm_verify_clean(vm);
+  vm_aot_clean(vm);
+  vm_profile_clean(vm);
+  vm_framebuffer_clean(vm);
+  vm_jit_clean(vm);
+  vm_decode_flush(vm);
+  free(vm->code_pages);
+  free(vm->fused_counts);
+  munmap(vm->memory_mapping, vm->memory_mapping_size);
   free(vm->regs);
   return;
 }
@@ -50,49 +265,102 @@ VMError vm_flash(VM* vm, Executable* exe) {
 
   // Reset the machine
   memset(vm->regs, 0, VM_REGCOUNT * sizeof(uint64_t));
-  memset(vm->memory, 0, VM_MEMORYSIZE);
+  if (!vm_memory_reset(vm)) {
+    return vm_err_internal_failure;
+  }
+  memset(vm->fused_counts, 0, handler_num_types * sizeof(uint64_t));
+  vm_profile_reset(vm);
+  vm_framebuffer_reset(vm);
+  vm_jit_reset(vm);
+  vm_verify_clean(vm);
+  vm_aot_clean(vm);
+  vm_decode_flush(vm);
   vm->running = true;
+  vm->sleeping = false;
   vm->exit_code = 0;
 
   // Initialize special purpose registers
-  vm_write_reg(vm, VM_REGSP, VM_STACK_START);
-  vm_write_reg(vm, VM_REGFP, VM_MEMORYSIZE);
+  vm_write_reg(vm, VM_REGSP, vm->stack_start);
+  vm_write_reg(vm, VM_REGFP, vm->memory_size);
   vm_write_reg(vm, VM_REGIP, exe->header->entry_addr);
 
-  // If the executables load table is empty
-  // we assume that there is an entry which loads
-  // the entire data segment onto address 0x00
-  if (exe->header->load_table_size == 0) {
-    if (!vm_legal_address(exe->data_size)) {
-      return vm_err_executable_too_big;
-    }
-
-    memmove(vm->memory, exe->data, exe->data_size);
-    return vm_err_regular_exit;
+  // The executable may ask for more memory than the machine has
+  if (exe->header->memory_size > vm->memory_size) {
+    return vm_err_executable_too_big;
   }
 
   // Iterate over the load table and copy each segment
   // into it's specified location
-  for (int i = 0; i < exe->header->load_table_size; i++) {
+  bool loaded = false;
+  for (size_t i = 0; i < exe->header->load_table_size; i++) {
     LoadEntry entry = exe->header->load_table[i];
 
+    // Memory size requests don't load anything
+    if (entry.offset == EXE_MEMORY_REQUEST) continue;
+
     // Check overflow in executable
-    if (entry.offset + entry.size > exe->data_size) {
+    if ((uint64_t) entry.offset + entry.size > exe->data_size && !(entry.flags & EXE_SEGMENT_ZERO)) {
       return vm_err_invalid_executable;
     }
 
     // Check overflow for machine memory
-    if (!vm_legal_address(entry.load + entry.size)) {
+    if ((uint64_t) entry.load + entry.memory_size >= vm->memory_size) {
       return vm_err_invalid_executable;
     }
 
-    // Copy the relevant bytes into the machines memory
-    memmove(vm->memory + entry.load, exe->data + entry.offset, entry.size);
+    // Zero segments aren't stored, compressed ones expand straight into memory
+    if (entry.flags & EXE_SEGMENT_ZERO) {
+      vm_clear_segment(vm, exe, i);
+    } else if (entry.flags & EXE_SEGMENT_COMPRESSED) {
+      if (!exe_decompress(vm->memory + entry.load, entry.memory_size, exe->data + entry.offset, entry.size)) {
+        return vm_err_invalid_executable;
+      }
+    } else {
+
+      // Copy the relevant bytes into the machines memory
+      vm_load_segment(vm, exe, entry.offset, entry.size, entry.load);
+    }
+
+    loaded = true;
+  }
+
+  // If the executables load table is empty
+  // we assume that there is an entry which loads
+  // the entire data segment onto address 0x00
+  if (!loaded) {
+    if (exe->data_size >= vm->memory_size) {
+      return vm_err_executable_too_big;
+    }
+
+    vm_load_segment(vm, exe, 0, exe->data_size, 0);
   }
 
   return vm_err_regular_exit;
 }
 
+/*
+ * Run vm_loop_guarded until the machine stops or faults
+ *
+ * A fault leaves the instruction pointer on the faulting instruction, the
+ * machine is stopped just like the checked loops would have, with the
+ * instruction pointer moved past it
+ * */
+static void vm_run_guarded(VM* vm) {
+  VMGuardFrame frame;
+  vm_guard_enter(&frame, vm);
+
+  if (sigsetjmp(frame.env, 1) == 0) {
+    vm_loop_guarded(vm);
+  } else {
+    uint32_t ip = REG(VM_REGIP);
+    vm->exit_code = ILLEGAL_MEMORY_ACCESS;
+    vm->running = false;
+    vm_write_reg(vm, VM_REGIP, ip + vm_instruction_length(vm, vm->memory[ip]));
+  }
+
+  vm_guard_leave(&frame);
+}
+
 /*
  * The main loop of the virtual machine
  *
@@ -102,14 +370,54 @@ VMError vm_flash(VM* vm, Executable* exe) {
 int vm_run(VM* vm, int* exit_code) {
 
   // Loop until not running anymore
-  while (vm->running) {
-    vm_cycle(vm);
+  if (vm->trace) {
+    vm_loop_trace(vm);
+  } else if (vm->profile) {
+    vm_loop_profile(vm);
+  } else if (vm->aot) {
+    vm_aot_run(vm);
+  } else if (vm->jit) {
+    vm_loop_jit(vm);
+  } else if (vm->guarded) {
+    vm_run_guarded(vm);
+  } else {
+    vm_loop(vm);
   }
 
+  vm_output_flush(vm->output);
+  vm_framebuffer_present(vm, true);
+
   *exit_code = REG(0 | VM_REGBYTE);
   return vm->exit_code;
 }
 
+/*
+ * Run the machine for roughly max_instructions instructions
+ *
+ * The budget is checked whenever a block ends, so a few more instructions
+ * might run. Returns VM_YIELDED if the machine is still running, calling
+ * vm_run_for or vm_run again resumes it. vm->budget holds what's left of
+ * the budget afterwards. Compiled blocks aren't used.
+ *
+ * If vm->park_sleep is set, the sleep syscall doesn't block the thread.
+ * The machine stops right after it and VM_SLEEPING is returned instead,
+ * it's up to the caller to wait vm->sleep_ns nanoseconds before resuming it.
+ * */
+int vm_run_for(VM* vm, uint64_t max_instructions, int* exit_code) {
+  vm->budget = max_instructions > INT64_MAX ? INT64_MAX : (int64_t) max_instructions;
+  vm->sleeping = false;
+  vm_loop_budget(vm);
+
+  *exit_code = REG(0 | VM_REGBYTE);
+  if (vm->running) {
+    return vm->sleeping ? VM_SLEEPING : VM_YIELDED;
+  }
+
+  vm_output_flush(vm->output);
+  vm_framebuffer_present(vm, true);
+  return vm->exit_code;
+}
+
 /*
  * Perform a single cpu cycle in the vm
  * Returns false if no cycle could be performed
@@ -118,7 +426,7 @@ bool vm_cycle(VM* vm) {
   uint32_t ip = REG(VM_REGIP);
 
   // Check if ip is out-of-bounds
-  if (!vm_legal_address(ip)) {
+  if (!vm_legal_address(vm, ip)) {
     vm->exit_code = ILLEGAL_MEMORY_ACCESS;
     vm->running = false;
     return false;
@@ -129,7 +437,7 @@ bool vm_cycle(VM* vm) {
   uint64_t instruction_length = vm_instruction_length(vm, instruction);
 
   // Check if there is enough memory for the instruction
-  if (!vm_legal_address(ip + instruction_length)) {
+  if ((uint64_t) ip + instruction_length >= vm->memory_size) {
     vm->exit_code = ILLEGAL_MEMORY_ACCESS;
     vm->running = false;
     return false;
@@ -193,7 +501,7 @@ uint64_t vm_instruction_length(VM* vm, opcode instruction) {
 /*
  * Return the size of a given register
  * */
-uint32_t vm_reg_size(uint8_t reg) {
+VM_INLINE uint32_t vm_reg_size(uint8_t reg) {
   switch (reg & VM_MODEMASK) {
     case VM_REGBYTE:
       return 1;
@@ -208,6 +516,31 @@ uint32_t vm_reg_size(uint8_t reg) {
   }
 }
 
+/*
+ * Returns true if size bytes can be pushed onto a stack at sp
+ *
+ * The stack may start right at the end of memory, pushes must not
+ * write below the stack limit (see VMConfig)
+ * */
+static VM_INLINE bool vm_stack_fits(VM* vm, uint32_t sp, uint64_t size) {
+  return sp >= vm->stack_limit + size && sp <= vm->memory_size;
+}
+
+/*
+ * Report a push of up to 8 bytes to vm_memory_written
+ *
+ * Stack pages rarely hold decoded instructions. Unless something else
+ * watches writes, the push is skipped if neither the page of its end nor
+ * the one of the first instruction that could overlap it is cached.
+ * */
+static VM_INLINE void vm_stack_written(VM* vm, uint32_t address, uint32_t size) {
+  uint32_t first = address < VM_INSTRUCTION_MAXLENGTH ? 0 : address - (VM_INSTRUCTION_MAXLENGTH - 1);
+  if (vm->framebuffer || vm->trace || vm->verified || vm->aot || vm->code_pages[first >> VM_CODEPAGE_SHIFT] ||
+      vm->code_pages[(address + size - 1) >> VM_CODEPAGE_SHIFT]) {
+    vm_memory_written(vm, address, size);
+  }
+}
+
 /*
  * Writes a block of memory from the machine's own memory onto the stack
  * Address and size argument index into the machine's memory
@@ -215,47 +548,75 @@ uint32_t vm_reg_size(uint8_t reg) {
 void vm_stack_write(VM* vm, uint32_t address, uint32_t size) {
   uint32_t sp = REG(VM_REGSP);
 
-  // Check for a stack underflow
-  if (sp < size || address + size - 1 >= VM_MEMORYSIZE) {
+  // Check for a stack overflow and the source range
+  if (!vm_stack_fits(vm, sp, size) || address + size - 1 >= vm->memory_size) {
     vm->exit_code = ILLEGAL_MEMORY_ACCESS;
     vm->running = false;
     return;
   }
 
   memmove(vm->memory + sp - size, vm->memory + address, size);
+  vm_memory_written(vm, sp - size, size);
   vm_write_reg(vm, VM_REGSP, sp - size);
 }
 
 /*
  * Write an arbitrary block of memory onto the stack
  * Address and size arguments index into global address space
+ *
+ * Blocks of 1, 2, 4 and 8 bytes are copied with a single load and store,
+ * which turns into a plain move once the size is a constant
  * */
-void vm_stack_write_block(VM* vm, void* block, size_t size) {
+VM_INLINE void vm_stack_write_block(VM* vm, void* block, size_t size) {
   uint32_t sp = REG(VM_REGSP);
 
-  // Check for a stack underflow
-  if (sp < size || !vm_legal_address(sp + size - 1)) {
+  // Check for a stack overflow
+  if (!vm_stack_fits(vm, sp, size)) {
     vm->exit_code = ILLEGAL_MEMORY_ACCESS;
     vm->running = false;
     return;
   }
 
-  memmove(vm->memory + sp - size, block, size);
-  vm_write_reg(vm, VM_REGSP, sp - size);
+  uint32_t address = sp - size;
+  switch (size) {
+    case 1:
+      *(uint8_t *)(vm->memory + address) = *(uint8_t *) block;
+      vm_stack_written(vm, address, 1);
+      break;
+    case 2:
+      *(uint16_t *)(vm->memory + address) = *(uint16_t *) block;
+      vm_stack_written(vm, address, 2);
+      break;
+    case 4:
+      *(uint32_t *)(vm->memory + address) = *(uint32_t *) block;
+      vm_stack_written(vm, address, 4);
+      break;
+    case 8:
+      *(uint64_t *)(vm->memory + address) = *(uint64_t *) block;
+      vm_stack_written(vm, address, 8);
+      break;
+    default:
+      memmove(vm->memory + address, block, size);
+      vm_memory_written(vm, address, size);
+      break;
+  }
+
+  vm_write_reg(vm, VM_REGSP, address);
 }
 
 /*
  * Pop some bytes off the stack and return a pointer
  * to the bytes which were just popped off
+ * Returns NULL and stops the machine if they aren't inside memory
  * */
-void* vm_stack_pop(VM* vm, uint32_t size) {
+VM_INLINE void* vm_stack_pop(VM* vm, uint32_t size) {
   uint32_t sp = REG(VM_REGSP);
 
-  // Check for a stack underflow
-  if (sp >= VM_MEMORYSIZE || sp < size) {
+  // Check for a stack underflow, the popped bytes have to be inside memory
+  if ((uint64_t) sp + size > vm->memory_size || sp < size) {
     vm->exit_code = ILLEGAL_MEMORY_ACCESS;
     vm->running = false;
-    return 0;
+    return NULL;
   }
 
   vm_write_reg(vm, VM_REGSP, sp + size);
@@ -265,7 +626,7 @@ void* vm_stack_pop(VM* vm, uint32_t size) {
 /*
  * Write a value into a register
  * */
-void vm_write_reg(VM* vm, uint8_t reg, uint64_t value) {
+VM_INLINE void vm_write_reg(VM* vm, uint8_t reg, uint64_t value) {
   switch (vm_reg_size(reg)) {
     case 1:
       *((uint8_t *) (vm->regs + (reg & VM_CODEMASK))) = (uint8_t) value;
@@ -288,7 +649,7 @@ void vm_write_reg(VM* vm, uint8_t reg, uint64_t value) {
  * Moves a block of memory into a register
  * */
 void vm_move_mem_to_reg(VM* vm, uint8_t reg, uint32_t address, uint32_t size) {
-  if (VM_MEMORYSIZE - size < address) {
+  if (vm->memory_size - size < address) {
     vm->exit_code = ILLEGAL_MEMORY_ACCESS;
     vm->running = false;
     return;
@@ -312,729 +673,331 @@ void vm_move_mem_to_reg(VM* vm, uint8_t reg, uint32_t address, uint32_t size) {
 
 /*
  * Read the value of a register
+ *
+ * The whole 64-bit register is returned, no matter which width the mode bits
+ * select. Programs rely on this, so callers which only want the low bytes
+ * have to truncate the value themselves.
  * */
-uint64_t vm_read_reg(VM* vm, uint8_t reg) {
-  switch (vm_reg_size(reg)) {
-    case 1:
-      return *(uint64_t *)(uint8_t *) (vm->regs + (reg & VM_CODEMASK));
-    case 2:
-      return *(uint64_t *)(uint16_t *) (vm->regs + (reg & VM_CODEMASK));
-    case 4:
-      return *(uint64_t *)(uint32_t *) (vm->regs + (reg & VM_CODEMASK));
-    case 8:
-      return vm->regs[reg & VM_CODEMASK];
-    default:
-      return 0; // can't happen
-  }
+VM_INLINE uint64_t vm_read_reg(VM* vm, uint8_t reg) {
+  return vm->regs[reg & VM_CODEMASK];
 }
 
 /*
  * Pushes a stack frame onto the stack and updates the required
  * special purpose registers
+ *
+ * The frame holds the old frame pointer followed by the return address,
+ * both are checked and written at once. Nothing is written if the frame
+ * doesn't fit.
  * */
-void vm_push_stack_frame(VM* vm, uint32_t return_address) {
-  uint32_t fp = REG(VM_REGFP);
-  uint32_t stack_frame_baseadr = REG(VM_REGSP) - 8;
-  vm_stack_write_block(vm, &return_address, 4);
-  vm_stack_write_block(vm, &fp, 4);
+static VM_INLINE void vm_push_stack_frame(VM* vm, uint32_t return_address) {
+  uint32_t sp = REG(VM_REGSP);
+
+  if (!vm_stack_fits(vm, sp, 8)) {
+    vm->exit_code = ILLEGAL_MEMORY_ACCESS;
+    vm->running = false;
+    return;
+  }
+
+  uint32_t stack_frame_baseadr = sp - 8;
+  *(uint32_t *)(vm->memory + stack_frame_baseadr) = REG(VM_REGFP);
+  *(uint32_t *)(vm->memory + stack_frame_baseadr + 4) = return_address;
+  vm_stack_written(vm, stack_frame_baseadr, 8);
+  vm_write_reg(vm, VM_REGSP, stack_frame_baseadr);
   vm_write_reg(vm, VM_REGFP, stack_frame_baseadr);
 }
 
 /*
  * Returns true if address is legal
  * */
-bool vm_legal_address(uint32_t address) {
-  return address < VM_MEMORYSIZE;
+VM_INLINE bool vm_legal_address(VM* vm, uint32_t address) {
+  return address < vm->memory_size;
 }
 
 /*
  * Return true if the zero bit of the flags register is set
  * */
-bool vm_is_zero_bit_set(VM* vm) {
+static VM_INLINE bool vm_is_zero_bit_set(VM* vm) {
   return (REG(VM_REGFLAGS) & VM_FLAG_ZERO) == 1;
 }
 
 /*
  * Set the zero bit of the vm to a specific value
  * */
-void vm_set_zero_bit(VM* vm, bool value) {
+static VM_INLINE void vm_set_zero_bit(VM* vm, bool value) {
   uint64_t flags = REG(VM_REGFLAGS);
   flags ^= (-value ^ flags) & 1;
   vm_write_reg(vm, VM_REGFLAGS, flags);
 }
 
 /*
- * Execute an instruction
+ * Current CLOCK_MONOTONIC time in nanoseconds
  * */
-void vm_execute(VM* vm, opcode instruction, uint32_t ip) {
-  switch (instruction) {
-    case op_rpush: {
-
-      uint8_t reg = vm->memory[ip + 1];
-      uint32_t size = vm_reg_size(reg);
-      void* ptr = vm->regs + (reg & VM_CODEMASK);
-      vm_stack_write_block(vm, ptr, size);
-
-      break;
-    }
-
-    case op_rpop: {
-
-      uint8_t reg = vm->memory[ip + 1];
-      uint32_t size = vm_reg_size(reg);
-      uint8_t* data = vm_stack_pop(vm, size);
-      uint32_t address = data - vm->memory;
-      vm_move_mem_to_reg(vm, reg, address, size);
-
-      break;
-    }
-
-    case op_mov: {
-
-      uint8_t target = vm->memory[ip + 1];
-      uint8_t source = vm->memory[ip + 2];
-      uint64_t value = REG(source);
-      vm_write_reg(vm, target, value);
-
-      break;
-    }
-
-    case op_loadi: {
-
-      uint8_t reg = vm->memory[ip + 1];
-      vm_move_mem_to_reg(vm, reg, ip + 2, vm_reg_size(reg));
-
-      break;
-    }
-
-    case op_rst: {
-
-      uint8_t reg = vm->memory[ip + 1];
-      vm_write_reg(vm, reg, 0);
-
-      break;
-    }
-
-    case op_add:
-    case op_sub:
-    case op_mul:
-    case op_div:
-    case op_idiv:
-    case op_rem:
-    case op_irem: {
-      uint8_t target = vm->memory[ip + 1];
-      uint8_t source = vm->memory[ip + 2];
-      uint64_t result;
-
-      switch (instruction) {
-        case op_add:
-          result = REG(target) + REG(source);
-          break;
-        case op_sub:
-          result = REG(target) - REG(source);
-          break;
-        case op_mul:
-          result = REG(target) * REG(source);
-          break;
-        case op_div:
-          result = REG(target) / REG(source);
-          break;
-        case op_idiv:
-          result = (int64_t)REG(target) / (int64_t)REG(source);
-          break;
-        case op_rem:
-          result = REG(target) % REG(source);
-          break;
-        case op_irem:
-          result = (int64_t)REG(target) % (int64_t)REG(source);
-          break;
-        default:
-          result = 0; // can't happen
-          break;
-      }
-
-      vm_set_zero_bit(vm, result == 0);
-      vm_write_reg(vm, target, result);
-      break;
-    }
-
-    case op_fadd:
-    case op_fsub:
-    case op_fmul:
-    case op_fdiv:
-    case op_frem:
-    case op_fexp: {
-      uint8_t target_reg = vm->memory[ip + 1];
-      uint8_t source_reg = vm->memory[ip + 2];
-
-      uint64_t target_uncasted_value = REG(target_reg);
-      uint64_t source_uncasted_value = REG(source_reg);
-
-      double target = *(double *)(&target_uncasted_value);
-      double source = *(double *)(&source_uncasted_value);
-
-      double result;
-
-      switch (instruction) {
-        case op_fadd:
-          result = target + source;
-          break;
-        case op_fsub:
-          result = target - source;
-          break;
-        case op_fmul:
-          result = target * source;
-          break;
-        case op_fdiv:
-          result = target / source;
-          break;
-        case op_frem:
-          result = fmod(target, source);
-          break;
-        case op_fexp:
-          result = pow(target, source);
-          break;
-        default:
-          result = 0; // can't happen
-          break;
-      }
-
-      vm_set_zero_bit(vm, result == (double)0);
-      vm_write_reg(vm, target_reg, result);
-      break;
-    }
-
-    case op_flt:
-    case op_fgt:
-    case op_cmp:
-    case op_lt:
-    case op_gt:
-    case op_ult:
-    case op_ugt: {
-
-      uint8_t left = vm->memory[ip + 1];
-      uint8_t right = vm->memory[ip + 2];
-
-      uint64_t left_uncasted_value = REG(left);
-      uint64_t right_uncasted_value = REG(right);
-
-      double left_f = *(double *)(&left_uncasted_value);
-      double right_f = *(double *)(&right_uncasted_value);
-      uint64_t left_ui = *(uint64_t *)(&left_uncasted_value);
-      uint64_t right_ui = *(uint64_t *)(&right_uncasted_value);
-      int64_t left_i = *(int64_t *)(&left_uncasted_value);
-      int64_t right_i = *(int64_t *)(&right_uncasted_value);
-
-      switch (instruction) {
-        case op_flt:
-          vm_set_zero_bit(vm, left_f < right_f);
-          break;
-        case op_fgt:
-          vm_set_zero_bit(vm, left_f > right_f);
-          break;
-        case op_cmp:
-          vm_set_zero_bit(vm, left_ui == right_ui);
-          break;
-        case op_lt:
-          vm_set_zero_bit(vm, left_i < right_i);
-          break;
-        case op_gt:
-          vm_set_zero_bit(vm, left_i > right_i);
-          break;
-        case op_ult:
-          vm_set_zero_bit(vm, left_ui < right_ui);
-          break;
-        case op_ugt:
-          vm_set_zero_bit(vm, left_ui > right_ui);
-          break;
-        default:
-          break; // can't happen
-      }
-
-      break;
-    }
-
-    case op_shr:
-    case op_shl:
-    case op_and:
-    case op_xor:
-    case op_or: {
-
-      uint8_t left_reg = vm->memory[ip + 1];
-      uint8_t right_reg = vm->memory[ip + 2];
-
-      uint64_t left = REG(left_reg);
-      uint64_t right = REG(right_reg);
-
-      uint64_t result;
-
-      switch (instruction) {
-        case op_shr:
-          result = left << right;
-          break;
-        case op_shl:
-          result = left >> right;
-          break;
-        case op_and:
-          result = left & right;
-          break;
-        case op_xor:
-          result = left ^ right;
-          break;
-        case op_or:
-          result = left | right;
-          break;
-        default:
-          break; // can't happen
-      }
-
-      vm_set_zero_bit(vm, result == 0);
-      break;
-    }
-
-    case op_not: {
-
-      uint8_t reg = vm->memory[ip + 1];
-      uint64_t value = REG(reg);
-      value = ~value;
-      vm_set_zero_bit(vm, value == 0);
-      vm_write_reg(vm, reg, value);
-      break;
-    }
-
-    case op_inttofp: {
-
-      uint8_t source = vm->memory[ip + 1];
-      double value = (double)REG(source);
-      vm_write_reg(vm, source, *(uint64_t *)(&value));
-
-      break;
-    }
-
-    case op_sinttofp: {
-
-      uint8_t source = vm->memory[ip + 1];
-      double value = (double)(int64_t)REG(source);
-      vm_write_reg(vm, source, *(uint64_t *)(&value));
-
-      break;
-    }
-
-    case op_fptoint: {
-
-      uint8_t source = vm->memory[ip + 1];
-      uint64_t reg_content = REG(source);
-      double value = *(double *)(&reg_content);
-      vm_write_reg(vm, source, (int64_t)value);
-
-      break;
-    }
-
-    case op_load: {
-
-      uint8_t reg = vm->memory[ip + 1];
-      int32_t offset = *(int32_t *)(vm->memory + ip + 2);
-      uint32_t fp = REG(VM_REGFP);
-      vm_move_mem_to_reg(vm, reg, fp + offset, vm_reg_size(reg));
-
-      break;
-    }
-
-    case op_loadr: {
-
-      uint8_t reg = vm->memory[ip + 1];
-      uint8_t offset_reg = *(uint8_t *)(vm->memory + ip + 2);
-      int32_t offset = (int32_t)REG(offset_reg);
-      uint32_t fp = REG(VM_REGFP);
-      vm_move_mem_to_reg(vm, reg, fp + offset, vm_reg_size(reg));
-
-      break;
-    }
-
-    case op_loads: {
-
-      uint32_t size = *(uint32_t *)(vm->memory + ip + 1);
-      int32_t offset = *(int32_t *)(vm->memory + ip + 5);
-      uint32_t fp = REG(VM_REGFP);
-      vm_stack_write_block(vm, (vm->memory + fp + offset), size);
-
-      break;
-    }
-
-    case op_loadsr: {
-
-      uint32_t size = *(uint32_t *)(vm->memory + ip + 1);
-      uint8_t offset_reg = *(uint8_t *)(vm->memory + ip + 2);
-      int32_t offset = (int32_t)REG(offset_reg);
-      uint32_t fp = REG(VM_REGFP);
-      vm_stack_write_block(vm, (vm->memory + fp + offset), size);
-
-      break;
-    }
-
-    case op_store: {
-
-      int32_t offset = *(int32_t *)(vm->memory + ip + 1);
-      uint8_t reg = vm->memory[ip + 5];
-      uint32_t fp = REG(VM_REGFP);
-      uint64_t value = REG(reg);
-
-      switch (vm_reg_size(reg)) {
-        case 1:
-          *((uint8_t *) (vm->memory + fp + offset)) = value;
-          break;
-        case 2:
-          *((uint16_t *) (vm->memory + fp + offset)) = value;
-          break;
-        case 4:
-          *((uint32_t *) (vm->memory + fp + offset)) = value;
-          break;
-        case 8:
-          *((uint64_t *) (vm->memory + fp + offset)) = value;
-          break;
-        default:
-          break; // Can't happen
-      }
-
-      break;
-    }
-
-    case op_push: {
-
-      uint32_t size = *(uint32_t *)(vm->memory + ip + 1);
-      void* data = (void* )(vm->memory + ip + 5);
-      vm_stack_write_block(vm, data, size);
-
-      break;
-    }
-
-    case op_read: {
-
-      uint8_t target = vm->memory[ip + 1];
-      uint8_t source = vm->memory[ip + 2];
-
-      uint32_t address = REG(source);
-      uint32_t size = vm_reg_size(target);
-
-      if (!vm_legal_address(address) || !vm_legal_address(address + size)) {
-        vm->exit_code = ILLEGAL_MEMORY_ACCESS;
-        vm->running = false;
-        return;
-      }
-
-      vm_move_mem_to_reg(vm, target, address, size);
-      break;
-    }
-
-    case op_readc: {
-
-      uint8_t target = vm->memory[ip + 1];
-      uint32_t address = *(uint32_t *)(vm->memory + ip + 2);
-      uint32_t size = vm_reg_size(target);
-
-      if (!vm_legal_address(address) || !vm_legal_address(address + size)) {
-        vm->exit_code = ILLEGAL_MEMORY_ACCESS;
-        vm->running = false;
-        return;
-      }
-
-      vm_move_mem_to_reg(vm, target, address, size);
-      break;
-    }
-
-    case op_reads: {
-
-      uint32_t size = *(uint32_t *)(vm->memory + ip + 1);
-      uint8_t source = *(uint8_t *)(vm->memory + ip + 5);
-      uint32_t address = REG(source);
-
-      if (!vm_legal_address(address) || !vm_legal_address(address + size)) {
-        vm->exit_code = ILLEGAL_MEMORY_ACCESS;
-        vm->running = false;
-        return;
-      }
-
-      vm_stack_write_block(vm, vm->memory + address, size);
-      break;
-    }
-
-    case op_readcs: {
-
-      uint32_t size = *(uint32_t *)(vm->memory + ip + 1);
-      uint32_t address = *(uint32_t *)(vm->memory + ip + 5);
-
-      if (!vm_legal_address(address) || !vm_legal_address(address + size)) {
-        vm->exit_code = ILLEGAL_MEMORY_ACCESS;
-        vm->running = false;
-        return;
-      }
-
-      vm_stack_write_block(vm, vm->memory + address, size);
-      break;
-    }
-
-    case op_write: {
-
-      uint8_t target = vm->memory[ip + 1];
-      uint8_t source = vm->memory[ip + 2];
-
-      uint32_t address = REG(target);
-      uint32_t size = vm_reg_size(source);
-
-      if (!vm_legal_address(address) || !vm_legal_address(address + size)) {
-        vm->exit_code = ILLEGAL_MEMORY_ACCESS;
-        vm->running = false;
-        return;
-      }
-
-      memmove(vm->memory + address, vm->regs + source, size);
-      break;
-    }
-
-    case op_writec: {
-
-      uint32_t address = *(uint32_t *)(vm->memory + ip + 1);
-      uint8_t source = vm->memory[ip + 5];
-      uint32_t size = vm_reg_size(source);
-
-      if (!vm_legal_address(address) || !vm_legal_address(address + size)) {
-        vm->exit_code = ILLEGAL_MEMORY_ACCESS;
-        vm->running = false;
-        return;
-      }
-
-      memmove(vm->memory + address, vm->regs + source, size);
-      break;
-    }
-
-    case op_writes: {
-
-      uint8_t target = vm->memory[ip + 1];
-      uint32_t size = *(uint32_t *)(vm->memory + ip + 2);
-      uint32_t address = REG(target);
-
-      if (!vm_legal_address(address) || !vm_legal_address(address + size)) {
-        vm->exit_code = ILLEGAL_MEMORY_ACCESS;
-        vm->running = false;
-        return;
-      }
-
-      void* data = vm_stack_pop(vm, size);
-      memmove(vm->memory + address, data, size);
-
-      break;
-    }
-
-    case op_writecs: {
-
-      uint32_t address = *(uint32_t *)(vm->memory + ip + 1);
-      uint32_t size = *(uint32_t *)(vm->memory + ip + 5);
-
-      if (!vm_legal_address(address) || !vm_legal_address(address + size)) {
-        vm->exit_code = ILLEGAL_MEMORY_ACCESS;
-        vm->running = false;
-        return;
-      }
+uint64_t vm_now_ns(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (uint64_t) time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
 
-      void* data = vm_stack_pop(vm, size);
-      memmove(vm->memory + address, data, size);
+/*
+ * Convert the duration of a sleep syscall into nanoseconds
+ *
+ * Negative and invalid durations don't sleep at all,
+ * absurdly long ones are cut off at about 30 years
+ * */
+static uint64_t vm_sleep_duration(double duration) {
+  if (!(duration > 0)) return 0;
+  if (duration > 1e9) return 1000000000ULL * 1000000000ULL;
+  return (uint64_t)(duration * 1e9);
+}
 
+/*
+ * Perform the syscall whose id is on top of the stack
+ *
+ * If park is set, a sleep only marks the machine as sleeping,
+ * the loop has to stop and hand it back to the caller
+ * */
+static void vm_syscall(VM* vm, bool park) {
+
+  // vm_stack_pop stops the machine if the arguments aren't on the stack
+  uint16_t* id = vm_stack_pop(vm, 2);
+  if (id == NULL) return;
+
+  switch (*id) {
+    case VM_SYS_EXIT: {
+      uint8_t* exit_code = vm_stack_pop(vm, 1);
+      if (exit_code == NULL) break;
+      vm_write_reg(vm, 0 | VM_REGBYTE, *exit_code);
+      vm->exit_code = REGULAR_EXIT;
+      vm->running = false;
+      vm_output_flush(vm->output);
       break;
     }
 
-    case op_copy: {
-
-      uint8_t target = REG(vm->memory[ip + 1]);
-      uint32_t size = *(uint32_t *)(vm->memory + ip + 2);
-      uint8_t source = REG(vm->memory[ip + 6]);
-
-      if (!vm_legal_address(target) || !vm_legal_address(target + size)) {
-        vm->exit_code = ILLEGAL_MEMORY_ACCESS;
-        vm->running = false;
-        return;
+    case VM_SYS_SLEEP: {
+      double* argument = vm_stack_pop(vm, 8);
+      if (argument == NULL) break;
+      double duration = *argument;
+      vm_output_flush(vm->output);
+      vm_framebuffer_present(vm, false);
+
+      if (park) {
+        vm->sleep_ns = vm_sleep_duration(duration);
+        vm->sleeping = true;
+        break;
       }
 
-      if (!vm_legal_address(source) || !vm_legal_address(source + size)) {
-        vm->exit_code = ILLEGAL_MEMORY_ACCESS;
-        vm->running = false;
-        return;
-      }
-
-      memmove(vm->memory + target, vm->memory + source, size);
-
+      usleep((unsigned int)(1000 * 1000 * duration));
       break;
     }
 
-    case op_copyc: {
-
-      uint32_t target = *(uint32_t *)(vm->memory + ip + 1);
-      uint32_t size = *(uint32_t *)(vm->memory + ip + 5);
-      uint32_t source = *(uint32_t *)(vm->memory + ip + 9);
+    case VM_SYS_WRITE: {
+      uint32_t* size_argument = vm_stack_pop(vm, 4);
+      if (size_argument == NULL) break;
+      uint32_t size = *size_argument;
+      uint32_t* address_argument = vm_stack_pop(vm, 4);
+      if (address_argument == NULL) break;
+      uint32_t address = *address_argument;
 
-      if (!vm_legal_address(target) || !vm_legal_address(target + size)) {
+      // Check if this is a legal address, the end is computed in 64 bits so it can't wrap
+      if (!vm_legal_address(vm, address) || (uint64_t) address + size > vm->memory_size) {
         vm->exit_code = ILLEGAL_MEMORY_ACCESS;
         vm->running = false;
-        return;
+        break;
       }
 
-      if (!vm_legal_address(source) || !vm_legal_address(source + size)) {
-        vm->exit_code = ILLEGAL_MEMORY_ACCESS;
-        vm->running = false;
-        return;
-      }
-
-      memmove(vm->memory + target, vm->memory + source, size);
-
+      vm_output_write(vm->output, vm->memory + address, size);
       break;
     }
 
-    case op_jz: {
-
-      uint32_t address = *(uint32_t *)(vm->memory + ip + 1);
-      if (vm_is_zero_bit_set(vm)) {
-        vm_write_reg(vm, VM_REGIP, address);
-      }
+    case VM_SYS_PUTS: {
+      uint8_t* reg = vm_stack_pop(vm, 1);
+      if (reg == NULL) break;
+      int64_t value = REG(*reg);
 
+      vm_output_integer(vm->output, value);
       break;
     }
 
-    case op_jzr: {
-
-      uint8_t reg = vm->memory[ip + 1];
-      uint32_t address = REG(reg);
-      if (vm_is_zero_bit_set(vm)) {
-        vm_write_reg(vm, VM_REGIP, address);
-      }
-
+    case VM_SYS_FLUSH: {
+      vm_output_flush(vm->output);
       break;
     }
 
-    case op_jmp: {
-
-      uint32_t address = *(uint32_t *)(vm->memory + ip + 1);
-      vm_write_reg(vm, VM_REGIP, address);
-
-      break;
-    }
-
-    case op_jmpr: {
-
-      uint8_t reg = vm->memory[ip + 1];
-      uint32_t address = REG(reg);
-      vm_write_reg(vm, VM_REGIP, address);
-
-      break;
-    }
-
-    case op_call: {
-
-      uint32_t address = *(uint32_t *)(vm->memory + ip + 1);
-      vm_push_stack_frame(vm, ip + 5);
-      vm_write_reg(vm, VM_REGIP, address);
-
-      break;
-    }
-
-    case op_callr: {
-
-      uint8_t reg = vm->memory[ip + 1];
-      uint32_t address = REG(reg);
-      vm_push_stack_frame(vm, ip + 2);
-      vm_write_reg(vm, VM_REGIP, address);
-
+    default: {
+      vm->exit_code = INVALID_SYSCALL;
+      vm->running = false;
       break;
     }
+  }
+}
 
-    case op_ret: {
-
-      uint32_t stack_frame_baseadr = REG(VM_REGFP);
-
-      // Check out-of-bounds
-      if (!vm_legal_address(stack_frame_baseadr + 12)) {
-        vm->exit_code = ILLEGAL_MEMORY_ACCESS;
-        vm->running = false;
-        return;
-      }
-
-      // Read the current stackframe
-      uint32_t fp = *(uint32_t *)(vm->memory + stack_frame_baseadr);
-      uint32_t ra = *(uint32_t *)(vm->memory + stack_frame_baseadr + 4);
-      uint32_t ac = *(uint32_t *)(vm->memory + stack_frame_baseadr + 8);
-      uint32_t sp = stack_frame_baseadr + 12 + ac;
-
-      // Check if the new stack pointer is out of bounds
-      if (!vm_legal_address(sp)) {
-        vm->exit_code = ILLEGAL_MEMORY_ACCESS;
-        vm->running = false;
-        return;
-      }
-
-      vm_write_reg(vm, VM_REGSP, sp);
-      vm_write_reg(vm, VM_REGFP, fp);
-      vm_write_reg(vm, VM_REGIP, ra);
+/*
+ * Same as vm_syscall, also records how long the syscall took
+ * */
+static void vm_syscall_profiled(VM* vm) {
+  uint32_t sp = REG(VM_REGSP);
+  uint16_t id = sp <= vm->memory_size - 2 ? *(uint16_t *)(vm->memory + sp) : VM_PROFILE_SYSCALLS;
 
-      break;
-    }
+  uint64_t start = vm_profile_clock();
+  vm_syscall(vm, false);
 
-    case op_nop: { break; }
-
-    case op_syscall: {
-
-      uint16_t id = *(uint16_t *)vm_stack_pop(vm, 2);
-
-      switch (id) {
-        case VM_SYS_EXIT: {
-          uint8_t exit_code = *(uint8_t *)vm_stack_pop(vm, 1);
-          vm_write_reg(vm, 0 | VM_REGBYTE, exit_code);
-          vm->exit_code = REGULAR_EXIT;
-          vm->running = false;
-          break;
-        }
-
-        case VM_SYS_SLEEP: {
-          double duration = *(double *)vm_stack_pop(vm, 8);
-          usleep((unsigned int)(1000 * 1000 * duration));
-          break;
-        }
-
-        case VM_SYS_WRITE: {
-          uint32_t size = *(uint32_t *)vm_stack_pop(vm, 4);
-          uint32_t address = *(uint32_t *)vm_stack_pop(vm, 4);
-
-          // Check if this is a legal address
-          if (!vm_legal_address(address) || !vm_legal_address(address + size - 1)) {
-            vm->exit_code = ILLEGAL_MEMORY_ACCESS;
-            vm->running = false;
-            break;
-          }
-
-          fwrite(vm->memory + address, size, 1, stdout);
-          break;
-        }
-
-        case VM_SYS_PUTS: {
-          uint8_t reg = *(uint8_t *)vm_stack_pop(vm, 1);
-          int64_t value = REG(reg);
-
-          fprintf(stdout, "%lld", value);
-          break;
-        }
-
-        default: {
-          vm->exit_code = INVALID_SYSCALL;
-          vm->running = false;
-          break;
-        }
-      }
+  if (id < VM_PROFILE_SYSCALLS) {
+    vm->profile->syscall_counts[id]++;
+    vm->profile->syscall_ticks[id] += vm_profile_clock() - start;
+  }
+}
 
-      break;
-    }
+// Decide which dispatch technique the main loop uses
+//
+// Computed goto is a GNU extension, compilers which don't support it
+// fall back to a regular switch statement
+#ifndef VM_USE_COMPUTED_GOTO
+#if defined(__GNUC__) || defined(__clang__)
+#define VM_USE_COMPUTED_GOTO 1
+#else
+#define VM_USE_COMPUTED_GOTO 0
+#endif
+#endif
+
+// Single-step interpreter used by vm_execute
+#define VM_LOOP_NAME vm_step
+#define VM_LOOP_SINGLE_STEP 1
+#define VM_LOOP_THREADED 0
+#define VM_LOOP_JIT 0
+#define VM_LOOP_PROFILE 0
+#define VM_LOOP_BUDGET 0
+#define VM_LOOP_GUARDED 0
+#define VM_LOOP_TRACE 0
+#include "vm_loop.h"
+#undef VM_LOOP_NAME
+#undef VM_LOOP_SINGLE_STEP
+#undef VM_LOOP_THREADED
+#undef VM_LOOP_JIT
+#undef VM_LOOP_PROFILE
+#undef VM_LOOP_BUDGET
+#undef VM_LOOP_GUARDED
+#undef VM_LOOP_TRACE
+
+// Main interpreter loop used by vm_run
+#define VM_LOOP_NAME vm_loop
+#define VM_LOOP_SINGLE_STEP 0
+#define VM_LOOP_THREADED VM_USE_COMPUTED_GOTO
+#define VM_LOOP_JIT 0
+#define VM_LOOP_PROFILE 0
+#define VM_LOOP_BUDGET 0
+#define VM_LOOP_GUARDED 0
+#define VM_LOOP_TRACE 0
+#include "vm_loop.h"
+#undef VM_LOOP_NAME
+#undef VM_LOOP_SINGLE_STEP
+#undef VM_LOOP_THREADED
+#undef VM_LOOP_JIT
+#undef VM_LOOP_PROFILE
+#undef VM_LOOP_BUDGET
+#undef VM_LOOP_GUARDED
+#undef VM_LOOP_TRACE
+
+// Main interpreter loop used by vm_run if the JIT is enabled
+#define VM_LOOP_NAME vm_loop_jit
+#define VM_LOOP_SINGLE_STEP 0
+#define VM_LOOP_THREADED VM_USE_COMPUTED_GOTO
+#define VM_LOOP_JIT 1
+#define VM_LOOP_PROFILE 0
+#define VM_LOOP_BUDGET 0
+#define VM_LOOP_GUARDED 0
+#define VM_LOOP_TRACE 0
+#include "vm_loop.h"
+#undef VM_LOOP_NAME
+#undef VM_LOOP_SINGLE_STEP
+#undef VM_LOOP_THREADED
+#undef VM_LOOP_JIT
+#undef VM_LOOP_PROFILE
+#undef VM_LOOP_BUDGET
+#undef VM_LOOP_GUARDED
+#undef VM_LOOP_TRACE
+
+// Main interpreter loop used by vm_run while profiling
+#define VM_LOOP_NAME vm_loop_profile
+#define VM_LOOP_SINGLE_STEP 0
+#define VM_LOOP_THREADED VM_USE_COMPUTED_GOTO
+#define VM_LOOP_JIT 0
+#define VM_LOOP_PROFILE 1
+#define VM_LOOP_BUDGET 0
+#define VM_LOOP_GUARDED 0
+#define VM_LOOP_TRACE 0
+#include "vm_loop.h"
+#undef VM_LOOP_NAME
+#undef VM_LOOP_SINGLE_STEP
+#undef VM_LOOP_THREADED
+#undef VM_LOOP_JIT
+#undef VM_LOOP_PROFILE
+#undef VM_LOOP_BUDGET
+#undef VM_LOOP_GUARDED
+#undef VM_LOOP_TRACE
+
+// Interpreter loop used by vm_run_for
+#define VM_LOOP_NAME vm_loop_budget
+#define VM_LOOP_SINGLE_STEP 0
+#define VM_LOOP_THREADED VM_USE_COMPUTED_GOTO
+#define VM_LOOP_JIT 0
+#define VM_LOOP_PROFILE 0
+#define VM_LOOP_BUDGET 1
+#define VM_LOOP_GUARDED 0
+#define VM_LOOP_TRACE 0
+#include "vm_loop.h"
+#undef VM_LOOP_NAME
+#undef VM_LOOP_SINGLE_STEP
+#undef VM_LOOP_THREADED
+#undef VM_LOOP_JIT
+#undef VM_LOOP_PROFILE
+#undef VM_LOOP_BUDGET
+#undef VM_LOOP_GUARDED
+#undef VM_LOOP_TRACE
+
+// Interpreter loop used by vm_run if the memory is followed by guard pages
+#define VM_LOOP_NAME vm_loop_guarded
+#define VM_LOOP_SINGLE_STEP 0
+#define VM_LOOP_THREADED VM_USE_COMPUTED_GOTO
+#define VM_LOOP_JIT 0
+#define VM_LOOP_PROFILE 0
+#define VM_LOOP_BUDGET 0
+#define VM_LOOP_GUARDED 1
+#define VM_LOOP_TRACE 0
+#include "vm_loop.h"
+#undef VM_LOOP_NAME
+#undef VM_LOOP_SINGLE_STEP
+#undef VM_LOOP_THREADED
+#undef VM_LOOP_JIT
+#undef VM_LOOP_PROFILE
+#undef VM_LOOP_BUDGET
+#undef VM_LOOP_GUARDED
+#undef VM_LOOP_TRACE
+
+// Interpreter loop used by vm_run while recording a trace
+#define VM_LOOP_NAME vm_loop_trace
+#define VM_LOOP_SINGLE_STEP 0
+#define VM_LOOP_THREADED VM_USE_COMPUTED_GOTO
+#define VM_LOOP_JIT 0
+#define VM_LOOP_PROFILE 0
+#define VM_LOOP_BUDGET 0
+#define VM_LOOP_GUARDED 0
+#define VM_LOOP_TRACE 1
+#include "vm_loop.h"
+#undef VM_LOOP_NAME
+#undef VM_LOOP_SINGLE_STEP
+#undef VM_LOOP_THREADED
+#undef VM_LOOP_JIT
+#undef VM_LOOP_PROFILE
+#undef VM_LOOP_BUDGET
+#undef VM_LOOP_GUARDED
+#undef VM_LOOP_TRACE
 
-    default:
-      vm->exit_code = INVALID_INSTRUCTION;
-      vm->running = false;
-      break;
-  }
+/*
+ * Execute an instruction
+ * */
+void vm_execute(VM* vm, opcode instruction, uint32_t ip) {
+  vm_step(vm, instruction, ip);
 }
 
 /*
@@ -1060,6 +1023,18 @@ char* vm_err(VMError errcode) {
       return "Allocation failure";
     case vm_err_internal_failure:
       return "Internal failure";
+    case vm_err_jit_unavailable:
+      return "JIT not available";
+    case vm_err_invalid_trace:
+      return "Invalid trace";
+    case vm_err_invalid_config:
+      return "Invalid configuration";
+    case vm_err_overlapping_code:
+      return "Overlapping instructions";
+    case vm_err_compile_failed:
+      return "Compiler failed";
+    case vm_err_invalid_module:
+      return "Invalid native module";
     default:
       return "Unknown error";
   }
@@ -1068,7 +1043,7 @@ char* vm_err(VMError errcode) {
 /*
  * Define the instruction lengths for all opcodes
  * */
-uint64_t opcode_length_lookup_table[59] = {
+const uint64_t opcode_length_lookup_table[op_num_types] = {
   2, // rpush
   2, // rpop
   3, // mov
@@ -1138,4 +1113,8 @@ uint64_t opcode_length_lookup_table[59] = {
 
   1, // nop
   1, // syscall
+
+  4, // fill
+  4, // cmpmem
+  4, // findb
 };
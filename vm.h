@@ -1,4 +1,5 @@
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include "exe.h"
 
@@ -15,6 +16,14 @@
 #define INVALID_EXECUTABLE    0x06
 #define ALLOCATION_FAILURE    0x07
 
+// Returned by vm_run_for if the machine used up its budget and can be resumed,
+// this never ends up in exit_code
+#define VM_YIELDED            0xff
+
+// Returned by vm_run_for if the program went to sleep while park_sleep was set,
+// vm->sleep_ns holds the duration. Calling vm_run_for again resumes the machine
+#define VM_SLEEPING           0xfe
+
 // Bitmasks for the flags register
 #define VM_FLAG_ZERO    1
 
@@ -105,6 +114,18 @@ typedef enum opcode {
   op_nop,
   op_syscall,
 
+  // Bulk memory instructions, all operands are registers (see bulk.h)
+  //
+  // fill   address, size, value  sets size bytes at address to the low byte of value
+  // cmpmem left, right, size     sets the zero bit if both ranges are equal and writes
+  //                              the offset of the first differing byte into size
+  // findb  address, size, value  sets the zero bit if the low byte of value occurs in
+  //                              the range and writes the offset of its first occurrence
+  //                              into size
+  op_fill,
+  op_cmpmem,
+  op_findb,
+
   // This is here so we can compare an integer against it and
   // thus check if it's a valid instruction
   op_num_types
@@ -113,13 +134,14 @@ typedef enum opcode {
 /*
  * Contains the amounts of bytes each opcode takes up
  * */
-uint64_t opcode_length_lookup_table[59];
+extern const uint64_t opcode_length_lookup_table[op_num_types];
 
 // Syscall ids
 #define VM_SYS_EXIT   0x00
 #define VM_SYS_SLEEP  0x01
 #define VM_SYS_WRITE  0x02
 #define VM_SYS_PUTS   0x03
+#define VM_SYS_FLUSH  0x04
 
 // Well-known addresses
 #define VM_STACK_START 0x00400000
@@ -139,12 +161,58 @@ uint64_t opcode_length_lookup_table[59];
 #define VM_VRAMWIDTH      240
 #define VM_VRAMHEIGHT     160
 
+// Memory sizes vm_create accepts, the largest one keeps the end of every
+// access of up to 8 bytes inside 32 bits
+#define VM_MEMORY_MINSIZE 4096
+#define VM_MEMORY_MAXSIZE 0xfffff000
+
+/*
+ * Size and layout of a machine's memory
+ *
+ * The stack grows down from stack_start, the frame pointer starts at the end
+ * of memory. VRAM stays at VM_VRAM, vram can only be set if memory covers it.
+ * vm_create uses the defaults of vm_config_default if it's given no config.
+ *
+ * A push which would grow the stack to more than stack_size bytes raises an
+ * illegal memory access. The limit is clamped to address 0, a stack_size of
+ * 0 (the default) lets the stack grow all the way down to it.
+ * */
+typedef struct VMConfig {
+  uint32_t memory_size;
+  uint32_t stack_start;
+  uint32_t stack_size;            // 0 for no limit, VM_STACKSIZE is the size of the standard layout
+  bool vram;                      // the framebuffer can be enabled (see framebuffer.h)
+} VMConfig;
+
 // The machine itself
 typedef struct VM {
   uint8_t* memory;
+  uint32_t memory_size;
+  uint32_t stack_start;
+  uint32_t stack_size;
+  uint32_t stack_limit;           // lowest address pushes may write to, see VMConfig
+  bool vram;
   uint64_t* regs;
   bool running;
   uint8_t exit_code;
+  struct VMCodePage** code_pages; // decode cache, see decode.h
+  struct VMJit* jit;              // compiled blocks, NULL if the JIT is disabled
+  uint64_t* fused_counts;         // executions of each fused handler, see decode.h
+  bool count_fused;               // fused handlers only count their executions if set
+  bool shared_memory;             // memory is (partly) a copy-on-write mapping of a file
+  uint8_t* memory_mapping;        // start of the mapping holding memory, see guard.h
+  size_t memory_mapping_size;
+  bool guarded;                   // memory is followed by guard pages, see guard.h
+  struct VMOutput* output;        // buffered output of the write and puts syscalls, see output.h
+  struct VMProfile* profile;      // per opcode counts and timings, NULL unless profiling (see profile.h)
+  struct VMFramebuffer* framebuffer; // VRAM stream, NULL unless enabled (see framebuffer.h)
+  struct VMTrace* trace;          // instruction trace, NULL unless recording (see trace.h)
+  struct VMVerified* verified;    // verified instruction starts, NULL unless verified (see verify.h)
+  struct VMAot* aot;              // translated code, NULL unless a module was loaded (see aot.h)
+  int64_t budget;                 // instructions vm_run_for has left, negative if it overran
+  bool park_sleep;                // vm_run_for returns VM_SLEEPING instead of blocking in the sleep syscall
+  bool sleeping;                  // the machine is parked in a sleep syscall
+  uint64_t sleep_ns;              // duration of the sleep the machine is parked in
 } VM;
 
 typedef enum {
@@ -156,14 +224,23 @@ typedef enum {
   vm_err_executable_too_big,
   vm_err_invalid_executable,
   vm_err_allocation,
-  vm_err_internal_failure
+  vm_err_internal_failure,
+  vm_err_jit_unavailable,
+  vm_err_invalid_trace,
+  vm_err_invalid_config,
+  vm_err_overlapping_code,
+  vm_err_compile_failed,
+  vm_err_invalid_module
 } VMError;
 
 // VM Methods
-VMError vm_create(VM** vm);
+void vm_config_default(VMConfig* config);
+void vm_config_executable(VMConfig* config, Executable* exe);
+VMError vm_create(VM** vm, const VMConfig* config);
 void vm_clean(VM* vm);
 VMError vm_flash(VM* vm, Executable* exe);
 int vm_run(VM* vm, int* exit_code);
+int vm_run_for(VM* vm, uint64_t max_instructions, int* exit_code);
 bool vm_cycle(VM* vm);
 void vm_execute(VM* vm, opcode instruction, uint32_t ip);
 uint64_t vm_instruction_length(VM* vm, opcode instruction);
@@ -175,6 +252,8 @@ void* vm_stack_pop(VM* vm, uint32_t size);
 void vm_write_reg(VM* vm, uint8_t reg, uint64_t value);
 uint64_t vm_read_reg(VM* vm, uint8_t reg);
 void vm_move_mem_to_reg(VM* vm, uint8_t reg, uint32_t address, uint32_t size);
-bool vm_legal_address(uint32_t address);
+bool vm_legal_address(VM* vm, uint32_t address);
+void vm_memory_written(VM* vm, uint32_t address, uint32_t size);
+uint64_t vm_now_ns(void);
 
 #endif
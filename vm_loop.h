@@ -0,0 +1,1207 @@
+/*
+ * Instruction handlers of the virtual machine
+ *
+ * This file has no include guard on purpose. vm.c includes it once for every
+ * variant of the interpreter it needs, after defining the following macros:
+ *
+ * VM_LOOP_NAME         Name of the generated function
+ * VM_LOOP_SINGLE_STEP  If 1, the function executes exactly one instruction and
+ *                      has the signature of vm_execute. If 0, the function
+ *                      keeps running until the machine stops.
+ * VM_LOOP_THREADED     If 1, the handlers are chained together via computed
+ *                      goto (one indirect branch per instruction). If 0, a
+ *                      portable switch statement is used.
+ * VM_LOOP_JIT          If 1, branches count how often their target is reached
+ *                      and hand hot blocks over to the JIT (see jit.h).
+ * VM_LOOP_PROFILE      If 1, every dispatch is counted and timed per opcode
+ *                      (see profile.h).
+ * VM_LOOP_BUDGET       If 1, the function returns once vm->budget instructions
+ *                      have been executed. The budget is only checked at the
+ *                      end of a block, so it can be overrun by a few instructions.
+ *                      It also returns after a sleep syscall if vm->park_sleep is set.
+ * VM_LOOP_GUARDED      If 1, loads and stores of up to 8 bytes aren't checked, the
+ *                      machine's memory has to be followed by guard pages (see guard.h).
+ * VM_LOOP_TRACE        If 1, every dispatched instruction is recorded (see trace.h).
+ *
+ * Instructions are executed from their decoded form (see decode.h). The main loop
+ * looks them up in the decode cache, the single step variant decodes the
+ * instruction it was given on the spot.
+ *
+ * Every handler ends with NEXT(), which either returns (single step) or advances
+ * the instruction pointer and jumps straight to the handler of the next instruction.
+ * Branches end with NEXT_BLOCK() instead, which also marks the start of a block.
+ *
+ * Handlers have to read all operands out of inst before they write to the
+ * machine's memory, as the write might invalidate the decoded instruction.
+ *
+ * The instruction pointer is only checked when an instruction changed it, the
+ * address after a decoded instruction is always inside memory (see vm_decode).
+ *
+ * Except for the single step and profiling variants, the instruction pointer
+ * and the flags register live in locals while the loop runs. Handlers jump with
+ * JUMP and use the zero bit through ZERO_BIT and SET_ZERO_BIT. The locals are
+ * written back into vm->regs before syscalls, compiled blocks and anything else
+ * which looks at the registers, and whenever the loop returns. In between, the
+ * instruction pointer register holds the start of the current block. Instructions
+ * which name either register as an operand are executed by vm_execute instead
+ * (see handler_synced).
+ * */
+
+// Set if the instruction pointer and the flags are kept in locals
+#define VM_LOOP_CACHED (!VM_LOOP_SINGLE_STEP && !VM_LOOP_PROFILE)
+
+#if VM_LOOP_CACHED
+
+// Jumps to ADDRESS, a jump onto the instruction itself falls through like
+// an instruction which didn't touch the instruction pointer (see ADVANCE)
+#define JUMP(ADDRESS) {                                                        \
+    uint32_t target = (ADDRESS);                                               \
+    if (target != ip) next = target;                                           \
+  }
+
+#define ZERO_BIT() ((flags & VM_FLAG_ZERO) == 1)
+#define SET_ZERO_BIT(VALUE) (flags ^= (-(uint64_t)(VALUE) ^ flags) & 1)
+
+// Writes the locals back into the registers
+#define SYNC() {                                                               \
+    vm_write_reg(vm, VM_REGIP, ip);                                            \
+    vm->regs[(VM_REGFLAGS) & VM_CODEMASK] = flags;                             \
+  }
+
+// Picks up the registers after something else ran on them, a changed
+// instruction pointer becomes the next instruction
+#define RELOAD() {                                                             \
+    flags = REG(VM_REGFLAGS);                                                  \
+    JUMP(REG(VM_REGIP));                                                       \
+  }
+
+#else
+
+#define JUMP(ADDRESS) vm_write_reg(vm, VM_REGIP, ADDRESS)
+#define ZERO_BIT() vm_is_zero_bit_set(vm)
+#define SET_ZERO_BIT(VALUE) vm_set_zero_bit(vm, VALUE)
+#define SYNC()
+#define RELOAD()
+
+#endif
+
+#if VM_LOOP_SINGLE_STEP
+
+#define TARGET(OP) case OP:
+#define NEXT() return
+#define NEXT_BLOCK() return
+
+#else
+
+// Leaves the loop, the unused part of the budget is handed back first
+#if VM_LOOP_BUDGET
+#define LEAVE() { SYNC(); vm->budget = budget; return; }
+#else
+#define LEAVE() { SYNC(); return; }
+#endif
+
+// The instruction pointer is only advanced if the instruction didn't change it
+//
+// This check has to stay even for jumps, as a jump onto itself is treated
+// exactly like an instruction which didn't touch the instruction pointer
+//
+// ip is updated right away, so the register doesn't have to be read back
+//
+// With cached registers, JUMP already replaced next. Only branches jump,
+// ADVANCE_BLOCK checks where they went and updates the register.
+#if VM_LOOP_CACHED
+#define ADVANCE() ip = next;
+#define ADVANCE_BLOCK()                                                        \
+  ip = next;                                                                   \
+  CHECK_IP();                                                                  \
+  vm_write_reg(vm, VM_REGIP, ip);
+#else
+#define ADVANCE()                                                              \
+  if (REG(VM_REGIP) == ip) {                                                   \
+    vm_write_reg(vm, VM_REGIP, next);                                          \
+    ip = next;                                                                 \
+  } else {                                                                     \
+    ip = REG(VM_REGIP);                                                        \
+    CHECK_IP();                                                                \
+  }
+#define ADVANCE_BLOCK() ADVANCE()
+#endif
+
+// Stops the machine if ip isn't inside its memory, unless it stopped already
+#define CHECK_IP()                                                             \
+  if (!vm_legal_address(vm, ip)) {                                             \
+    if (vm->running) {                                                         \
+      vm->exit_code = ILLEGAL_MEMORY_ACCESS;                                   \
+      vm->running = false;                                                     \
+    }                                                                          \
+    LEAVE();                                                                   \
+  }
+
+// Look up the instruction at the current instruction pointer, which has
+// to be inside memory
+#define FETCH()                                                                \
+  if (!vm->running) LEAVE();                                                   \
+  page = vm->code_pages[ip >> VM_CODEPAGE_SHIFT];                              \
+  if (page == NULL) goto decode;                                               \
+  inst = page->instructions + (ip & VM_CODEPAGE_MASK);                         \
+  next = inst->next;                                                           \
+  if (next == 0) goto decode;
+
+// Run the compiled block at ip, or count the entry if there is none yet
+//
+// Blocks are chained together as long as they make progress, the instruction
+// a block stopped at is then executed by the interpreter
+#define ENTER_BLOCK()                                                          \
+  while (inst->native) {                                                       \
+    uint32_t entry = ip;                                                       \
+    SYNC();                                                                    \
+    ((VMNativeBlock) inst->native)(vm->regs, vm->memory, vm->code_pages);      \
+    ip = REG(VM_REGIP);                                                        \
+    flags = REG(VM_REGFLAGS);                                                  \
+    CHECK_IP();                                                                \
+    FETCH();                                                                   \
+    if (ip == entry) break;                                                    \
+  }                                                                            \
+  if (inst->native == NULL && ++inst->hits == VM_JIT_THRESHOLD) {              \
+    vm_jit_compile(vm, ip, inst);                                              \
+  }
+
+// Runs whenever an instruction is dispatched
+//
+// The profiler charges the time since the previous dispatch to the previous
+// instruction, the budget variant counts the instruction and the trace
+// variant records it
+#if VM_LOOP_PROFILE
+#define DISPATCHED() {                                                         \
+    uint64_t now = vm_profile_clock();                                         \
+    vm->profile->ticks[profiled] += now - profile_start;                       \
+    vm->profile->counts[inst->kind]++;                                         \
+    profiled = inst->kind;                                                     \
+    profile_start = now;                                                       \
+  }
+#elif VM_LOOP_BUDGET
+#define DISPATCHED() budget--;
+#elif VM_LOOP_TRACE
+#define DISPATCHED() { SYNC(); vm_trace_step(vm, ip, inst); }
+#else
+#define DISPATCHED()
+#endif
+
+// Leaves the loop at the end of a block once the budget is used up
+#if VM_LOOP_BUDGET
+#define CHECK_BUDGET() if (budget <= 0) LEAVE();
+#else
+#define CHECK_BUDGET()
+#endif
+
+#if VM_LOOP_THREADED
+
+#define TARGET(OP) L_##OP:
+#define DISPATCH() { FETCH(); DISPATCHED(); goto *inst->handler; }
+#define NEXT() { ADVANCE(); DISPATCH(); }
+
+#if VM_LOOP_JIT
+#define NEXT_BLOCK() { ADVANCE_BLOCK(); FETCH(); ENTER_BLOCK(); goto *inst->handler; }
+#else
+#define NEXT_BLOCK() { ADVANCE_BLOCK(); CHECK_BUDGET(); DISPATCH(); }
+#endif
+
+#else
+
+#define TARGET(OP) case OP:
+#define DISPATCH() goto dispatch
+#define NEXT() { ADVANCE(); DISPATCH(); }
+
+#if VM_LOOP_JIT
+#define NEXT_BLOCK() { ADVANCE_BLOCK(); FETCH(); ENTER_BLOCK(); goto execute; }
+#else
+#define NEXT_BLOCK() { ADVANCE_BLOCK(); CHECK_BUDGET(); DISPATCH(); }
+#endif
+
+#endif
+
+// Finishes the first instruction of a fused pair
+//
+// The second instruction only runs as part of the pair if the first one
+// advanced the instruction pointer like a regular instruction and didn't
+// overwrite the pair, otherwise execution continues as if they weren't fused
+//
+// The second instruction of the pair counts against the budget as well
+#if VM_LOOP_BUDGET
+#define FUSE()                                                                 \
+  ADVANCE();                                                                   \
+  if (!vm->running || ip != next || inst->next == 0) DISPATCH();               \
+  budget--;
+#else
+#define FUSE()                                                                 \
+  ADVANCE();                                                                   \
+  if (!vm->running || ip != next || inst->next == 0) DISPATCH();
+#endif
+
+#endif
+
+// Stops the machine, the instruction pointer is still advanced
+#define RAISE(CODE) {                                                          \
+  vm->exit_code = CODE;                                                        \
+  vm->running = false;                                                         \
+  NEXT();                                                                      \
+}
+
+// Integer arithmetic, result is written back into the target register
+#define INTEGER_OP(OP, EXPR)                                                   \
+  TARGET(OP) {                                                                 \
+    uint8_t target = inst->r1;                                                 \
+    uint8_t source = inst->r2;                                                 \
+    uint64_t result = (EXPR);                                                  \
+    SET_ZERO_BIT(result == 0);                                                 \
+    vm_write_reg(vm, target, result);                                          \
+    NEXT();                                                                    \
+  }
+
+// Floating-point arithmetic
+#define FLOAT_OP(OP, EXPR)                                                     \
+  TARGET(OP) {                                                                 \
+    uint8_t target_reg = inst->r1;                                             \
+    uint8_t source_reg = inst->r2;                                             \
+    uint64_t target_uncasted_value = REG(target_reg);                          \
+    uint64_t source_uncasted_value = REG(source_reg);                          \
+    double target = *(double *)(&target_uncasted_value);                       \
+    double source = *(double *)(&source_uncasted_value);                       \
+    double result = (EXPR);                                                    \
+    SET_ZERO_BIT(result == (double)0);                                         \
+    vm_write_reg(vm, target_reg, result);                                      \
+    NEXT();                                                                    \
+  }
+
+// Comparisons, only the zero bit is updated
+#define COMPARE_OP(OP, TYPE, EXPR)                                             \
+  TARGET(OP) {                                                                 \
+    uint64_t left_uncasted_value = REG(inst->r1);                              \
+    uint64_t right_uncasted_value = REG(inst->r2);                             \
+    TYPE left = *(TYPE *)(&left_uncasted_value);                               \
+    TYPE right = *(TYPE *)(&right_uncasted_value);                             \
+    SET_ZERO_BIT(EXPR);                                                        \
+    NEXT();                                                                    \
+  }
+
+// Bitwise operations, only the zero bit is updated
+#define BITWISE_OP(OP, EXPR)                                                   \
+  TARGET(OP) {                                                                 \
+    uint64_t left = REG(inst->r1);                                             \
+    uint64_t right = REG(inst->r2);                                            \
+    uint64_t result = (EXPR);                                                  \
+    SET_ZERO_BIT(result == 0);                                                 \
+    NEXT();                                                                    \
+  }
+
+// Counts the execution of a fused handler for vm_decode_stats, only if asked
+// to, so the hot loop doesn't pay for counts nobody reads
+#define COUNT_FUSED(HANDLER)                                                   \
+  if (vm->count_fused) vm->fused_counts[HANDLER]++
+
+// Comparison followed by jz
+//
+// The result of the comparison decides the jump, without reading the flags back
+#define FUSED_COMPARE_JZ(HANDLER, TYPE, EXPR)                                  \
+  TARGET(HANDLER) {                                                            \
+    COUNT_FUSED(HANDLER);                                                      \
+    uint64_t left_uncasted_value = REG(inst->r1);                              \
+    uint64_t right_uncasted_value = REG(inst->r2);                             \
+    TYPE left = *(TYPE *)(&left_uncasted_value);                               \
+    TYPE right = *(TYPE *)(&right_uncasted_value);                             \
+    bool taken = (EXPR);                                                       \
+    SET_ZERO_BIT(taken);                                                       \
+    FUSE();                                                                    \
+    next = inst->c;                                                            \
+    if (taken) JUMP(inst->a);                                                  \
+    NEXT_BLOCK();                                                              \
+  }
+
+// loadi followed by integer arithmetic
+#define FUSED_LOADI_INTEGER_OP(HANDLER, EXPR)                                  \
+  TARGET(HANDLER) {                                                            \
+    COUNT_FUSED(HANDLER);                                                      \
+    vm_write_reg(vm, inst->r1, inst->value);                                   \
+    FUSE();                                                                    \
+    uint8_t target = inst->a;                                                  \
+    uint8_t source = inst->b;                                                  \
+    uint64_t result = (EXPR);                                                  \
+    SET_ZERO_BIT(result == 0);                                                 \
+    vm_write_reg(vm, target, result);                                          \
+    next = inst->c;                                                            \
+    NEXT();                                                                    \
+  }
+
+// loadi followed by a comparison or bitwise operation
+#define FUSED_LOADI_FLAG_OP(HANDLER, TYPE, EXPR)                               \
+  TARGET(HANDLER) {                                                            \
+    COUNT_FUSED(HANDLER);                                                      \
+    vm_write_reg(vm, inst->r1, inst->value);                                   \
+    FUSE();                                                                    \
+    uint64_t left_uncasted_value = REG(inst->a);                               \
+    uint64_t right_uncasted_value = REG(inst->b);                              \
+    TYPE left = *(TYPE *)(&left_uncasted_value);                               \
+    TYPE right = *(TYPE *)(&right_uncasted_value);                             \
+    SET_ZERO_BIT(EXPR);                                                        \
+    next = inst->c;                                                            \
+    NEXT();                                                                    \
+  }
+
+// Writes the low bytes of VALUE into a register, for handlers which know its width
+#define WRITE_REG(TYPE, REG, VALUE)                                            \
+  (*(TYPE *)(vm->regs + ((REG) & VM_CODEMASK)) = (TYPE)(VALUE))
+
+// Instantiates a handler for every width of the target register (see VM_WIDTH_HANDLERS)
+//
+// BODY receives the type of the target register and ARG
+#define WIDTH_HANDLER(OP, BODY, ARG)                                           \
+  TARGET(handler_##OP##_byte) BODY(uint8_t, ARG)                               \
+  TARGET(handler_##OP##_word) BODY(uint16_t, ARG)                              \
+  TARGET(handler_##OP##_dword) BODY(uint32_t, ARG)                             \
+  TARGET(handler_##OP##_qword) BODY(uint64_t, ARG)
+
+// Moves VALUE into the target register
+#define MOVE_WIDTH(TYPE, VALUE) {                                              \
+    WRITE_REG(TYPE, inst->r1, (VALUE));                                        \
+    NEXT();                                                                    \
+  }
+
+// Integer arithmetic, see INTEGER_OP
+#define INTEGER_WIDTH(TYPE, EXPR) {                                            \
+    uint8_t target = inst->r1;                                                 \
+    uint8_t source = inst->r2;                                                 \
+    uint64_t result = (EXPR);                                                  \
+    SET_ZERO_BIT(result == 0);                                                 \
+    WRITE_REG(TYPE, target, result);                                           \
+    NEXT();                                                                    \
+  }
+
+// Integer arithmetic on the target register alone, see INTEGER_WIDTH
+#define UNARY_WIDTH(TYPE, EXPR) {                                              \
+    uint8_t target = inst->r1;                                                 \
+    uint64_t result = (EXPR);                                                  \
+    SET_ZERO_BIT(result == 0);                                                 \
+    WRITE_REG(TYPE, target, result);                                           \
+    NEXT();                                                                    \
+  }
+
+// Loads the target register from memory, see vm_move_mem_to_reg
+#define LOAD_WIDTH(TYPE, ADDRESS) {                                            \
+    uint32_t address = (ADDRESS);                                              \
+    CHECK_ACCESS(address, sizeof(TYPE));                                       \
+    WRITE_REG(TYPE, inst->r1, *(TYPE *)(vm->memory + address));                \
+    NEXT();                                                                    \
+  }
+
+// Pushes the low bytes of VALUE, see vm_stack_write_block
+#define PUSH_WIDTH(TYPE, VALUE) {                                              \
+    TYPE value = (TYPE)(VALUE);                                                \
+    vm_stack_write_block(vm, &value, sizeof(TYPE));                            \
+    NEXT();                                                                    \
+  }
+
+// Pops the target register off the stack
+#define POP_WIDTH(TYPE, ARG) {                                                 \
+    TYPE* data = vm_stack_pop(vm, sizeof(TYPE));                               \
+    if (data != NULL) WRITE_REG(TYPE, inst->r1, *data);                        \
+    NEXT();                                                                    \
+  }
+
+// Same as LOAD_WIDTH, for the read instructions which check the range like CHECK_RANGE
+#define READ_WIDTH(TYPE, ADDRESS) {                                            \
+    uint32_t address = (ADDRESS);                                              \
+    CHECK_FIXED_RANGE(address, sizeof(TYPE));                                  \
+    WRITE_REG(TYPE, inst->r1, *(TYPE *)(vm->memory + address));                \
+    NEXT();                                                                    \
+  }
+
+// Same as READ_WIDTH, for verified instructions (see verify.h)
+#define VERIFIED_READ_WIDTH(TYPE, ADDRESS) {                                   \
+    WRITE_REG(TYPE, inst->r1, *(TYPE *)(vm->memory + (ADDRESS)));              \
+    NEXT();                                                                    \
+  }
+
+// Instructions with constant ranges, CHECK checks the ranges
+//
+// The verified variants pass VERIFIED, the verifier already made
+// sure the ranges are inside memory (see vm_decode_trust)
+#define VERIFIED(ADDRESS, SIZE)
+
+#define READCS(HANDLER, CHECK)                                                 \
+  TARGET(HANDLER) {                                                            \
+    uint32_t size = inst->a;                                                   \
+    uint32_t address = inst->b;                                                \
+    CHECK(address, size);                                                      \
+    vm_stack_write_block(vm, vm->memory + address, size);                      \
+    NEXT();                                                                    \
+  }
+
+#define WRITEC(HANDLER, CHECK)                                                 \
+  TARGET(HANDLER) {                                                            \
+    uint32_t address = inst->a;                                                \
+    uint8_t source = inst->r1;                                                 \
+    uint32_t size = vm_reg_size(source);                                       \
+    CHECK(address, size);                                                      \
+    memmove(vm->memory + address, vm->regs + (source & VM_CODEMASK), size);    \
+    vm_memory_written(vm, address, size);                                      \
+    NEXT();                                                                    \
+  }
+
+#define WRITECS(HANDLER, CHECK)                                                \
+  TARGET(HANDLER) {                                                            \
+    uint32_t address = inst->a;                                                \
+    uint32_t size = inst->b;                                                   \
+    CHECK(address, size);                                                      \
+    void* data = vm_stack_pop(vm, size);                                       \
+    if (data == NULL) NEXT();                                                  \
+    memmove(vm->memory + address, data, size);                                 \
+    vm_memory_written(vm, address, size);                                      \
+    NEXT();                                                                    \
+  }
+
+#define COPYC(HANDLER, CHECK)                                                  \
+  TARGET(HANDLER) {                                                            \
+    uint32_t target = inst->a;                                                 \
+    uint32_t size = inst->b;                                                   \
+    uint32_t source = inst->c;                                                 \
+    CHECK(target, size);                                                       \
+    CHECK(source, size);                                                       \
+    memmove(vm->memory + target, vm->memory + source, size);                   \
+    TRACE_COPY(target, source, size);                                          \
+    vm_memory_written(vm, target, size);                                       \
+    NEXT();                                                                    \
+  }
+
+// Both of the given addresses have to be inside the machine's memory
+//
+// A single comparison covers both, the end is computed in 64 bits so
+// a huge size can't wrap around into a legal address
+#define CHECK_RANGE(ADDRESS, SIZE)                                             \
+  if ((uint64_t)(ADDRESS) + (SIZE) >= vm->memory_size) {                       \
+    RAISE(ILLEGAL_MEMORY_ACCESS);                                              \
+  }
+
+// Blocks of any size, which may end right at the end of the memory
+//
+// Unlike CHECK_ACCESS this is kept in the guarded loop, a block can reach
+// past the guard pages
+#define CHECK_BLOCK(ADDRESS, SIZE)                                             \
+  if ((uint64_t)(ADDRESS) + (SIZE) > vm->memory_size) {                        \
+    RAISE(ILLEGAL_MEMORY_ACCESS);                                              \
+  }
+
+// Accesses of at most 8 bytes
+//
+// CHECK_ACCESS allows the access to end right at the end of the memory (loads
+// and stores), CHECK_FIXED_RANGE doesn't (reads and writes, like CHECK_RANGE).
+// The guarded loop leaves both to the guard pages behind the memory, the
+// cached registers are written back first for the fault handler (see vm_run_guarded).
+// Copies and fills are traced as such, instead of the bytes they wrote
+#if VM_LOOP_TRACE
+#define TRACE_COPY(TARGET, SOURCE, SIZE) vm_trace_copied(vm, TARGET, SOURCE, SIZE);
+#define TRACE_FILL(ADDRESS, VALUE, SIZE) vm_trace_filled(vm, ADDRESS, VALUE, SIZE);
+#else
+#define TRACE_COPY(TARGET, SOURCE, SIZE)
+#define TRACE_FILL(ADDRESS, VALUE, SIZE)
+#endif
+
+#if VM_LOOP_GUARDED
+#define CHECK_ACCESS(ADDRESS, SIZE) SYNC();
+#define CHECK_FIXED_RANGE(ADDRESS, SIZE) SYNC();
+#else
+#define CHECK_ACCESS(ADDRESS, SIZE)                                            \
+  if (vm->memory_size - (SIZE) < (ADDRESS)) {                                  \
+    RAISE(ILLEGAL_MEMORY_ACCESS);                                              \
+  }
+#define CHECK_FIXED_RANGE(ADDRESS, SIZE) CHECK_RANGE(ADDRESS, SIZE)
+#endif
+
+#if VM_LOOP_SINGLE_STEP
+static void VM_LOOP_NAME(VM* vm, opcode instruction, uint32_t ip) {
+  VMInstruction decoded;
+  VMInstruction* inst = &decoded;
+
+  if (vm_decode(vm, ip, instruction, inst) == 0) {
+    vm->exit_code = ILLEGAL_MEMORY_ACCESS;
+    vm->running = false;
+    return;
+  }
+#else
+static void VM_LOOP_NAME(VM* vm) {
+  uint32_t ip;
+  uint32_t next;
+#if VM_LOOP_CACHED
+  uint64_t flags = REG(VM_REGFLAGS);
+#endif
+  VMCodePage* page;
+  VMInstruction* inst;
+  VMInstruction scratch;
+#endif
+
+#if VM_LOOP_PROFILE
+  uint16_t profiled = handler_invalid;
+  uint64_t profile_start = vm_profile_clock();
+#endif
+
+#if VM_LOOP_BUDGET
+  int64_t budget = vm->budget;
+#endif
+
+#if VM_LOOP_THREADED
+  static const void* const dispatch_table[handler_num_types] = {
+    [0 ... handler_num_types - 1] = &&L_handler_invalid,
+    [op_rpush] = &&L_op_rpush,
+    [op_rpop] = &&L_op_rpop,
+    [op_mov] = &&L_op_mov,
+    [op_loadi] = &&L_op_loadi,
+    [op_rst] = &&L_op_rst,
+    [op_add] = &&L_op_add,
+    [op_sub] = &&L_op_sub,
+    [op_mul] = &&L_op_mul,
+    [op_div] = &&L_op_div,
+    [op_idiv] = &&L_op_idiv,
+    [op_rem] = &&L_op_rem,
+    [op_irem] = &&L_op_irem,
+    [op_fadd] = &&L_op_fadd,
+    [op_fsub] = &&L_op_fsub,
+    [op_fmul] = &&L_op_fmul,
+    [op_fdiv] = &&L_op_fdiv,
+    [op_frem] = &&L_op_frem,
+    [op_fexp] = &&L_op_fexp,
+    [op_flt] = &&L_op_flt,
+    [op_fgt] = &&L_op_fgt,
+    [op_cmp] = &&L_op_cmp,
+    [op_lt] = &&L_op_lt,
+    [op_gt] = &&L_op_gt,
+    [op_ult] = &&L_op_ult,
+    [op_ugt] = &&L_op_ugt,
+    [op_shr] = &&L_op_shr,
+    [op_shl] = &&L_op_shl,
+    [op_and] = &&L_op_and,
+    [op_xor] = &&L_op_xor,
+    [op_or] = &&L_op_or,
+    [op_not] = &&L_op_not,
+    [op_inttofp] = &&L_op_inttofp,
+    [op_sinttofp] = &&L_op_sinttofp,
+    [op_fptoint] = &&L_op_fptoint,
+    [op_load] = &&L_op_load,
+    [op_loadr] = &&L_op_loadr,
+    [op_loads] = &&L_op_loads,
+    [op_loadsr] = &&L_op_loadsr,
+    [op_store] = &&L_op_store,
+    [op_push] = &&L_op_push,
+    [op_read] = &&L_op_read,
+    [op_readc] = &&L_op_readc,
+    [op_reads] = &&L_op_reads,
+    [op_readcs] = &&L_op_readcs,
+    [op_write] = &&L_op_write,
+    [op_writec] = &&L_op_writec,
+    [op_writes] = &&L_op_writes,
+    [op_writecs] = &&L_op_writecs,
+    [op_copy] = &&L_op_copy,
+    [op_copyc] = &&L_op_copyc,
+    [op_jz] = &&L_op_jz,
+    [op_jzr] = &&L_op_jzr,
+    [op_jmp] = &&L_op_jmp,
+    [op_jmpr] = &&L_op_jmpr,
+    [op_call] = &&L_op_call,
+    [op_callr] = &&L_op_callr,
+    [op_ret] = &&L_op_ret,
+    [op_nop] = &&L_op_nop,
+    [op_syscall] = &&L_op_syscall,
+    [op_fill] = &&L_op_fill,
+    [op_cmpmem] = &&L_op_cmpmem,
+    [op_findb] = &&L_op_findb,
+    [handler_cmp_jz] = &&L_handler_cmp_jz,
+    [handler_lt_jz] = &&L_handler_lt_jz,
+    [handler_gt_jz] = &&L_handler_gt_jz,
+    [handler_ult_jz] = &&L_handler_ult_jz,
+    [handler_ugt_jz] = &&L_handler_ugt_jz,
+    [handler_loadi_add] = &&L_handler_loadi_add,
+    [handler_loadi_sub] = &&L_handler_loadi_sub,
+    [handler_loadi_mul] = &&L_handler_loadi_mul,
+    [handler_loadi_and] = &&L_handler_loadi_and,
+    [handler_loadi_xor] = &&L_handler_loadi_xor,
+    [handler_loadi_or] = &&L_handler_loadi_or,
+    [handler_loadi_cmp] = &&L_handler_loadi_cmp,
+    [handler_loadi_lt] = &&L_handler_loadi_lt,
+    [handler_loadi_gt] = &&L_handler_loadi_gt,
+    [handler_loadi_ult] = &&L_handler_loadi_ult,
+    [handler_loadi_ugt] = &&L_handler_loadi_ugt,
+    [handler_rpush_call] = &&L_handler_rpush_call,
+    [handler_push_call] = &&L_handler_push_call,
+#define WIDTH_DISPATCH(OP)                                                     \
+    [handler_##OP##_byte] = &&L_handler_##OP##_byte,                           \
+    [handler_##OP##_word] = &&L_handler_##OP##_word,                           \
+    [handler_##OP##_dword] = &&L_handler_##OP##_dword,                         \
+    [handler_##OP##_qword] = &&L_handler_##OP##_qword,
+    VM_WIDTH_HANDLERS(WIDTH_DISPATCH)
+    [handler_readcs_trusted] = &&L_handler_readcs_trusted,
+    [handler_writec_trusted] = &&L_handler_writec_trusted,
+    [handler_writecs_trusted] = &&L_handler_writecs_trusted,
+    [handler_copyc_trusted] = &&L_handler_copyc_trusted,
+    WIDTH_DISPATCH(readc_trusted)
+#undef WIDTH_DISPATCH
+    [handler_synced] = &&L_handler_synced,
+  };
+
+  ip = REG(VM_REGIP);
+  CHECK_IP();
+  FETCH();
+  DISPATCHED();
+  goto *inst->handler;
+
+  // Slow path for instructions which aren't in the decode cache yet
+decode:
+  inst = vm_decode_cached(vm, ip, &scratch);
+  if (inst == NULL) {
+    vm->exit_code = ILLEGAL_MEMORY_ACCESS;
+    vm->running = false;
+    LEAVE();
+  }
+  inst->handler = dispatch_table[inst->kind];
+  next = inst->next;
+  DISPATCHED();
+  goto *inst->handler;
+#else
+#if !VM_LOOP_SINGLE_STEP
+  ip = REG(VM_REGIP);
+  CHECK_IP();
+dispatch:
+  FETCH();
+  goto execute;
+
+  // Slow path for instructions which aren't in the decode cache yet
+decode:
+  inst = vm_decode_cached(vm, ip, &scratch);
+  if (inst == NULL) {
+    vm->exit_code = ILLEGAL_MEMORY_ACCESS;
+    vm->running = false;
+    LEAVE();
+  }
+  next = inst->next;
+
+execute:
+  DISPATCHED();
+#endif
+  switch (inst->kind) {
+#endif
+
+    TARGET(op_rpush) {
+      uint8_t reg = inst->r1;
+      uint32_t size = vm_reg_size(reg);
+      void* ptr = vm->regs + (reg & VM_CODEMASK);
+      vm_stack_write_block(vm, ptr, size);
+      NEXT();
+    }
+
+    TARGET(op_rpop) {
+      uint8_t reg = inst->r1;
+      uint32_t size = vm_reg_size(reg);
+      uint8_t* data = vm_stack_pop(vm, size);
+      if (data == NULL) NEXT();
+      uint32_t address = data - vm->memory;
+      vm_move_mem_to_reg(vm, reg, address, size);
+      NEXT();
+    }
+
+    TARGET(op_mov) {
+      uint8_t target = inst->r1;
+      uint8_t source = inst->r2;
+      uint64_t value = REG(source);
+      vm_write_reg(vm, target, value);
+      NEXT();
+    }
+
+    TARGET(op_loadi) {
+      vm_write_reg(vm, inst->r1, inst->value);
+      NEXT();
+    }
+
+    TARGET(op_rst) {
+      uint8_t reg = inst->r1;
+      vm_write_reg(vm, reg, 0);
+      NEXT();
+    }
+
+    INTEGER_OP(op_add, REG(target) + REG(source))
+    INTEGER_OP(op_sub, REG(target) - REG(source))
+    INTEGER_OP(op_mul, REG(target) * REG(source))
+    INTEGER_OP(op_div, REG(target) / REG(source))
+    INTEGER_OP(op_idiv, (int64_t)REG(target) / (int64_t)REG(source))
+    INTEGER_OP(op_rem, REG(target) % REG(source))
+    INTEGER_OP(op_irem, (int64_t)REG(target) % (int64_t)REG(source))
+
+    FLOAT_OP(op_fadd, target + source)
+    FLOAT_OP(op_fsub, target - source)
+    FLOAT_OP(op_fmul, target * source)
+    FLOAT_OP(op_fdiv, target / source)
+    FLOAT_OP(op_frem, fmod(target, source))
+    FLOAT_OP(op_fexp, pow(target, source))
+
+    COMPARE_OP(op_flt, double, left < right)
+    COMPARE_OP(op_fgt, double, left > right)
+    COMPARE_OP(op_cmp, uint64_t, left == right)
+    COMPARE_OP(op_lt, int64_t, left < right)
+    COMPARE_OP(op_gt, int64_t, left > right)
+    COMPARE_OP(op_ult, uint64_t, left < right)
+    COMPARE_OP(op_ugt, uint64_t, left > right)
+
+    BITWISE_OP(op_shr, left << right)
+    BITWISE_OP(op_shl, left >> right)
+    BITWISE_OP(op_and, left & right)
+    BITWISE_OP(op_xor, left ^ right)
+    BITWISE_OP(op_or, left | right)
+
+    TARGET(op_not) {
+      uint8_t reg = inst->r1;
+      uint64_t value = REG(reg);
+      value = ~value;
+      SET_ZERO_BIT(value == 0);
+      vm_write_reg(vm, reg, value);
+      NEXT();
+    }
+
+    TARGET(op_inttofp) {
+      uint8_t source = inst->r1;
+      double value = (double)REG(source);
+      vm_write_reg(vm, source, *(uint64_t *)(&value));
+      NEXT();
+    }
+
+    TARGET(op_sinttofp) {
+      uint8_t source = inst->r1;
+      double value = (double)(int64_t)REG(source);
+      vm_write_reg(vm, source, *(uint64_t *)(&value));
+      NEXT();
+    }
+
+    TARGET(op_fptoint) {
+      uint8_t source = inst->r1;
+      uint64_t reg_content = REG(source);
+      double value = *(double *)(&reg_content);
+      vm_write_reg(vm, source, (int64_t)value);
+      NEXT();
+    }
+
+    TARGET(op_load) {
+      uint8_t reg = inst->r1;
+      int32_t offset = (int32_t) inst->a;
+      uint32_t fp = REG(VM_REGFP);
+      vm_move_mem_to_reg(vm, reg, fp + offset, vm_reg_size(reg));
+      NEXT();
+    }
+
+    TARGET(op_loadr) {
+      uint8_t reg = inst->r1;
+      uint8_t offset_reg = inst->r2;
+      int32_t offset = (int32_t)REG(offset_reg);
+      uint32_t fp = REG(VM_REGFP);
+      vm_move_mem_to_reg(vm, reg, fp + offset, vm_reg_size(reg));
+      NEXT();
+    }
+
+    TARGET(op_loads) {
+      uint32_t size = inst->a;
+      int32_t offset = (int32_t) inst->b;
+      uint32_t fp = REG(VM_REGFP);
+      uint32_t address = fp + offset;
+      CHECK_BLOCK(address, size);
+      vm_stack_write_block(vm, (vm->memory + address), size);
+      NEXT();
+    }
+
+    TARGET(op_loadsr) {
+      uint32_t size = inst->a;
+      uint8_t offset_reg = inst->r2;
+      int32_t offset = (int32_t)REG(offset_reg);
+      uint32_t fp = REG(VM_REGFP);
+      uint32_t address = fp + offset;
+      CHECK_BLOCK(address, size);
+      vm_stack_write_block(vm, (vm->memory + address), size);
+      NEXT();
+    }
+
+    TARGET(op_store) {
+      int32_t offset = (int32_t) inst->a;
+      uint8_t reg = inst->r1;
+      uint32_t fp = REG(VM_REGFP);
+      uint64_t value = REG(reg);
+      uint32_t size = vm_reg_size(reg);
+      uint32_t address = fp + offset;
+      CHECK_ACCESS(address, size);
+
+      switch (size) {
+        case 1:
+          *((uint8_t *) (vm->memory + address)) = value;
+          break;
+        case 2:
+          *((uint16_t *) (vm->memory + address)) = value;
+          break;
+        case 4:
+          *((uint32_t *) (vm->memory + address)) = value;
+          break;
+        case 8:
+          *((uint64_t *) (vm->memory + address)) = value;
+          break;
+        default:
+          break; // Can't happen
+      }
+
+      vm_memory_written(vm, address, size);
+      NEXT();
+    }
+
+    TARGET(op_push) {
+      uint32_t size = inst->a;
+      void* data = (void* )(vm->memory + ip + 5);
+      vm_stack_write_block(vm, data, size);
+      NEXT();
+    }
+
+    TARGET(op_read) {
+      uint8_t target = inst->r1;
+      uint8_t source = inst->r2;
+      uint32_t address = REG(source);
+      uint32_t size = vm_reg_size(target);
+      CHECK_FIXED_RANGE(address, size);
+      vm_move_mem_to_reg(vm, target, address, size);
+      NEXT();
+    }
+
+    TARGET(op_readc) {
+      uint8_t target = inst->r1;
+      uint32_t address = inst->a;
+      uint32_t size = vm_reg_size(target);
+      CHECK_FIXED_RANGE(address, size);
+      vm_move_mem_to_reg(vm, target, address, size);
+      NEXT();
+    }
+
+    TARGET(op_reads) {
+      uint32_t size = inst->a;
+      uint8_t source = inst->r1;
+      uint32_t address = REG(source);
+      CHECK_RANGE(address, size);
+      vm_stack_write_block(vm, vm->memory + address, size);
+      NEXT();
+    }
+
+    READCS(op_readcs, CHECK_RANGE)
+
+    TARGET(op_write) {
+      uint8_t target = inst->r1;
+      uint8_t source = inst->r2;
+      uint32_t address = REG(target);
+      uint32_t size = vm_reg_size(source);
+      CHECK_FIXED_RANGE(address, size);
+      memmove(vm->memory + address, vm->regs + (source & VM_CODEMASK), size);
+      vm_memory_written(vm, address, size);
+      NEXT();
+    }
+
+    WRITEC(op_writec, CHECK_FIXED_RANGE)
+
+    TARGET(op_writes) {
+      uint8_t target = inst->r1;
+      uint32_t size = inst->a;
+      uint32_t address = REG(target);
+      CHECK_RANGE(address, size);
+      void* data = vm_stack_pop(vm, size);
+      if (data == NULL) NEXT();
+      memmove(vm->memory + address, data, size);
+      vm_memory_written(vm, address, size);
+      NEXT();
+    }
+
+    WRITECS(op_writecs, CHECK_RANGE)
+
+    TARGET(op_copy) {
+      uint8_t target = REG(inst->r1);
+      uint32_t size = inst->a;
+      uint8_t source = REG(inst->r2);
+      CHECK_RANGE(target, size);
+      CHECK_RANGE(source, size);
+      memmove(vm->memory + target, vm->memory + source, size);
+      TRACE_COPY(target, source, size);
+      vm_memory_written(vm, target, size);
+      NEXT();
+    }
+
+    COPYC(op_copyc, CHECK_RANGE)
+
+    TARGET(op_jz) {
+      uint32_t address = inst->a;
+      if (ZERO_BIT()) {
+        JUMP(address);
+      }
+      NEXT_BLOCK();
+    }
+
+    TARGET(op_jzr) {
+      uint8_t reg = inst->r1;
+      uint32_t address = REG(reg);
+      if (ZERO_BIT()) {
+        JUMP(address);
+      }
+      NEXT_BLOCK();
+    }
+
+    TARGET(op_jmp) {
+      uint32_t address = inst->a;
+      JUMP(address);
+      NEXT_BLOCK();
+    }
+
+    TARGET(op_jmpr) {
+      uint8_t reg = inst->r1;
+      uint32_t address = REG(reg);
+      JUMP(address);
+      NEXT_BLOCK();
+    }
+
+    TARGET(op_call) {
+      uint32_t address = inst->a;
+      vm_push_stack_frame(vm, ip + 5);
+      JUMP(address);
+      NEXT_BLOCK();
+    }
+
+    TARGET(op_callr) {
+      uint8_t reg = inst->r1;
+      uint32_t address = REG(reg);
+      vm_push_stack_frame(vm, ip + 2);
+      JUMP(address);
+      NEXT_BLOCK();
+    }
+
+    TARGET(op_ret) {
+      uint32_t stack_frame_baseadr = REG(VM_REGFP);
+
+      // Check out-of-bounds, the frame may not wrap around the end of the address space
+      if ((uint64_t) stack_frame_baseadr + 12 >= vm->memory_size) {
+        RAISE(ILLEGAL_MEMORY_ACCESS);
+      }
+
+      // Read the current stackframe
+      uint32_t fp = *(uint32_t *)(vm->memory + stack_frame_baseadr);
+      uint32_t ra = *(uint32_t *)(vm->memory + stack_frame_baseadr + 4);
+      uint32_t ac = *(uint32_t *)(vm->memory + stack_frame_baseadr + 8);
+      uint32_t sp = stack_frame_baseadr + 12 + ac;
+
+      // Check if the new stack pointer is out of bounds
+      if (!vm_legal_address(vm, sp)) {
+        RAISE(ILLEGAL_MEMORY_ACCESS);
+      }
+
+      vm_write_reg(vm, VM_REGSP, sp);
+      vm_write_reg(vm, VM_REGFP, fp);
+      JUMP(ra);
+      NEXT_BLOCK();
+    }
+
+    TARGET(op_nop) {
+      NEXT();
+    }
+
+    TARGET(op_syscall) {
+      SYNC();
+#if VM_LOOP_PROFILE
+      vm_syscall_profiled(vm);
+#elif VM_LOOP_BUDGET
+
+      // A parked machine resumes at the next instruction
+      vm_syscall(vm, vm->park_sleep);
+      if (vm->sleeping) {
+        ADVANCE();
+        LEAVE();
+      }
+#else
+      vm_syscall(vm, false);
+#endif
+      NEXT();
+    }
+
+    // The ranges are checked once, the loops over their bytes run in bulk.c
+    TARGET(op_fill) {
+      uint32_t address = REG(inst->r1);
+      uint32_t size = REG(inst->r2);
+      uint8_t value = REG(inst->a);
+      CHECK_RANGE(address, size);
+      memset(vm->memory + address, value, size);
+      TRACE_FILL(address, value, size);
+      vm_memory_written(vm, address, size);
+      NEXT();
+    }
+
+    TARGET(op_cmpmem) {
+      uint32_t left = REG(inst->r1);
+      uint32_t right = REG(inst->r2);
+      uint8_t size_reg = inst->a;
+      uint32_t size = REG(size_reg);
+      CHECK_RANGE(left, size);
+      CHECK_RANGE(right, size);
+      uint32_t offset = vm_bulk_mismatch(vm->memory + left, vm->memory + right, size);
+      SET_ZERO_BIT(offset == size);
+      vm_write_reg(vm, size_reg, offset);
+      NEXT();
+    }
+
+    TARGET(op_findb) {
+      uint32_t address = REG(inst->r1);
+      uint8_t size_reg = inst->r2;
+      uint32_t size = REG(size_reg);
+      uint8_t value = REG(inst->a);
+      CHECK_RANGE(address, size);
+      uint32_t offset = vm_bulk_find(vm->memory + address, value, size);
+      SET_ZERO_BIT(offset != size);
+      vm_write_reg(vm, size_reg, offset);
+      NEXT();
+    }
+
+    TARGET(handler_invalid) {
+      RAISE(INVALID_INSTRUCTION);
+    }
+
+    // Fused and width specialized instructions only come out of the decode cache
+#if !VM_LOOP_SINGLE_STEP
+    FUSED_COMPARE_JZ(handler_cmp_jz, uint64_t, left == right)
+    FUSED_COMPARE_JZ(handler_lt_jz, int64_t, left < right)
+    FUSED_COMPARE_JZ(handler_gt_jz, int64_t, left > right)
+    FUSED_COMPARE_JZ(handler_ult_jz, uint64_t, left < right)
+    FUSED_COMPARE_JZ(handler_ugt_jz, uint64_t, left > right)
+
+    FUSED_LOADI_INTEGER_OP(handler_loadi_add, REG(target) + REG(source))
+    FUSED_LOADI_INTEGER_OP(handler_loadi_sub, REG(target) - REG(source))
+    FUSED_LOADI_INTEGER_OP(handler_loadi_mul, REG(target) * REG(source))
+
+    FUSED_LOADI_FLAG_OP(handler_loadi_and, uint64_t, (left & right) == 0)
+    FUSED_LOADI_FLAG_OP(handler_loadi_xor, uint64_t, (left ^ right) == 0)
+    FUSED_LOADI_FLAG_OP(handler_loadi_or, uint64_t, (left | right) == 0)
+    FUSED_LOADI_FLAG_OP(handler_loadi_cmp, uint64_t, left == right)
+    FUSED_LOADI_FLAG_OP(handler_loadi_lt, int64_t, left < right)
+    FUSED_LOADI_FLAG_OP(handler_loadi_gt, int64_t, left > right)
+    FUSED_LOADI_FLAG_OP(handler_loadi_ult, uint64_t, left < right)
+    FUSED_LOADI_FLAG_OP(handler_loadi_ugt, uint64_t, left > right)
+
+    // The pushed data may overwrite the pair, so the call
+    // target has to be read before
+    TARGET(handler_rpush_call) {
+      COUNT_FUSED(handler_rpush_call);
+      uint8_t reg = inst->r1;
+      uint32_t address = inst->a;
+      uint32_t after = inst->c;
+      vm_stack_write_block(vm, vm->regs + (reg & VM_CODEMASK), vm_reg_size(reg));
+      FUSE();
+      next = after;
+      vm_push_stack_frame(vm, ip + 5);
+      JUMP(address);
+      NEXT_BLOCK();
+    }
+
+    TARGET(handler_push_call) {
+      COUNT_FUSED(handler_push_call);
+      uint32_t size = inst->a;
+      uint32_t address = inst->b;
+      uint32_t after = inst->c;
+      vm_stack_write_block(vm, vm->memory + ip + 5, size);
+      FUSE();
+      next = after;
+      vm_push_stack_frame(vm, ip + 5);
+      JUMP(address);
+      NEXT_BLOCK();
+    }
+
+    // Width specialized handlers, the decode cache selects them
+    WIDTH_HANDLER(rpush, PUSH_WIDTH, REG(inst->r1))
+    WIDTH_HANDLER(rpop, POP_WIDTH, 0)
+    WIDTH_HANDLER(mov, MOVE_WIDTH, REG(inst->r2))
+    WIDTH_HANDLER(loadi, MOVE_WIDTH, inst->value)
+    WIDTH_HANDLER(rst, MOVE_WIDTH, 0)
+
+    WIDTH_HANDLER(add, INTEGER_WIDTH, REG(target) + REG(source))
+    WIDTH_HANDLER(sub, INTEGER_WIDTH, REG(target) - REG(source))
+    WIDTH_HANDLER(mul, INTEGER_WIDTH, REG(target) * REG(source))
+    WIDTH_HANDLER(div, INTEGER_WIDTH, REG(target) / REG(source))
+    WIDTH_HANDLER(idiv, INTEGER_WIDTH, (int64_t)REG(target) / (int64_t)REG(source))
+    WIDTH_HANDLER(rem, INTEGER_WIDTH, REG(target) % REG(source))
+    WIDTH_HANDLER(irem, INTEGER_WIDTH, (int64_t)REG(target) % (int64_t)REG(source))
+    WIDTH_HANDLER(not, UNARY_WIDTH, ~REG(target))
+
+    WIDTH_HANDLER(load, LOAD_WIDTH, (uint32_t)REG(VM_REGFP) + (int32_t)inst->a)
+    WIDTH_HANDLER(loadr, LOAD_WIDTH, (uint32_t)REG(VM_REGFP) + (int32_t)REG(inst->r2))
+    WIDTH_HANDLER(read, READ_WIDTH, REG(inst->r2))
+    WIDTH_HANDLER(readc, READ_WIDTH, inst->a)
+
+    // Verified instructions, the decode cache selects them (see vm_decode_trust)
+    READCS(handler_readcs_trusted, VERIFIED)
+    WRITEC(handler_writec_trusted, VERIFIED)
+    WRITECS(handler_writecs_trusted, VERIFIED)
+    COPYC(handler_copyc_trusted, VERIFIED)
+    WIDTH_HANDLER(readc_trusted, VERIFIED_READ_WIDTH, inst->a)
+
+    // The instruction sees the registers as they are in vm->regs, whatever it
+    // did to them is picked up again. inst isn't used after it ran, it might
+    // have overwritten itself.
+    TARGET(handler_synced) {
+      SYNC();
+      vm_execute(vm, vm->memory[ip], ip);
+      RELOAD();
+      NEXT_BLOCK();
+    }
+#endif
+
+#if !VM_LOOP_THREADED
+  }
+#endif
+}
+
+#undef VM_LOOP_CACHED
+#undef JUMP
+#undef ZERO_BIT
+#undef SET_ZERO_BIT
+#undef SYNC
+#undef RELOAD
+#undef TARGET
+#undef NEXT
+#undef NEXT_BLOCK
+#undef DISPATCH
+#undef FUSE
+#undef ENTER_BLOCK
+#undef DISPATCHED
+#undef CHECK_BUDGET
+#undef LEAVE
+#undef ADVANCE
+#undef ADVANCE_BLOCK
+#undef CHECK_IP
+#undef FETCH
+#undef RAISE
+#undef INTEGER_OP
+#undef FLOAT_OP
+#undef COMPARE_OP
+#undef BITWISE_OP
+#undef CHECK_RANGE
+#undef CHECK_ACCESS
+#undef CHECK_BLOCK
+#undef CHECK_FIXED_RANGE
+#undef TRACE_COPY
+#undef TRACE_FILL
+#undef COUNT_FUSED
+#undef FUSED_COMPARE_JZ
+#undef FUSED_LOADI_INTEGER_OP
+#undef FUSED_LOADI_FLAG_OP
+#undef WRITE_REG
+#undef WIDTH_HANDLER
+#undef MOVE_WIDTH
+#undef INTEGER_WIDTH
+#undef UNARY_WIDTH
+#undef LOAD_WIDTH
+#undef PUSH_WIDTH
+#undef POP_WIDTH
+#undef READ_WIDTH
+#undef VERIFIED_READ_WIDTH
+#undef VERIFIED
+#undef READCS
+#undef WRITEC
+#undef WRITECS
+#undef COPYC